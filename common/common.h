@@ -12,9 +12,42 @@
 #define CMD_BOOTLOADER	(3 << CMD_FLAG_BITS)
 #define CMD_COUNTER	(4 << CMD_FLAG_BITS)
 #define CMD_SET_WAIT	(5 << CMD_FLAG_BITS)
+// CMD_CAPS | CMD_FLAG_W | CMD_FLAG_R | CMD_FLAG_B, the payload is ignored,
+// the reply is BULK_SIZE words, CAPS_W_* below
+// a uCSIO without it echoes the payload back, so it is sent all 0
+#define CMD_CAPS	(6 << CMD_FLAG_BITS)
+// CMD_XFER with a word count, the byte right after the command, up to
+// CAPS_W_BULK_MAX, then that many words if CMD_FLAG_W, replies if CMD_FLAG_R
+// CMD_FLAG_B must be set, only if CMD_CAPS lists CAPS_F_XFERN
+#define CMD_XFERN	(7 << CMD_FLAG_BITS)
 
 #define BULK_SIZE 8 // u32[8]
 
+// the CMD_CAPS reply, word by word
+#define CAPS_W_MAGIC	0 // CAPS_MAGIC
+#define CAPS_W_VERSION	1 // UCSIO_VERSION of the firmware
+#define CAPS_W_MCU	2 // CAPS_MCU_* in the low byte, CAPS_BOARD_* in the next
+#define CAPS_W_EP	3 // CDC endpoint sizes in bytes, IN (to the PC) low half, OUT high
+#define CAPS_W_BULK_MAX	4 // words per CMD_XFERN
+#define CAPS_W_RAM	5 // free SRAM in bytes
+#define CAPS_W_FEATURES	6 // optional commands, CAPS_F_*
+#define CAPS_MAGIC	0x53504143 // "CAPS"
+// 0 is everything before CMD_CAPS
+#define UCSIO_VERSION	1
+
+#define CAPS_MCU_ATMEGA32U4	1
+#define CAPS_MCU_AT90USB1286	2
+#define CAPS_MCU_AT90USB162	3
+#define CAPS_MCU_EMU		0xff
+#define CAPS_BOARD_TEENSY	1
+#define CAPS_BOARD_LEONARDO	2
+#define CAPS_BOARD_EMU		0xff
+
+#define CAPS_F_COUNTER		1
+#define CAPS_F_SET_WAIT		2
+#define CAPS_F_BOOTLOADER	4
+#define CAPS_F_XFERN		8
+
 #define AGB_BUF_SIZE 0x20000 // 128K(*u8)
 
 // these are shared between DFAGB and PC
@@ -30,6 +63,11 @@
 #define DF_CMD_DOWNLOAD		(2 << 24)
 // read fsm_p0, like the return value of crc32
 #define DF_CMD_READ		(3 << 24)
+// read the build id, like DF_CMD_READ, used by the PC to tell whether the
+// DFAGB already running is the one it was going to multiboot
+// the build id is the CRC32 of the string starting with DF_BUILD_TAG in the ROM, NUL excluded
+#define DF_CMD_BUILD		(4 << 24)
+#define DF_BUILD_TAG		"DFAGB build "
 // these are WORKER commands, FSM will block(return busy) until worker finishes them in main loop
 #define DF_CMD_CRC32		(0x10 << 24) // length (of u8)
 // save
@@ -48,9 +86,39 @@
 #define DF_CMD_ERASE		(0x42 << 24)
 #define DF_CMD_PROGRAM		(0x43 << 24)
 
+/*
+DFAGB protocol v2
+===
+the single word commands above all stay, v2 adds frames of worker commands
+with full 32 bit arguments, run one after the other, their results are
+matched to the commands by sequence number
+	DF_CMD_PROTO		the next reply is DF_PROTO_V2, an older DFAGB answers IDLE
+	DF_CMD_FRAME | n	n commands follow, 1..DF_FRAME_MAX, DF_FRAME_WORDS each:
+		id | seq << 8	DF_CMD_* >> 24 of a worker command, a sequence number
+		offset		cart offset in bytes
+		length		length in bytes, AGB_BUF_SIZE at most
+	checksum		~ the sum of all words from DF_CMD_FRAME on
+the reply after the checksum is BUSY if the frame was taken, DF_STATE_NAK if
+it was dropped for its checksum, count or ids, none of it runs then
+NOPs are answered BUSY until the last command is done, like a single worker
+	DF_CMD_RESULT		the next reply is DF_RESULT | id << 8 | seq of the
+				oldest result not read yet, the one after its value,
+				IDLE or BUSY and 0 if there is none
+a new frame drops the results nobody read
+*/
+#define DF_CMD_FRAME		(5 << 24)
+#define DF_CMD_RESULT		(6 << 24)
+#define DF_CMD_PROTO		(7 << 24)
+#define DF_FRAME_MAX		8
+#define DF_FRAME_WORDS		3
+#define DF_PROTO_V2		0x32564644 // "DFV2"
+#define DF_RESULT		0x52000000 // 'R' in the top byte
+#define DF_RESULT_MASK		0xff000000
+
 #define MULTIBOOT_PING		0x00006202
 
 // this is the 4CC status code PC will read from DFAGB via SIO
 #define DF_STATE_IDLE	0x454c4449 // "IDLE"
 #define DF_STATE_BUSY	0x59535542 // "BUSY"
+#define DF_STATE_NAK	0x214b414e // "NAK!", a v2 frame was dropped
 
@@ -13,6 +13,9 @@
 #include "../../common/crc32.h"
 
 const char sTitle[] = "DFAGB - Dumper/Flasher for GBA build %s %s\n";
+// see DF_CMD_BUILD, new on every build
+const char sBuild[] = DF_BUILD_TAG __DATE__ " " __TIME__;
+u32 build_id;
 
 void irq_keypad(void){
 	SystemCall(0x26);
@@ -29,11 +32,22 @@ u32 crc32_table[CRC32_TABLE_LEN];
 #define FSM_UPLOADING	1
 #define FSM_DOWNLOADING	2
 #define FSM_READING	3
+#define FSM_FRAME	4
+#define FSM_RESULT	5
 #define FSM_WORKER	0x10
 // if I don't declare this as volatile, worker never wakes up
 // some ridiculous compiler stunts?
 vu32 fsm_state, fsm_p0, fsm_p1, fsm_p3, fsm_p4;
 
+// protocol v2, the commands of the last frame and their results
+// job_n is 0 while the worker runs a single word command
+struct job {
+	u32 id_seq, offset, length;
+};
+struct job jobs[DF_FRAME_MAX];
+u32 results[DF_FRAME_MAX][2];
+vu32 job_n, result_n, result_i, frame_sum;
+
 IWRAM_CODE void start_serial(u32 out32){
 	REG_SIODATA32 = out32;
 	REG_SIOCNT &= ~(SIO_SO_HIGH);
@@ -87,7 +101,78 @@ worker example
 	out = idle
 <nop>		<->	<IDLE>
 
+v2 frame of 2 commands, see common.h
+===
+	s == idle, out == idle
+05000002	<->	<IDLE>
+	s = frame, p0 = 2 * 3 words to come, p1 = 0
+00000130	<->	<IDLE>
+	dump, seq 1
+00020000	<->	<IDLE>
+00020000	<->	<IDLE>
+00000210	<->	<IDLE>
+	CRC32, seq 2
+00000000	<->	<IDLE>
+00020000	<->	<IDLE>
+	p1 == p0
+<checksum>	<->	<IDLE>
+	out = <BUSY> and s = worker, or out = <NAK!> and s = idle
+<nop>		<->	<BUSY>
+...
+<nop>		<->	<IDLE>
+06000000	<->	<IDLE>
+	out = 'R' | 0x30 << 8 | 1, s = result
+<nop>		<->	52003001
+	out = value
+<nop>		<->	<value>
 */
+
+#define CART_BASE 0x08000000 // ends @ 0x09ffffff
+#define CART_SIZE 0x02000000
+
+// a worker command, as v2 knows them
+static int job_valid(u32 id){
+	switch(id << 24){
+		case DF_CMD_CRC32:
+		case DF_CMD_READ_SRAM:
+		case DF_CMD_WRITE_SRAM:
+		case DF_CMD_READ_FLASH:
+		case DF_CMD_WRITE_FLASH:
+		case DF_CMD_READ_EEPROM:
+		case DF_CMD_WRITE_EEPROM:
+		case DF_CMD_DUMP:
+		case DF_CMD_VERIFY:
+		case DF_CMD_ID:
+		case DF_CMD_UNLOCK:
+		case DF_CMD_ERASE:
+		case DF_CMD_PROGRAM:
+			return 1;
+	}
+	return 0;
+}
+
+// a whole frame is in, it runs or it is dropped
+IWRAM_CODE static u32 frame_done(u32 checksum){
+	u32 i;
+	fsm_state = FSM_IDLE;
+	if(checksum != ~frame_sum){
+		iprintf("\nframe checksum mismatch");
+		return DF_STATE_NAK;
+	}
+	for(i = 0; i < fsm_p0 / DF_FRAME_WORDS; ++i){
+		if(!job_valid(jobs[i].id_seq & 0xff) || jobs[i].length > AGB_BUF_SIZE
+				|| jobs[i].offset >= CART_SIZE){
+			iprintf("\ninvalid frame command 0x%08x", jobs[i].id_seq);
+			return DF_STATE_NAK;
+		}
+	}
+	job_n = fsm_p0 / DF_FRAME_WORDS;
+	result_n = 0;
+	result_i = 0;
+	fsm_state = FSM_WORKER;
+	return DF_STATE_BUSY;
+}
+
 IWRAM_CODE void irq_serial(void){
 	u32 in32 = REG_SIODATA32, out32 = DF_STATE_IDLE;
 	switch(fsm_state){
@@ -121,6 +206,36 @@ IWRAM_CODE void irq_serial(void){
 					out32 = fsm_p0;
 					fsm_state = FSM_READING;
 					break;
+				case DF_CMD_BUILD:
+					out32 = build_id;
+					fsm_state = FSM_READING;
+					break;
+				case DF_CMD_PROTO:
+					out32 = DF_PROTO_V2;
+					fsm_state = FSM_READING;
+					break;
+				case DF_CMD_FRAME:
+					fsm_p1 = in32 & DF_PARAM_MASK;
+					if(fsm_p1 == 0 || fsm_p1 > DF_FRAME_MAX){
+						iprintf("\ninvalid frame 0x%08x", in32);
+						out32 = DF_STATE_NAK;
+						break;
+					}
+					// words to come, the checksum excluded
+					fsm_p0 = fsm_p1 * DF_FRAME_WORDS;
+					fsm_p1 = 0;
+					frame_sum = in32;
+					fsm_state = FSM_FRAME;
+					break;
+				case DF_CMD_RESULT:
+					if(result_i < result_n){
+						out32 = results[result_i][0];
+						fsm_p1 = results[result_i++][1];
+					}else{
+						fsm_p1 = 0;
+					}
+					fsm_state = FSM_RESULT;
+					break;
 				case DF_CMD_CRC32:
 				case DF_CMD_READ_SRAM:
 				case DF_CMD_WRITE_SRAM:
@@ -135,6 +250,7 @@ IWRAM_CODE void irq_serial(void){
 				case DF_CMD_ERASE:
 				case DF_CMD_PROGRAM:
 					fsm_p0 = in32;
+					job_n = 0;
 					out32 = DF_STATE_BUSY;
 					fsm_state = FSM_WORKER;
 					// iprintf("\nworker command: 0x%08x", in32);
@@ -167,6 +283,18 @@ IWRAM_CODE void irq_serial(void){
 		case FSM_READING:
 			fsm_state = FSM_IDLE;
 			break;
+		case FSM_FRAME:
+			if(fsm_p1 == fsm_p0){
+				out32 = frame_done(in32);
+				break;
+			}
+			((u32*)jobs)[fsm_p1++] = in32;
+			frame_sum += in32;
+			break;
+		case FSM_RESULT:
+			out32 = fsm_p1;
+			fsm_state = FSM_IDLE;
+			break;
 		case FSM_WORKER:
 			out32 = DF_STATE_BUSY;
 			break;
@@ -174,7 +302,6 @@ IWRAM_CODE void irq_serial(void){
 	start_serial(out32);
 }
 
-#define CART_BASE 0x08000000 // ends @ 0x09ffffff
 
 // based on Intel 28FxxxJ3D datasheet
 
@@ -203,10 +330,10 @@ IWRAM_CODE void irq_serial(void){
 #define READ32(_ADDR)		(*(vu32*)(_ADDR))
 
 u32 cart_id(u32 offset){
-	// since we have only 24 bit parameter space
-	// and the offset should be able to cover the entire ROM length 0x02000000
-	// the offset is shifted 8 bits
-	offset = CART_BASE + (offset << 8);
+	// offsets are in bytes, the single word commands have only 24 bit
+	// parameter space to cover the entire ROM length 0x02000000,
+	// worker shifts theirs 8 bits
+	offset = CART_BASE + offset;
 	WRITE16(offset, I28F_RIC);
 	u8 m = READ16(offset), d = READ16(offset + 2);
 	iprintf("\nManufacture/Device: %02x, %02x", m, d);
@@ -244,7 +371,7 @@ IWRAM_CODE u32 cart_wait_wsms(u32 offset, u16 command){
 
 u32 cart_unlock(u32 offset){
 	// unlock is chip wise and erase is block wise, so they are separated
-	offset = CART_BASE + (offset << 8);
+	offset = CART_BASE + offset;
 	// TODO: if no block is locked...
 	iprintf("\nunlocking 0x%08x", offset);
 	WRITE16(offset, I28F_BLB);
@@ -261,7 +388,7 @@ u32 cart_unlock(u32 offset){
 }
 
 u32 cart_erase(u32 offset){
-	offset = CART_BASE + (offset << 8);
+	offset = CART_BASE + offset;
 	iprintf("\nerasing 0x%08x", offset);
 	WRITE16(offset, I28F_BE);
 	WRITE16(offset, I28F_CONFIRM);
@@ -278,7 +405,7 @@ u32 cart_erase(u32 offset){
 
 IWRAM_CODE u32 cart_program(u32 offset){
 	u32 o1, o2, sr;
-	offset = CART_BASE + (offset << 8);
+	offset = CART_BASE + offset;
 	iprintf("\nprogramming 0x%08x", offset);
 	// caution these are 16 bit wise operations but o1/o2 are byte offset
 	for(o1 = 0; o1 < AGB_BUF_SIZE; o1 += (I28F_WB_SIZE << 1)){
@@ -305,7 +432,7 @@ IWRAM_CODE u32 cart_program(u32 offset){
 
 void cart_dump(u32 offset){
 	u32 o1;
-	offset = CART_BASE + (offset << 8);
+	offset = CART_BASE + offset;
 	iprintf("\ndumping 0x%08x", offset);
 	for(o1 = 0; o1 < AGB_BUF_SIZE; o1 += 2){
 		WRITE16(buf + o1, READ16(offset + o1));
@@ -313,10 +440,10 @@ void cart_dump(u32 offset){
 	iprintf(", done");
 }
 
-void cart_verify(u32 offset){
+u32 cart_verify(u32 offset){
 	u32 o1;
 	u16 cmp = 0;
-	offset = CART_BASE + (offset << 8);
+	offset = CART_BASE + offset;
 	iprintf("\ncomparing 0x%08x", offset);
 	for(o1 = 0; o1 < AGB_BUF_SIZE; o1 += 2){
 		cmp = READ16(buf + o1) - READ16(offset + o1);
@@ -325,7 +452,7 @@ void cart_verify(u32 offset){
 		}
 	}
 	iprintf(", %d", cmp);
-	fsm_p0 = cmp;
+	return cmp;
 }
 
 void read_sram(u32 length){
@@ -451,52 +578,75 @@ void read_flash(u32 length){
 void write_flash(u32 length){
 }
 
-void worker(void){
-	switch(fsm_p0 & DF_CMD_MASK){
+// one worker command, the value is what DF_CMD_READ returns afterwards
+u32 run(u32 cmd, u32 offset, u32 length){
+	u32 r = 0;
+	switch(cmd){
 		case DF_CMD_CRC32:
-			iprintf("\nCRC32(0x%06x)", fsm_p0 & DF_PARAM_MASK);
-			fsm_p0 = crc32(crc32_table, 0, (const void *)buf, fsm_p0 & DF_PARAM_MASK);
-			iprintf(": 0x%08x", fsm_p0);
+			iprintf("\nCRC32(0x%06x)", length);
+			r = crc32(crc32_table, 0, (const void *)buf, length);
+			iprintf(": 0x%08x", r);
 			break;
 		case DF_CMD_ID:
-			fsm_p0 = cart_id(fsm_p0 & DF_PARAM_MASK);
+			r = cart_id(offset);
 			break;
 		case DF_CMD_UNLOCK:
-			fsm_p0 = cart_unlock(fsm_p0 & DF_PARAM_MASK);
+			r = cart_unlock(offset);
 			break;
 		case DF_CMD_ERASE:
-			fsm_p0 = cart_erase(fsm_p0 & DF_PARAM_MASK);
+			r = cart_erase(offset);
 			break;
 		case DF_CMD_PROGRAM:
-			fsm_p0 = cart_program(fsm_p0 & DF_PARAM_MASK);
+			r = cart_program(offset);
 			break;
 		case DF_CMD_DUMP:
-			cart_dump(fsm_p0 & DF_PARAM_MASK);
+			cart_dump(offset);
 			break;
 		case DF_CMD_VERIFY:
-			cart_verify(fsm_p0 & DF_PARAM_MASK);
+			r = cart_verify(offset);
 			break;
 		case DF_CMD_READ_SRAM:
-			read_sram(fsm_p0 & DF_PARAM_MASK);
+			read_sram(length);
 			break;
 		case DF_CMD_WRITE_SRAM:
-			write_sram(fsm_p0 & DF_PARAM_MASK);
+			write_sram(length);
 			break;
 		case DF_CMD_READ_EEPROM:
-			read_eeprom(fsm_p0 & DF_PARAM_MASK);
+			read_eeprom(length);
 			break;
 		case DF_CMD_WRITE_EEPROM:
-			write_eeprom(fsm_p0 & DF_PARAM_MASK);
+			write_eeprom(length);
 			break;
 		case DF_CMD_READ_FLASH:
-			read_flash(fsm_p0 & DF_PARAM_MASK);
+			read_flash(length);
 			break;
 		case DF_CMD_WRITE_FLASH:
-			write_flash(fsm_p0 & DF_PARAM_MASK);
+			write_flash(length);
 			break;
 		default:
-			iprintf("\ninvalid worker command: 0x%08x", fsm_p0);
+			iprintf("\ninvalid worker command: 0x%08x", cmd);
+	}
+	return r;
+}
+
+void worker(void){
+	u32 i, p, id;
+	if(!job_n){
+		// the single word command has either, the cart offset shifted 8 bits
+		p = fsm_p0 & DF_PARAM_MASK;
+		fsm_p0 = run(fsm_p0 & DF_CMD_MASK, p << 8, p);
+		fsm_state = FSM_IDLE;
+		return;
+	}
+	for(i = 0; i < job_n; ++i){
+		id = jobs[i].id_seq & 0xff;
+		p = run(id << 24, jobs[i].offset, jobs[i].length);
+		results[i][0] = DF_RESULT | id << 8 | ((jobs[i].id_seq >> 8) & 0xff);
+		results[i][1] = p;
+		result_n = i + 1;
+		fsm_p0 = p;
 	}
+	job_n = 0;
 	fsm_state = FSM_IDLE;
 }
 
@@ -528,6 +678,8 @@ int main(void) {
 	//iprintf("\n%dKB buffer @ 0x%08x", AGB_BUF_SIZE >> 10, (u32)buf);
 
 	init_crc32_table(crc32_table);
+	build_id = crc32(crc32_table, 0, sBuild, sizeof(sBuild) - 1);
+	iprintf("\nbuild id 0x%08x", build_id);
 	iprintf("\nCRC32 table @ 0x%08x", (u32)crc32_table);
 
 	while (1) {
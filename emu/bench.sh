@@ -0,0 +1,26 @@
+#!/bin/sh
+# runs the pc/usbagb benchmark matrix against the emulator, no hardware needed
+# usage: ./bench.sh out.json [baseline.json|-] [emulator options]
+# example: ./bench.sh new.json bench-baseline.json
+# without emulator options the link is a bit faster than the default model,
+# bench-baseline.json was recorded like that
+# both ../pc/build.sh and ./build.sh must have been run
+out=${1:?usage: $0 out.json [baseline.json|-] [emulator options]}
+base=${2:--}
+[ $# -ge 2 ] && shift 2 || shift 1
+tty=/tmp/ucagbemu.$$
+rom=/tmp/ucagbemu.$$.gba
+
+# the emulator doesn't care what it boots, a fixed image keeps runs comparable
+head -c 65536 /dev/zero > $rom
+[ $# -eq 0 ] && set -- -b 100 -s 1000 -l 125
+./ucagbemu -m -L $tty "$@" >/dev/null 2>&1 &
+emu=$!
+while [ ! -e $tty ]; do sleep 0.1; done
+
+../pc/usbagb $tty bench "$out" "$base" $rom 2>/dev/null
+r=$?
+
+kill $emu
+rm -f $rom
+exit $r
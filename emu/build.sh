@@ -0,0 +1,3 @@
+#!/bin/sh
+# uCSIO + GBA emulator, Linux/POSIX only
+${CC:-cc} -O2 -o ucagbemu emu.c ../pc/gbaencryption.c ../common/crc32.c
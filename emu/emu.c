@@ -0,0 +1,859 @@
+/*
+uCSIO + GBA emulator
+===
+exposes a pty which looks like a uCSIO adapter with a GBA attached,
+so the PC client can run without any hardware
+
+the uC side speaks the common/common.h protocol
+the GBA side is either the BIOS multiboot slave or a running DFAGB
+the timing model is a virtual clock kept in step with the real one:
+	every byte from the host costs usb_byte ns
+	every SIO word costs sio_word ns, plus the set_wait delay
+	DFAGB needs sio_ready ns after every word, a word clocked earlier
+	may come out garbled, the earlier the likelier, see xfer_word
+	every reply reaches the host usb_latency after it was produced
+	DFAGB workers start at the next VBlank and take a configurable time,
+	the commands of a v2 frame back to back
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+
+#include "../common/common.h"
+#include "../common/crc32.h"
+#include "../pc/gbaencryption.h"
+
+typedef unsigned short u16;
+typedef unsigned long long u64;
+
+#define CART_MAX 0x2000000
+#define SAVE_MAX 0x20000
+#define VBLANK_NS 16742706ULL
+
+// timing, in ns
+static u64 usb_byte = 1000, usb_latency = 1000000, sio_word = 12000, sio_nop = 250, sio_ready;
+// garble chance of a word clocked with no time at all for DFAGB to get ready
+static double sio_early = 0.001;
+static u64 t_crc = 110000000, t_dump = 30000000, t_verify = 40000000;
+static u64 t_erase = 800000000, t_program = 250000000, t_unlock = 5000000, t_save = 20000000;
+static u32 cart_id = 0x00890018;
+static int verbose;
+
+static int master;
+static u32 crc32_table[CRC32_TABLE_LEN];
+
+static u64 now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// virtual clock, never behind the real one while we are waiting for input
+static u64 vt;
+
+/*
+host side
+===
+replies are queued with the time they are due at the host
+*/
+#define OUTQ_LEN 0x1000
+static struct {
+	u64 due;
+	u8 len, data[BULK_SIZE << 2];
+} outq[OUTQ_LEN];
+static uint outq_head, outq_tail;
+
+static void flush_due(void){
+	u64 t = now_ns();
+	u8 buf[0x1000];
+	uint n = 0;
+	while(outq_tail != outq_head && outq[outq_tail % OUTQ_LEN].due <= t){
+		if(n + (BULK_SIZE << 2) > sizeof(buf)){
+			break;
+		}
+		memcpy(buf + n, outq[outq_tail % OUTQ_LEN].data, outq[outq_tail % OUTQ_LEN].len);
+		n += outq[outq_tail % OUTQ_LEN].len;
+		++outq_tail;
+	}
+	if(n && write(master, buf, n) != n){
+		fprintf(stderr, "short write to the pty\n");
+	}
+}
+
+// ms until the next reply is due, -1 if none
+static int next_due(void){
+	u64 t = now_ns();
+	if(outq_tail == outq_head){
+		return -1;
+	}
+	if(outq[outq_tail % OUTQ_LEN].due <= t){
+		return 0;
+	}
+	return (outq[outq_tail % OUTQ_LEN].due - t) / 1000000 + 1;
+}
+
+// CMD_XFERN replies are longer than an entry, they take several
+static void reply(const void *data, uint len){
+	const u8 *p = data;
+	uint n;
+	for(; len; len -= n, p += n){
+		n = len < sizeof(outq[0].data) ? len : sizeof(outq[0].data);
+		while(outq_head - outq_tail >= OUTQ_LEN){
+			flush_due();
+			usleep(100);
+		}
+		outq[outq_head % OUTQ_LEN].due = vt + usb_latency;
+		outq[outq_head % OUTQ_LEN].len = n;
+		memcpy(outq[outq_head % OUTQ_LEN].data, p, n);
+		++outq_head;
+	}
+}
+
+// let the real clock catch up with the virtual one, keep replies flowing meanwhile
+static void advance(u64 ns){
+	u64 t, now;
+	struct timespec ts;
+	vt += ns;
+	while(1){
+		flush_due();
+		now = now_ns();
+		if(vt < now + 200000){
+			break;
+		}
+		t = vt - now;
+		// wake up in time for the next reply
+		if(outq_tail != outq_head && outq[outq_tail % OUTQ_LEN].due < vt){
+			t = outq[outq_tail % OUTQ_LEN].due > now ? outq[outq_tail % OUTQ_LEN].due - now : 0;
+		}
+		ts.tv_sec = t / 1000000000ULL;
+		ts.tv_nsec = t % 1000000000ULL;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static u8 inbuf[0x10000];
+static uint in_pos, in_len;
+
+static u8 getb(void){
+	struct pollfd pfd;
+	int n;
+	while(in_pos == in_len){
+		flush_due();
+		pfd.fd = master;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, next_due()) <= 0){
+			continue;
+		}
+		n = read(master, inbuf, sizeof(inbuf));
+		if(n <= 0){
+			// EIO while nobody has the slave open
+			usleep(10000);
+			continue;
+		}
+		in_pos = 0;
+		in_len = n;
+		if(vt < now_ns()){
+			vt = now_ns();
+		}
+	}
+	advance(usb_byte);
+	return inbuf[in_pos++];
+}
+
+/*
+GBA side
+===
+*/
+static u8 cart[CART_MAX], save[SAVE_MAX];
+static u32 cart_size;
+static u32 buf32[AGB_BUF_SIZE >> 2];
+#define buf ((u8*)buf32)
+
+// what the GBA put in SIODATA32 for the next transfer
+static u32 sio_out;
+
+// BIOS multiboot slave
+enum { MB_WAIT, MB_HEADER, MB_KEYS, MB_LEN, MB_DATA, MB_CRC, DFAGB };
+static int gba_state = MB_WAIT;
+static uint mb_count, mb_len, mb_pp, mb_cc, mb_rr;
+static struct gbaCrcState mb_crc;
+static struct gbaEncryptionState mb_enc;
+// what was multibooted, decrypted, for the DFAGB build id
+static u8 mb_rom[0x40000];
+static u32 build_id;
+
+// same as the PC side, CRC32 of the DF_BUILD_TAG string
+static u32 rom_build_id(const u8 *rom, uint size){
+	uint n = sizeof(DF_BUILD_TAG) - 1, i, j;
+	for(i = 0; i + n <= size; ++i){
+		if(!memcmp(rom + i, DF_BUILD_TAG, n)){
+			for(j = i + n; j < size && rom[j]; ++j);
+			return crc32(crc32_table, 0, rom + i, j - i);
+		}
+	}
+	return 0;
+}
+
+static void multiboot_xfer(u32 in32){
+	uint in = in32 & 0xffff, out = 0;
+	switch(gba_state){
+		case MB_WAIT:
+			if(in == 0x6202 || in == 0x6200){
+				out = 0x7202;
+			}else if(in == 0x6100){
+				gba_state = MB_HEADER;
+				mb_count = 0;
+			}else if((in >> 8) == 0x63){
+				gba_state = MB_KEYS;
+				mb_pp = in & 0xff;
+				mb_cc = rand() & 0xff;
+				out = 0x7300 | mb_cc;
+			}
+			break;
+		case MB_HEADER:
+			// 0x60 halfwords
+			out = (0x60 - ++mb_count) << 8 | 0x02;
+			if(mb_count == 0x60){
+				gba_state = MB_WAIT;
+			}
+			break;
+		case MB_KEYS:
+			if((in >> 8) == 0x63){
+				out = 0x7300 | mb_cc;
+			}else if((in >> 8) == 0x64){
+				mb_rr = rand() & 0xff;
+				out = 0x7300 | mb_rr;
+				gba_state = MB_LEN;
+			}
+			break;
+		case MB_LEN:
+			mb_len = ((in + 0x34) << 2) + 0xc0;
+			if(verbose){
+				fprintf(stderr, "multiboot: %u bytes\n", mb_len);
+			}
+			gbaCrcInit(((0x7300 | mb_cc) + 0x0f) & 0xff, mb_rr, &mb_crc);
+			gbaEncryptionInit((0x7300 | mb_cc) << 8 | 0xffff0000 | mb_pp, &mb_enc);
+			mb_count = 0xc0;
+			gba_state = MB_DATA;
+			out = 0x7300 | mb_rr;
+			break;
+		case MB_DATA:
+			in32 = gbaEncrypt(in32, mb_count, &mb_enc);
+			gbaCrcAdd(in32, &mb_crc);
+			if(mb_count + 4 <= sizeof(mb_rom)){
+				memcpy(mb_rom + mb_count, &in32, 4);
+			}
+			mb_count += 4;
+			if(mb_count >= mb_len){
+				gba_state = MB_CRC;
+			}
+			sio_out = 0;
+			return;
+		case MB_CRC:
+			if(in == 0x0065){
+				out = 0x0075;
+			}else if(in == 0x0066){
+				gbaCrcFinalize(0x0075, &mb_crc);
+				out = mb_crc.crc & 0xffff;
+			}else if(in == (mb_crc.crc & 0xffff)){
+				fprintf(stderr, "multiboot: checksum 0x%04x ok, DFAGB running\n", in);
+				gba_state = DFAGB;
+				build_id = rom_build_id(mb_rom, mb_len < sizeof(mb_rom) ? mb_len : sizeof(mb_rom));
+				sio_out = DF_STATE_IDLE;
+				return;
+			}else{
+				fprintf(stderr, "multiboot: checksum 0x%04x != 0x%04x\n", in, mb_crc.crc & 0xffff);
+				gba_state = MB_WAIT;
+			}
+			break;
+	}
+	sio_out = out << 16;
+}
+
+// DFAGB, see dfagb/source/dfagb.c, same FSM
+#define FSM_IDLE	0
+#define FSM_UPLOADING	1
+#define FSM_DOWNLOADING	2
+#define FSM_READING	3
+#define FSM_FRAME	4
+#define FSM_RESULT	5
+#define FSM_WORKER	0x10
+static u32 fsm_state, fsm_p0, fsm_p1;
+static u64 worker_done;
+// 1 for a DFAGB from before protocol v2
+static int proto = 2;
+static struct {
+	u32 id_seq, offset, length;
+} jobs[DF_FRAME_MAX];
+static u32 results[DF_FRAME_MAX][2], job_n, result_n, result_i, frame_sum;
+
+static u32 cart_offset(u32 offset){
+	return offset % (cart_size ? cart_size : CART_MAX) & ~(AGB_BUF_SIZE - 1);
+}
+
+// the effect of a worker command, the value DF_CMD_READ returns afterwards
+static u32 run(u32 cmd, u32 offset, u32 length){
+	u32 o, i, ok, r = 0;
+	u16 a, b;
+	switch(cmd){
+		case DF_CMD_CRC32:
+			r = crc32(crc32_table, 0, buf, length > AGB_BUF_SIZE ? AGB_BUF_SIZE : length);
+			break;
+		case DF_CMD_ID:
+			r = cart_id;
+			break;
+		case DF_CMD_UNLOCK:
+			r = 0x80;
+			break;
+		case DF_CMD_ERASE:
+			memset(cart + cart_offset(offset), 0xff, AGB_BUF_SIZE);
+			r = 0x80;
+			break;
+		case DF_CMD_PROGRAM:
+			// flash can only clear bits
+			o = cart_offset(offset);
+			for(i = 0, ok = 1; i < AGB_BUF_SIZE; ++i){
+				cart[o + i] &= buf[i];
+				ok &= cart[o + i] == buf[i];
+			}
+			r = ok ? 0x80 : 0x90;
+			break;
+		case DF_CMD_DUMP:
+			memcpy(buf, cart + cart_offset(offset), AGB_BUF_SIZE);
+			break;
+		case DF_CMD_VERIFY:
+			o = cart_offset(offset);
+			for(i = 0; i < AGB_BUF_SIZE; i += 2){
+				memcpy(&a, buf + i, 2);
+				memcpy(&b, cart + o + i, 2);
+				if(a != b){
+					r = (u16)(a - b);
+					break;
+				}
+			}
+			break;
+		case DF_CMD_READ_SRAM:
+		case DF_CMD_READ_EEPROM:
+			memcpy(buf, save, length > SAVE_MAX ? SAVE_MAX : length);
+			break;
+		case DF_CMD_WRITE_SRAM:
+		case DF_CMD_WRITE_EEPROM:
+			memcpy(save, buf, length > SAVE_MAX ? SAVE_MAX : length);
+			break;
+		default:
+			break;
+	}
+	return r;
+}
+
+// runs when its time has come, a frame all at once
+static void worker(void){
+	u32 i, p, id;
+	if(!job_n){
+		p = fsm_p0 & DF_PARAM_MASK;
+		fsm_p0 = run(fsm_p0 & DF_CMD_MASK, p << 8, p);
+	}
+	for(i = 0; i < job_n; ++i){
+		id = jobs[i].id_seq & 0xff;
+		p = run(id << 24, jobs[i].offset, jobs[i].length);
+		results[i][0] = DF_RESULT | id << 8 | ((jobs[i].id_seq >> 8) & 0xff);
+		results[i][1] = p;
+		result_n = i + 1;
+		fsm_p0 = p;
+	}
+	job_n = 0;
+	fsm_state = FSM_IDLE;
+}
+
+static u64 worker_time(u32 cmd, u32 length){
+	switch(cmd){
+		case DF_CMD_CRC32:
+			return t_crc * length / AGB_BUF_SIZE;
+		case DF_CMD_DUMP:
+			return t_dump;
+		case DF_CMD_VERIFY:
+			return t_verify;
+		case DF_CMD_ERASE:
+			return t_erase;
+		case DF_CMD_PROGRAM:
+			return t_program;
+		case DF_CMD_UNLOCK:
+			return t_unlock;
+		case DF_CMD_ID:
+			return 0;
+		default:
+			return t_save;
+	}
+}
+
+static int job_valid(u32 id){
+	switch(id << 24){
+		case DF_CMD_CRC32:
+		case DF_CMD_READ_SRAM:
+		case DF_CMD_WRITE_SRAM:
+		case DF_CMD_READ_FLASH:
+		case DF_CMD_WRITE_FLASH:
+		case DF_CMD_READ_EEPROM:
+		case DF_CMD_WRITE_EEPROM:
+		case DF_CMD_DUMP:
+		case DF_CMD_VERIFY:
+		case DF_CMD_ID:
+		case DF_CMD_UNLOCK:
+		case DF_CMD_ERASE:
+		case DF_CMD_PROGRAM:
+			return 1;
+	}
+	return 0;
+}
+
+static u32 frame_done(u32 checksum){
+	u64 t = 0;
+	u32 i;
+	fsm_state = FSM_IDLE;
+	if(checksum != ~frame_sum){
+		fprintf(stderr, "DFAGB: frame checksum 0x%08x != 0x%08x\n", checksum, ~frame_sum);
+		return DF_STATE_NAK;
+	}
+	for(i = 0; i < fsm_p0 / DF_FRAME_WORDS; ++i){
+		if(!job_valid(jobs[i].id_seq & 0xff) || jobs[i].length > AGB_BUF_SIZE
+				|| jobs[i].offset >= CART_MAX){
+			fprintf(stderr, "DFAGB: invalid frame command 0x%08x\n", jobs[i].id_seq);
+			return DF_STATE_NAK;
+		}
+		t += worker_time(jobs[i].id_seq << 24, jobs[i].length);
+	}
+	job_n = fsm_p0 / DF_FRAME_WORDS;
+	result_n = 0;
+	result_i = 0;
+	fsm_state = FSM_WORKER;
+	worker_done = (vt / VBLANK_NS + 1) * VBLANK_NS + t;
+	if(verbose){
+		fprintf(stderr, "frame of %u\n", job_n);
+	}
+	return DF_STATE_BUSY;
+}
+
+static void dfagb_xfer(u32 in32){
+	u32 out32 = DF_STATE_IDLE;
+	// the worker in the main loop sets the FSM back to IDLE
+	if(fsm_state == FSM_WORKER && vt >= worker_done){
+		worker();
+	}
+	switch(fsm_state){
+		case FSM_IDLE:
+			switch(in32 & DF_CMD_MASK){
+				case DF_CMD_UPLOAD:
+					fsm_state = FSM_UPLOADING;
+					fsm_p0 = in32 & DF_PARAM_MASK;
+					fsm_p1 = 0;
+					break;
+				case DF_CMD_DOWNLOAD:
+					fsm_state = FSM_DOWNLOADING;
+					fsm_p0 = in32 & DF_PARAM_MASK;
+					fsm_p1 = 0;
+					out32 = buf32[fsm_p1++ % (AGB_BUF_SIZE >> 2)];
+					break;
+				case DF_CMD_READ:
+					out32 = fsm_p0;
+					fsm_state = FSM_READING;
+					break;
+				case DF_CMD_BUILD:
+					out32 = build_id;
+					fsm_state = FSM_READING;
+					break;
+				case DF_CMD_PROTO:
+					if(proto < 2){
+						goto invalid;
+					}
+					out32 = DF_PROTO_V2;
+					fsm_state = FSM_READING;
+					break;
+				case DF_CMD_FRAME:
+					if(proto < 2){
+						goto invalid;
+					}
+					fsm_p1 = in32 & DF_PARAM_MASK;
+					if(fsm_p1 == 0 || fsm_p1 > DF_FRAME_MAX){
+						fprintf(stderr, "DFAGB: invalid frame 0x%08x\n", in32);
+						out32 = DF_STATE_NAK;
+						break;
+					}
+					fsm_p0 = fsm_p1 * DF_FRAME_WORDS;
+					fsm_p1 = 0;
+					frame_sum = in32;
+					fsm_state = FSM_FRAME;
+					break;
+				case DF_CMD_RESULT:
+					if(proto < 2){
+						goto invalid;
+					}
+					if(result_i < result_n){
+						out32 = results[result_i][0];
+						fsm_p1 = results[result_i++][1];
+					}else{
+						fsm_p1 = 0;
+					}
+					fsm_state = FSM_RESULT;
+					break;
+				case DF_CMD_CRC32:
+				case DF_CMD_READ_SRAM:
+				case DF_CMD_WRITE_SRAM:
+				case DF_CMD_READ_FLASH:
+				case DF_CMD_WRITE_FLASH:
+				case DF_CMD_READ_EEPROM:
+				case DF_CMD_WRITE_EEPROM:
+				case DF_CMD_DUMP:
+				case DF_CMD_VERIFY:
+				case DF_CMD_ID:
+				case DF_CMD_UNLOCK:
+				case DF_CMD_ERASE:
+				case DF_CMD_PROGRAM:
+					fsm_p0 = in32;
+					job_n = 0;
+					out32 = DF_STATE_BUSY;
+					fsm_state = FSM_WORKER;
+					// starts at the next VBlank
+					worker_done = (vt / VBLANK_NS + 1) * VBLANK_NS
+						+ worker_time(in32 & DF_CMD_MASK, in32 & DF_PARAM_MASK);
+					if(verbose){
+						fprintf(stderr, "worker 0x%08x\n", in32);
+					}
+					break;
+				default:
+				invalid:
+					if(in32 == MULTIBOOT_PING){
+						fprintf(stderr, "DFAGB: back to BIOS\n");
+						gba_state = MB_WAIT;
+						sio_out = 0;
+						return;
+					}else if(in32 != DF_CMD_NOP){
+						fprintf(stderr, "DFAGB: invalid command 0x%08x\n", in32);
+					}
+					break;
+			}
+			break;
+		case FSM_UPLOADING:
+			buf32[fsm_p1++ % (AGB_BUF_SIZE >> 2)] = in32;
+			if(fsm_p1 >= fsm_p0){
+				fsm_state = FSM_IDLE;
+			}
+			break;
+		case FSM_DOWNLOADING:
+			if(fsm_p1 < fsm_p0){
+				out32 = buf32[fsm_p1++ % (AGB_BUF_SIZE >> 2)];
+			}else{
+				fsm_state = FSM_IDLE;
+			}
+			break;
+		case FSM_READING:
+			fsm_state = FSM_IDLE;
+			break;
+		case FSM_FRAME:
+			if(fsm_p1 == fsm_p0){
+				out32 = frame_done(in32);
+				break;
+			}
+			((u32*)jobs)[fsm_p1++] = in32;
+			frame_sum += in32;
+			break;
+		case FSM_RESULT:
+			out32 = fsm_p1;
+			fsm_state = FSM_IDLE;
+			break;
+		case FSM_WORKER:
+			out32 = DF_STATE_BUSY;
+			break;
+	}
+	sio_out = out32;
+}
+
+/*
+uC side
+===
+*/
+#define BULK_MAX 255
+static u32 data, buffer[BULK_MAX], c_r, c_w, c_x;
+// words per CMD_XFERN, 0 is a uCSIO from before CMD_CAPS
+static uint bulk_max = 64;
+static u8 wait_p0, wait_p1;
+
+// when DFAGB's SIO interrupt is done with the last word
+static u64 sio_ready_at;
+
+static u32 xfer_word(u32 in32){
+	u32 out32 = sio_out;
+	u64 early = 0;
+	if(wait_p0 == 1){
+		// the handshake, SI goes low once DFAGB is ready
+		advance(vt < sio_ready_at ? sio_ready_at - vt : 0);
+	}else if(wait_p0 > 1){
+		advance(wait_p0 * sio_nop);
+	}
+	if(vt < sio_ready_at){
+		early = sio_ready_at - vt;
+	}
+	advance(sio_word);
+	if(gba_state == DFAGB){
+		sio_ready_at = vt + sio_ready;
+		// one bit off, on either side
+		if(early && rand() < sio_early * RAND_MAX * early / sio_ready){
+			if(rand() & 1){
+				in32 ^= 1u << (rand() & 31);
+			}else{
+				out32 ^= 1u << (rand() & 31);
+			}
+		}
+		dfagb_xfer(in32);
+	}else{
+		multiboot_xfer(in32);
+	}
+	return out32;
+}
+
+static void read_data(u8 *p, uint n){
+	uint i;
+	for(i = 0; i < n; ++i){
+		p[i] = getb();
+	}
+	c_r += n;
+}
+
+static void caps(void){
+	memset(buffer, 0, BULK_SIZE << 2);
+	buffer[CAPS_W_MAGIC] = CAPS_MAGIC;
+	buffer[CAPS_W_VERSION] = UCSIO_VERSION;
+	buffer[CAPS_W_MCU] = CAPS_MCU_EMU | CAPS_BOARD_EMU << 8;
+	buffer[CAPS_W_EP] = 64 | 64 << 16;
+	buffer[CAPS_W_BULK_MAX] = bulk_max;
+	buffer[CAPS_W_RAM] = 0x800;
+	buffer[CAPS_W_FEATURES] = CAPS_F_COUNTER | CAPS_F_SET_WAIT | CAPS_F_BOOTLOADER | CAPS_F_XFERN;
+}
+
+static void serve(void){
+	u8 cmd, bulk;
+	uint k, n;
+	while(1){
+		cmd = getb();
+		bulk = cmd & CMD_FLAG_B;
+		n = BULK_SIZE;
+		// the old firmware has no such command, it takes no count either
+		if(bulk_max && (cmd & CMD_MASK) == CMD_XFERN){
+			n = getb();
+			++c_r;
+			if(n > bulk_max){
+				n = bulk_max;
+			}
+		}
+		if(cmd & CMD_FLAG_W){
+			if(bulk){
+				read_data((u8*)buffer, n << 2);
+			}else{
+				read_data((u8*)&data, 4);
+			}
+		}
+		switch(cmd & CMD_MASK){
+			case CMD_XFER:
+				if(bulk){
+					for(k = 0; k < BULK_SIZE; ++k){
+						buffer[k] = xfer_word(buffer[k]);
+					}
+					c_x += BULK_SIZE << 2;
+				}else{
+					data = xfer_word(data);
+					c_x += 4;
+				}
+				break;
+			case CMD_XFERN:
+				if(bulk_max){
+					for(k = 0; k < n; ++k){
+						buffer[k] = xfer_word(buffer[k]);
+					}
+					c_x += n << 2;
+				}
+				break;
+			case CMD_CAPS:
+				if(bulk_max){
+					caps();
+				}
+				break;
+			case CMD_PING:
+				data = ~data;
+				// the LED blink
+				advance(10000000);
+				break;
+			case CMD_BOOTLOADER:
+				fprintf(stderr, "uC: reset to bootloader, ignored\n");
+				break;
+			case CMD_COUNTER:
+				buffer[0] = c_r;
+				buffer[1] = c_w;
+				buffer[2] = c_x;
+				c_r = 0; c_w = 0; c_x = 0;
+				break;
+			case CMD_SET_WAIT:
+				wait_p0 = (u8)(data & 0xff);
+				wait_p1 = (u8)((data >> 8) & 0xff);
+				if(verbose){
+					fprintf(stderr, "uC: set_wait(%d, %d)\n", wait_p0, wait_p1);
+				}
+				break;
+		}
+		if(cmd & CMD_FLAG_R){
+			if(bulk){
+				reply(buffer, n << 2);
+				c_w += n << 2;
+			}else{
+				reply(&data, 4);
+				c_w += 4;
+			}
+		}
+	}
+}
+
+static void load_cart(const char *filename){
+	FILE *f = fopen(filename, "rb");
+	if(!f){
+		fprintf(stderr, "failed to open \"%s\" for read\n", filename);
+		exit(-1);
+	}
+	cart_size = fread(cart, 1, CART_MAX, f);
+	fclose(f);
+	// round up to a whole flash block, the rest reads as erased
+	cart_size = (cart_size + AGB_BUF_SIZE - 1) & ~(AGB_BUF_SIZE - 1);
+}
+
+static void load_dfagb(const char *filename){
+	FILE *f = fopen(filename, "rb");
+	uint size;
+	if(!f){
+		fprintf(stderr, "failed to open \"%s\" for read\n", filename);
+		exit(-1);
+	}
+	size = fread(mb_rom, 1, sizeof(mb_rom), f);
+	fclose(f);
+	build_id = rom_build_id(mb_rom, size);
+}
+
+static void usage(const char *name){
+	fprintf(stderr, "usage: %s [options]\n"
+		"\t-r rom.gba\tcart content, default 16MB of pseudo random data\n"
+		"\t-m\t\tstart with DFAGB already running\n"
+		"\t-d dfagb.gba\tstart with this DFAGB already running, for its build id\n"
+		"\t-L path\t\tsymlink the pty to path\n"
+		"\t-i id\t\tflash ID returned by DF_CMD_ID, default 0x%08x\n"
+		"\t-l us\t\tUSB reply latency, default %llu\n"
+		"\t-b ns\t\tUSB cost per byte from the host, default %llu\n"
+		"\t-s ns\t\tSIO word time, default %llu\n"
+		"\t-n ns\t\tset_wait delay per nop loop, default %llu\n"
+		"\t-g ns\t\tDFAGB time to get ready for the next word, default 0\n"
+		"\t-B words\tCMD_XFERN limit, 0 for a uCSIO without CMD_CAPS, default %u\n"
+		"\t-e p\t\tgarble chance of a word clocked right away, with -g, default %g\n"
+		"\t-P 1\t\tDFAGB from before protocol v2, default 2\n"
+		"\t-w name=ms\tworker time, name is crc (per 128KB), dump, verify, erase, program, unlock or save\n"
+		"\t-v\t\tverbose\n",
+		name, cart_id, usb_latency / 1000, usb_byte, sio_word, sio_nop, bulk_max, sio_early);
+	exit(-1);
+}
+
+static void set_worker_time(const char *arg){
+	static const struct { const char *name; u64 *t; } w[] = {
+		{"crc", &t_crc}, {"dump", &t_dump}, {"verify", &t_verify}, {"erase", &t_erase},
+		{"program", &t_program}, {"unlock", &t_unlock}, {"save", &t_save},
+	};
+	const char *eq = strchr(arg, '=');
+	uint i;
+	for(i = 0; eq && i < sizeof(w) / sizeof(w[0]); ++i){
+		if(strlen(w[i].name) == (size_t)(eq - arg) && !strncmp(w[i].name, arg, eq - arg)){
+			*w[i].t = (u64)(atof(eq + 1) * 1000000);
+			return;
+		}
+	}
+	fprintf(stderr, "invalid worker time: %s\n", arg);
+	exit(-1);
+}
+
+int main(int argc, char *argv[]){
+	const char *rom = NULL, *link_path = NULL, *dfagb = NULL, *slave;
+	struct termios tio;
+	int opt, slave_fd;
+	u32 i, x = 0x12345678;
+
+	while((opt = getopt(argc, argv, "r:md:L:i:l:b:s:n:g:e:B:P:w:v")) != -1){
+		switch(opt){
+			case 'r': rom = optarg; break;
+			case 'm': gba_state = DFAGB; break;
+			case 'd': gba_state = DFAGB; dfagb = optarg; break;
+			case 'L': link_path = optarg; break;
+			case 'i': cart_id = strtoul(optarg, NULL, 0); break;
+			case 'l': usb_latency = strtoull(optarg, NULL, 0) * 1000; break;
+			case 'b': usb_byte = strtoull(optarg, NULL, 0); break;
+			case 's': sio_word = strtoull(optarg, NULL, 0); break;
+			case 'n': sio_nop = strtoull(optarg, NULL, 0); break;
+			case 'g': sio_ready = strtoull(optarg, NULL, 0); break;
+			case 'e': sio_early = atof(optarg); break;
+			case 'B':
+				bulk_max = atoi(optarg);
+				if(bulk_max > BULK_MAX){
+					bulk_max = BULK_MAX;
+				}
+				break;
+			case 'P': proto = atoi(optarg); break;
+			case 'w': set_worker_time(optarg); break;
+			case 'v': verbose = 1; break;
+			default: usage(argv[0]);
+		}
+	}
+
+	init_crc32_table(crc32_table);
+	if(rom){
+		load_cart(rom);
+	}else{
+		cart_size = 0x1000000;
+		for(i = 0; i < cart_size; i += 4){
+			x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+			memcpy(cart + i, &x, 4);
+		}
+	}
+	memset(cart + cart_size, 0xff, CART_MAX - cart_size);
+	memset(save, 0xff, SAVE_MAX);
+	if(dfagb){
+		load_dfagb(dfagb);
+	}
+	sio_out = gba_state == DFAGB ? DF_STATE_IDLE : 0;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(master < 0 || grantpt(master) || unlockpt(master)){
+		perror("posix_openpt");
+		return -1;
+	}
+	slave = ptsname(master);
+	// keep the slave open ourselves, so the pty survives between client runs
+	slave_fd = open(slave, O_RDWR | O_NOCTTY);
+	tcgetattr(slave_fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave_fd, TCSANOW, &tio);
+
+	if(link_path){
+		unlink(link_path);
+		if(symlink(slave, link_path)){
+			perror("symlink");
+			return -1;
+		}
+	}
+	printf("%s\n", link_path ? link_path : slave);
+	fflush(stdout);
+	fprintf(stderr, "uCSIO emulator on %s, %s, cart %uMB\n", slave,
+		gba_state == DFAGB ? "DFAGB running" : "waiting for multiboot", cart_size >> 20);
+
+	vt = now_ns();
+	serve();
+	return 0;
+}
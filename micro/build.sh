@@ -0,0 +1,3 @@
+#!/bin/sh
+# host kernel microbenchmarks, Linux/POSIX only
+${CC:-cc} -O2 -pthread -o micro micro.c $(ls ../pc/*.c | grep -v main.c) ../common/crc32.c $(sh ../pc/zflags.sh)
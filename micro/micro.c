@@ -0,0 +1,302 @@
+/*
+host kernel microbenchmarks
+===
+	./micro [filter]
+runs every kernel whose name contains filter, no hardware needed
+each one is timed in batches, the batch size doubles until a batch takes
+at least MICRO_MIN_NS, then MICRO_REPS batches are timed and the median kept,
+reported as time per iteration and bytes per second, or ns per op for the
+ones an iteration of is a number of ops rather than bytes:
+	name                                   size      time/iter    GB/s
+	crc32/byte_table                     128KB       512.000 us   0.256
+	crc32/combine_blocks                256ops        35.840 us  140.0 ns/op
+Linux/POSIX, the kernels are the ones linked into usbagb
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/common.h"
+#include "../common/crc32.h"
+#include "../pc/pl.h"
+#include "../pc/crc.h"
+#include "../pc/frame.h"
+#include "../pc/gbaencryption.h"
+#include "../pc/ucagb.h"
+#include "../pc/zfile.h"
+
+#define MICRO_MIN_NS 50000000ull
+#define MICRO_REPS 5
+#define MB_SIZE 0x40000
+#define ROM_SIZE 0x2000000
+
+struct micro {
+	const char *name;
+	tSize size;
+	void (*run)(tSize size, uint iters);
+	// optional, -1 to skip this one
+	int (*setup)(void);
+	// ops per iteration, 0 if size is what an iteration is
+	u32 ops;
+};
+
+static u8 *data;
+static u32 ref_table[CRC32_TABLE_LEN];
+static struct frame frame;
+static char rom_file[] = "/tmp/microXXXXXX";
+static int rom_made;
+static char gz_file[] = "/tmp/microXXXXXX.gz";
+static int gz_made;
+// keeps the results alive so nothing is optimized away
+static volatile u32 sink;
+
+static void run_crc_byte(tSize size, uint iters){
+	while(iters--){
+		sink ^= crc32(ref_table, iters, data, size);
+	}
+}
+
+static void run_crc_update(tSize size, uint iters){
+	while(iters--){
+		sink ^= crc32_update(iters, data, size);
+	}
+}
+
+static int use_slice8(void){
+	return crc_set_engine("slice8");
+}
+
+static int use_pclmul(void){
+	return crc_set_engine("pclmul");
+}
+
+// the whole ROM CRC from 256 block CRCs
+static void run_crc_combine(tSize size, uint iters){
+	u32 i, crc;
+	while(iters--){
+		for(crc = 0, i = 0; i < size / AGB_BUF_SIZE; ++i){
+			crc = crc32_combine(crc, i ^ iters, AGB_BUF_SIZE);
+		}
+		sink ^= crc;
+	}
+}
+
+// like gba_send_main before the block functions, the data is encrypted in place
+static void run_mb_word(tSize size, uint iters){
+	struct gbaCrcState crc;
+	struct gbaEncryptionState enc;
+	u32 *p, offset;
+	while(iters--){
+		gbaCrcInit(0x12, 0x34, &crc);
+		gbaEncryptionInit(0xffff7381, &enc);
+		for(offset = 0xc0, p = (u32*)&data[offset]; offset < size; offset += 4, ++p){
+			gbaCrcAdd(*p, &crc);
+			*p = gbaEncrypt(*p, offset, &enc);
+		}
+		sink ^= crc.crc;
+	}
+}
+
+static void run_mb_block(tSize size, uint iters){
+	struct gbaCrcState crc;
+	struct gbaEncryptionState enc;
+	while(iters--){
+		gbaCrcInit(0x12, 0x34, &crc);
+		gbaEncryptionInit(0xffff7381, &enc);
+		gbaCrcAddBlock((u32*)&data[0xc0], (size - 0xc0) >> 2, &crc);
+		gbaEncryptBlock((u32*)&data[0xc0], (size - 0xc0) >> 2, 0xc0, &enc);
+		sink ^= crc.crc;
+	}
+}
+
+// packing only, the frame is rewound instead of sent
+static void run_frame_bw(tSize size, uint iters){
+	while(iters--){
+		frame.len = 0;
+		frame_xfer32bw(&frame, data, size, 0);
+	}
+}
+
+static void run_frame_bwn(tSize size, uint iters){
+	while(iters--){
+		frame.len = 0;
+		frame_xfer32bw(&frame, data, size, 64);
+	}
+}
+
+static void run_frame_sbw(tSize size, uint iters){
+	while(iters--){
+		frame.len = 0;
+		frame_xfer32sbw(&frame, data, size);
+	}
+}
+
+// a ROM file in the page cache
+static int make_rom(void){
+	int fd;
+	if(rom_made){
+		return 0;
+	}
+	fd = mkstemp(rom_file);
+	if(fd < 0 || write(fd, data, ROM_SIZE) != ROM_SIZE){
+		perror("mkstemp");
+		return -1;
+	}
+	close(fd);
+	rom_made = 1;
+	return 0;
+}
+
+// the same ROM gzip compressed, skipped without zlib
+static int make_rom_gz(void){
+	struct zfile *z;
+	int fd;
+	if(gz_made){
+		return 0;
+	}
+	fd = mkstemps(gz_file, 3);
+	if(fd < 0){
+		perror("mkstemps");
+		return -1;
+	}
+	close(fd);
+	z = zfile_create(gz_file, 0);
+	if(!z || zfile_write(z, data, ROM_SIZE) | zfile_close(z)){
+		unlink(gz_file);
+		return -1;
+	}
+	gz_made = 1;
+	return 0;
+}
+
+static void run_load(const char *filename, uint iters){
+	tSize n;
+	u8 *p;
+	while(iters--){
+		p = ucagb_load_file(filename, &n, AGB_BUF_SIZE);
+		sink ^= p[n - 1];
+		free(p);
+	}
+}
+
+static void run_load_file(tSize size, uint iters){
+	(void)size;
+	run_load(rom_file, iters);
+}
+
+// inflate and the CRC32 of the gzip trailer, the data doesn't compress
+static void run_load_gz(tSize size, uint iters){
+	(void)size;
+	run_load(gz_file, iters);
+}
+
+// mapping plus the CRC of every block
+static void run_image_load(tSize size, uint iters){
+	struct ucagb_image img;
+	(void)size;
+	while(iters--){
+		ucagb_image_load(&img, rom_file);
+		sink ^= img.crc_rom;
+		ucagb_image_free(&img);
+	}
+}
+
+static const struct micro micros[] = {
+	{"crc32/byte_table", AGB_BUF_SIZE, run_crc_byte, NULL, 0},
+	{"crc32/slice8", AGB_BUF_SIZE, run_crc_update, use_slice8, 0},
+	{"crc32/slice8", ROM_SIZE, run_crc_update, use_slice8, 0},
+	{"crc32/pclmul", AGB_BUF_SIZE, run_crc_update, use_pclmul, 0},
+	{"crc32/pclmul", ROM_SIZE, run_crc_update, use_pclmul, 0},
+	{"crc32/combine_blocks", ROM_SIZE, run_crc_combine, NULL, ROM_SIZE / AGB_BUF_SIZE},
+	{"multiboot/crc_encrypt_word", MB_SIZE, run_mb_word, NULL, 0},
+	{"multiboot/crc_encrypt_block", MB_SIZE, run_mb_block, NULL, 0},
+	{"frame/xfer32bw", AGB_BUF_SIZE, run_frame_bw, NULL, 0},
+	{"frame/xfer32bw_n64", AGB_BUF_SIZE, run_frame_bwn, NULL, 0},
+	{"frame/xfer32sbw", MB_SIZE, run_frame_sbw, NULL, 0},
+	{"file/load_file", ROM_SIZE, run_load_file, make_rom, 0},
+	{"file/load_file_gz", ROM_SIZE, run_load_gz, make_rom_gz, 0},
+	{"file/image_load", ROM_SIZE, run_image_load, make_rom, 0},
+};
+
+static int cmp_u64(const void *a, const void *b){
+	u64 x = *(const u64*)a, y = *(const u64*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void measure(const struct micro *m){
+	u64 t, ns[MICRO_REPS];
+	uint iters = 1, i;
+	char size[0x10];
+	double per;
+
+	// one to warm up, then as many as a batch needs
+	m->run(m->size, 1);
+	while(1){
+		t = get_ntime();
+		m->run(m->size, iters);
+		t = get_ntime() - t;
+		if(t >= MICRO_MIN_NS || iters >= 1u << 30){
+			break;
+		}
+		iters <<= 1;
+	}
+	for(i = 0; i < MICRO_REPS; ++i){
+		t = get_ntime();
+		m->run(m->size, iters);
+		ns[i] = get_ntime() - t;
+	}
+	qsort(ns, MICRO_REPS, sizeof(u64), cmp_u64);
+	per = (double)ns[MICRO_REPS / 2] / iters;
+
+	// a combine doesn't touch the bytes it stands for, bytes per second would be meaningless
+	if(m->ops){
+		snprintf(size, sizeof(size), "%uops", m->ops);
+		printf("%-32s %8s %12.3f us %6.1f ns/op\n", m->name, size, per / 1000, per / m->ops);
+		fflush(stdout);
+		return;
+	}
+	if(m->size >= 1 << 20){
+		snprintf(size, sizeof(size), "%uMB", m->size >> 20);
+	}else{
+		snprintf(size, sizeof(size), "%uKB", m->size >> 10);
+	}
+	printf("%-32s %8s %12.3f us %8.3f\n", m->name, size, per / 1000, m->size / per);
+	fflush(stdout);
+}
+
+int main(int argc, const char *argv[]){
+	const char *filter = argc > 1 ? argv[1] : "";
+	uint i;
+	u32 x = 0x12345678;
+
+	ucagb_init();
+	init_crc32_table(ref_table);
+	data = malloc(ROM_SIZE);
+	for(i = 0; i < ROM_SIZE; i += 4){
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		memcpy(data + i, &x, 4);
+	}
+
+	printf("crc engine %s\n", crc_engine());
+	printf("%-32s %8s %15s %8s\n", "name", "size", "time/iter", "GB/s");
+	for(i = 0; i < sizeof(micros) / sizeof(micros[0]); ++i){
+		if(!strstr(micros[i].name, filter)){
+			continue;
+		}
+		if(micros[i].setup && micros[i].setup()){
+			printf("%-32s skipped\n", micros[i].name);
+			continue;
+		}
+		measure(&micros[i]);
+	}
+
+	if(rom_made){
+		unlink(rom_file);
+	}
+	if(gz_made){
+		unlink(gz_file);
+	}
+	frame_free(&frame);
+	free(data);
+	return 0;
+}
@@ -0,0 +1,414 @@
+/*
+end to end benchmark
+===
+runs a fixed matrix against whatever is behind the serial port,
+a uCSIO with a GBA running DFAGB, or emu/ucagbemu -m when there is no hardware
+
+every operation is repeated and timed with get_ntime,
+each (operation, set_wait) pair becomes one JSON object per line in the output:
+	{"op":"upload_128k","wait":1,"n":8,"bytes":131072,"median":123,"p95":456,"p99":456,"mbps":1.06}
+times are in ns, mbps is bytes per second / 10^6 of the median
+
+with a baseline (an older output file) every median is compared to it,
+more than BENCH_TOLERANCE percent slower is reported as a regression
+
+the flash cycle is only run on the I28F128J3 flash carts df_flash supports,
+it programs the complement of the last block then puts the original back,
+so it only runs against emu/ucagbemu, UCAGB_BENCH_FLASH=1 in the environment
+runs it on a real cart too, don't interrupt it then
+
+the fault sweep repeats flashes of a block the cart already has, the upload,
+CRC32 and verify of ucagb_flash_block with its retries, and dumps at a list
+of bit flip rates injected by fault.c, one JSON line per (operation, rate):
+	{"op":"dump_1m","flip":1e-06,"n":2,"ok":2,"bytes":2097152,"ns":123,"mbps":1.06,"retries":1,"failed":0,"resyncs":0,"flips":3}
+bytes only counts what got through, so mbps is the effective throughput
+a garbled word can be an erase or a program, the sweep only runs against
+emu/ucagbemu unless --faults has unsafe=1
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/common.h"
+#include "pl.h"
+#include "gba.h"
+#include "ucagb.h"
+#include "fault.h"
+#include "metrics.h"
+
+#define BENCH_TOLERANCE 10
+#define BENCH_MAX_SAMPLES 0x100
+#define FLASH_BLOCK 0x7f
+#define SWEEP_UPLOADS 8
+#define SWEEP_DUMPS 2
+// CRC mismatches a flash of the sweep gives up after, see upload_tries
+#define SWEEP_TRIES 8
+
+static const u8 bench_waits[] = {1, 8};
+
+struct result {
+	const char *op;
+	u32 wait, n, bytes;
+	u64 median, p95, p99;
+};
+
+static u64 samples[BENCH_MAX_SAMPLES];
+static u32 n_samples;
+static u64 t_sample;
+
+static void begin(void){
+	t_sample = get_ntime();
+}
+
+static void end(void){
+	if(n_samples < BENCH_MAX_SAMPLES){
+		samples[n_samples++] = get_ntime() - t_sample;
+	}
+}
+
+static int cmp_u64(const void *a, const void *b){
+	u64 x = *(const u64*)a, y = *(const u64*)b;
+	return x < y ? -1 : x > y;
+}
+
+// nearest rank
+static u64 percentile(u32 p){
+	u32 i = (n_samples * p + 99) / 100;
+	return samples[i ? i - 1 : 0];
+}
+
+static void report(FILE *f, const char *op, u32 wait, u32 bytes){
+	struct result r;
+	double mbps;
+	if(!n_samples){
+		return;
+	}
+	qsort(samples, n_samples, sizeof(u64), cmp_u64);
+	r.op = op; r.wait = wait; r.n = n_samples; r.bytes = bytes;
+	r.median = percentile(50);
+	r.p95 = percentile(95);
+	r.p99 = percentile(99);
+	mbps = r.median ? r.bytes * 1000.0 / r.median : 0;
+	fprintf(f, "{\"op\":\"%s\",\"wait\":%u,\"n\":%u,\"bytes\":%u,"
+		"\"median\":%llu,\"p95\":%llu,\"p99\":%llu,\"mbps\":%.3f}\n",
+		r.op, r.wait, r.n, r.bytes, r.median, r.p95, r.p99, mbps);
+	fflush(f);
+	printf("%-16s wait %-3u n %-4u median %12.3f ms  p95 %12.3f ms  p99 %12.3f ms  %8.3f MB/s\n",
+		r.op, r.wait, r.n, r.median / 1e6, r.p95 / 1e6, r.p99 / 1e6, mbps);
+	n_samples = 0;
+}
+
+static void run_matrix(FILE *f, struct ucagb *s, u8 wait, u8 *buf, int flash){
+	tDev d = s->d;
+	u32 i;
+	u8 *orig;
+
+	s->wait_p0 = wait;
+	set_wait(d, wait, 0);
+
+	for(i = 0; i < 200; ++i){
+		begin();
+		xfer32(d, DF_CMD_NOP);
+		end();
+	}
+	report(f, "xfer_rtt", wait, 4);
+
+	for(i = 0; i < 8; ++i){
+		begin();
+		df_upload(d, buf, AGB_BUF_SIZE);
+		end();
+	}
+	report(f, "upload_128k", wait, AGB_BUF_SIZE);
+
+	for(i = 0; i < 8; ++i){
+		begin();
+		df_download(d, buf, AGB_BUF_SIZE);
+		end();
+	}
+	report(f, "download_128k", wait, AGB_BUF_SIZE);
+
+	for(i = 0; i < 16; ++i){
+		begin();
+		df_worker(d, DF_CMD_CRC32 | 4, NULL, "worker round trip", "done");
+		end();
+	}
+	report(f, "worker_rtt", wait, 0);
+
+	for(i = 0; i < 3; ++i){
+		begin();
+		ucagb_dump(s, NULL, 1 << 20);
+		end();
+	}
+	report(f, "dump_1m", wait, 1 << 20);
+
+	begin();
+	ucagb_dump(s, NULL, 8 << 20);
+	end();
+	report(f, "dump_8m", wait, 8 << 20);
+
+	begin();
+	ucagb_dump(s, NULL, 32 << 20);
+	end();
+	report(f, "dump_32m", wait, 32 << 20);
+
+	if(!flash){
+		return;
+	}
+	// keep the block, program its complement, then restore it
+	// so both cycles really erase and program
+	orig = malloc(AGB_BUF_SIZE);
+	df_worker(d, DF_CMD_DUMP | (FLASH_BLOCK * AGB_BUF_SIZE >> 8),
+		NULL, "waiting for dump", "done");
+	df_download(d, orig, AGB_BUF_SIZE);
+	for(i = 0; i < AGB_BUF_SIZE; ++i){
+		buf[i] = ~orig[i];
+	}
+	df_worker(d, DF_CMD_UNLOCK, NULL, "waiting for clearing Block-Lock Bits", "done");
+	begin();
+	ucagb_flash_block(s, buf, ucagb_crc32(buf, AGB_BUF_SIZE), FLASH_BLOCK);
+	end();
+	begin();
+	ucagb_flash_block(s, orig, ucagb_crc32(orig, AGB_BUF_SIZE), FLASH_BLOCK);
+	end();
+	report(f, "flash_cycle_128k", wait, AGB_BUF_SIZE);
+	free(orig);
+}
+
+// returns the number of regressions, -1 if the baseline can't be read
+static int compare(const char *out, const char *baseline){
+	FILE *fo, *fb;
+	char lo[0x200], lb[0x200], op_o[0x40], op_b[0x40];
+	u32 wait_o, wait_b;
+	unsigned long long med_o, med_b;
+	const char *p;
+	int found, regressions = 0;
+
+	fo = fopen(out, "r");
+	fb = fopen(baseline, "r");
+	if(!fo || !fb){
+		fprintf(stderr, "failed to open \"%s\" for read\n", fo ? baseline : out);
+		if(fo) fclose(fo);
+		if(fb) fclose(fb);
+		return -1;
+	}
+	printf("\ncompared to %s:\n", baseline);
+	while(fgets(lo, sizeof(lo), fo)){
+		if(sscanf(lo, "{\"op\":\"%63[^\"]\",\"wait\":%u", op_o, &wait_o) != 2
+			|| !(p = strstr(lo, "\"median\":")) || sscanf(p, "\"median\":%llu", &med_o) != 1){
+			continue;
+		}
+		found = 0;
+		rewind(fb);
+		while(fgets(lb, sizeof(lb), fb)){
+			if(sscanf(lb, "{\"op\":\"%63[^\"]\",\"wait\":%u", op_b, &wait_b) == 2
+				&& !strcmp(op_o, op_b) && wait_o == wait_b
+				&& (p = strstr(lb, "\"median\":")) && sscanf(p, "\"median\":%llu", &med_b) == 1){
+				found = 1;
+				break;
+			}
+		}
+		if(!found || !med_b){
+			printf("%-16s wait %-3u not in baseline\n", op_o, wait_o);
+			continue;
+		}
+		printf("%-16s wait %-3u %+8.2f%%", op_o, wait_o, (med_o * 100.0 / med_b) - 100);
+		if(med_o * 100 > med_b * (100 + BENCH_TOLERANCE)){
+			printf("  REGRESSION");
+			++regressions;
+		}
+		printf("\n");
+	}
+	fclose(fo);
+	fclose(fb);
+	return regressions;
+}
+
+int ucagb_bench(struct ucagb *s, const char *out, const char *baseline, const u8 *rom, tSize rom_size){
+	tDev d = s->d;
+	FILE *f;
+	u8 *buf, wait = s->wait_p0, fixed;
+	u32 i, id;
+	int r = UCAGB_OK, flash;
+
+	f = fopen(out, "w");
+	if(!f){
+		fprintf(stderr, "failed to open \"%s\" for write\n", out);
+		return UCAGB_E_FILE;
+	}
+
+	// same content every run, for the dumps and uploads to be comparable
+	buf = malloc(AGB_BUF_SIZE);
+	srand(0x55aa);
+	for(i = 0; i < AGB_BUF_SIZE; ++i){
+		buf[i] = rand() & 0xff;
+	}
+
+	set_wait(d, s->wait_p0, 0);
+	id = df_worker(d, DF_CMD_ID, NULL, "waiting for Flash ID", "Flash ID returned");
+	fprintf(f, "{\"bench\":\"usbagb\",\"flash_id\":\"0x%08x\"}\n", id);
+
+	// every row at the wait it is labelled with, the rate control stays out
+	fixed = s->rate.fixed;
+	s->rate.fixed = 1;
+	flash = id == 0x00890018 && (s->caps.mcu == CAPS_MCU_EMU || getenv("UCAGB_BENCH_FLASH"));
+	if(id == 0x00890018 && !flash){
+		printf("no flash cycle, UCAGB_BENCH_FLASH=1 runs it on a real cart\n");
+	}
+	for(i = 0; i < sizeof(bench_waits); ++i){
+		run_matrix(f, s, bench_waits[i], buf, flash);
+	}
+	s->wait_p0 = wait;
+	s->rate.fixed = fixed;
+
+	// last, whatever we boot may not be DFAGB
+	if(rom){
+		s->cold = 1;
+		begin();
+		r = ucagb_multiboot(s, rom, rom_size);
+		s->cold = 0;
+		if(r == UCAGB_OK){
+			end();
+		}
+		report(f, "multiboot", 0, rom_size);
+	}
+
+	free(buf);
+	fclose(f);
+
+	if(d->err){
+		return d->err == SERIAL_ETIMEOUT ? UCAGB_E_TIMEOUT : UCAGB_E_IO;
+	}
+	if(r == UCAGB_OK && baseline){
+		r = compare(out, baseline);
+		if(r < 0){
+			r = UCAGB_E_FILE;
+		}
+	}
+	return r;
+}
+
+struct sweep {
+	const char *op;
+	u32 n, ok, bytes, retries, failed, resyncs;
+	u64 ns, flips;
+};
+
+static void sweep_report(FILE *f, struct sweep *w, double rate){
+	double mbps = w->ns ? w->bytes * 1000.0 / w->ns : 0;
+	fprintf(f, "{\"op\":\"%s\",\"flip\":%g,\"n\":%u,\"ok\":%u,\"bytes\":%u,\"ns\":%llu,"
+		"\"mbps\":%.3f,\"retries\":%u,\"failed\":%u,\"resyncs\":%u,\"flips\":%llu}\n",
+		w->op, rate, w->n, w->ok, w->bytes, w->ns, mbps, w->retries, w->failed, w->resyncs, w->flips);
+	fflush(f);
+	printf("%-12s flip %-8g ok %2u/%-2u retries %-4u failed %-2u resyncs %-2u %10.3f s %8.3f MB/s\n",
+		w->op, rate, w->ok, w->n, w->retries, w->failed, w->resyncs, w->ns / 1e9, mbps);
+}
+
+// after a failure, a garbled command may have left DFAGB anywhere
+// UCAGB_OK, or the session is lost for good
+static int sweep_recover(struct ucagb *s, struct sweep *w){
+	int on = fault_on, r;
+	++w->failed;
+	// the resync itself goes over a clean line
+	fault_on = 0;
+	++w->resyncs;
+	r = ucagb_resync(s);
+	fault_on = on;
+	return r;
+}
+
+// buf is the block as the cart has it, on a clean line the CRC32 matches
+// and the verify skips it, every fault is paid for by the real retry path
+static int sweep_uploads(FILE *f, struct ucagb *s, const u8 *buf, double rate){
+	struct sweep w = {"upload_128k", 0, 0, 0, 0, 0, 0, 0, 0};
+	u32 crc0 = ucagb_crc32(buf, AGB_BUF_SIZE), i;
+	u64 flips = metrics[M_FAULT_FLIPS], retries = metrics[M_RETRY_UPLOAD], t = get_ntime();
+	int r;
+	for(i = 0; i < SWEEP_UPLOADS; ++i){
+		++w.n;
+		if(ucagb_flash_block(s, buf, crc0, FLASH_BLOCK) >= 0){
+			++w.ok;
+			w.bytes += AGB_BUF_SIZE;
+		}else if((r = sweep_recover(s, &w))){
+			return r;
+		}
+	}
+	w.ns = get_ntime() - t;
+	w.flips = metrics[M_FAULT_FLIPS] - flips;
+	w.retries = (u32)(metrics[M_RETRY_UPLOAD] - retries);
+	sweep_report(f, &w, rate);
+	return UCAGB_OK;
+}
+
+static int sweep_dumps(FILE *f, struct ucagb *s, double rate){
+	struct sweep w = {"dump_1m", 0, 0, 0, 0, 0, 0, 0, 0};
+	u32 i;
+	u64 flips = metrics[M_FAULT_FLIPS], retries = metrics[M_RETRY_DUMP], t = get_ntime();
+	int r;
+	for(i = 0; i < SWEEP_DUMPS; ++i){
+		++w.n;
+		if(ucagb_dump(s, NULL, 1 << 20) == UCAGB_OK){
+			++w.ok;
+			w.bytes += 1 << 20;
+		}else if((r = sweep_recover(s, &w))){
+			return r;
+		}
+	}
+	w.ns = get_ntime() - t;
+	w.flips = metrics[M_FAULT_FLIPS] - flips;
+	w.retries = (u32)(metrics[M_RETRY_DUMP] - retries);
+	sweep_report(f, &w, rate);
+	return UCAGB_OK;
+}
+
+int ucagb_fault_sweep(struct ucagb *s, const char *out, const double *rates, uint n){
+	tDev d = s->d;
+	FILE *f;
+	u8 *buf, fixed;
+	u32 i;
+	int r = UCAGB_OK, on = fault_on;
+
+	if(fault_allowed(s->caps.mcu == CAPS_MCU_EMU)){
+		return UCAGB_E_PARAM;
+	}
+	f = fopen(out, "w");
+	if(!f){
+		fprintf(stderr, "failed to open \"%s\" for write\n", out);
+		return UCAGB_E_FILE;
+	}
+	buf = malloc(AGB_BUF_SIZE);
+	set_wait(d, s->wait_p0, 0);
+	// the block to flash is read over a clean line
+	fault_on = 0;
+	df_worker(d, DF_CMD_DUMP | (FLASH_BLOCK * AGB_BUF_SIZE >> 8),
+		NULL, "waiting for dump", "done");
+	df_download(d, buf, AGB_BUF_SIZE);
+	fault_on = on;
+	if(d->err){
+		free(buf);
+		fclose(f);
+		return UCAGB_E_IO;
+	}
+	// injected faults don't care about the wait, backing off would only skew the rows
+	fixed = s->rate.fixed;
+	s->rate.fixed = 1;
+	s->upload_tries = SWEEP_TRIES;
+
+	for(i = 0; i < n; ++i){
+		fault_set_flip(rates[i]);
+		r = sweep_uploads(f, s, buf, rates[i]);
+		if(r == UCAGB_OK){
+			r = sweep_dumps(f, s, rates[i]);
+		}
+		if(r){
+			fprintf(stderr, "lost the adapter at flip rate %g\n", rates[i]);
+			break;
+		}
+	}
+	fault_set_flip(0);
+	s->rate.fixed = fixed;
+	s->upload_tries = 0;
+
+	free(buf);
+	fclose(f);
+	return r;
+}
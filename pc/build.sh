@@ -0,0 +1,4 @@
+#!/bin/sh
+# the Linux/POSIX counterpart of build.cmd
+# gzip and zstd files need zlib and libzstd, see zfile.h
+${CC:-cc} -O2 -pthread -o usbagb *.c ../common/crc32.c $(sh zflags.sh)
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pl.h"
+#include "cache.h"
+#include "settings.h"
+
+static void entry_path(const struct cache *c, u32 key, char *path, uint size){
+	snprintf(path, size, "%s/%08x-%08x", c->dir, c->id, key);
+}
+
+int cache_load(struct cache *c, u32 id, u32 crc0){
+	char path[0x200], line[0x220];
+	FILE *f;
+	u32 i, crc;
+	int n = 0;
+	memset(c, 0, sizeof(*c));
+	c->id = id;
+	c->key = crc0;
+	if(settings_path("UCAGB_CACHE", ".usbagb_cache", c->dir, sizeof(c->dir))){
+		return 0;
+	}
+	c->on = 1;
+	entry_path(c, crc0, path, sizeof(path));
+	f = fopen(path, "r");
+	if(!f){
+		return 0;
+	}
+	while(fgets(line, sizeof(line), f)){
+		if(!strncmp(line, "file ", 5)){
+			line[strcspn(line, "\r\n")] = 0;
+			// a path cut short points at some other file
+			if(snprintf(c->file, sizeof(c->file), "%s", line + 5) >= (int)sizeof(c->file)){
+				c->file[0] = 0;
+			}
+		}else if(sscanf(line, "%u 0x%x", &i, &crc) == 2 && i < CACHE_BLOCKS){
+			c->known[i] = 1;
+			c->crc[i] = crc;
+			++n;
+		}
+	}
+	fclose(f);
+	// block 0 is what the entry was found by
+	return n && cache_has(c, 0, crc0);
+}
+
+uint cache_samples(const struct cache *c, u32 *blocks, uint n){
+	u32 known[CACHE_BLOCKS], k = 0, i, j, t, x = get_rtime() | 1;
+	for(i = 1; i < CACHE_BLOCKS; ++i){
+		if(c->known[i]){
+			known[k++] = i;
+		}
+	}
+	// a partial Fisher-Yates shuffle, xorshift is plenty for a spot check
+	for(i = 0; i < n && i < k; ++i){
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		j = i + x % (k - i);
+		t = known[j];
+		known[j] = known[i];
+		blocks[i] = known[i] = t;
+	}
+	return i;
+}
+
+void cache_forget(struct cache *c){
+	memset(c->known, 0, sizeof(c->known));
+	c->file[0] = 0;
+}
+
+int cache_has(const struct cache *c, u32 i, u32 crc){
+	return c->on && i < CACHE_BLOCKS && c->known[i] && c->crc[i] == crc;
+}
+
+int cache_known(const struct cache *c, u32 i){
+	return c->on && i < CACHE_BLOCKS && c->known[i];
+}
+
+void cache_set(struct cache *c, u32 i, u32 crc){
+	if(i < CACHE_BLOCKS){
+		c->known[i] = 1;
+		c->crc[i] = crc;
+	}
+}
+
+void cache_unset(struct cache *c, u32 i){
+	if(i < CACHE_BLOCKS){
+		c->known[i] = 0;
+	}
+}
+
+void cache_file(struct cache *c, const char *path){
+	if(full_path(path, c->file, sizeof(c->file))){
+		snprintf(c->file, sizeof(c->file), "%s", path);
+	}
+}
+
+void cache_save(struct cache *c){
+	struct settings st;
+	char path[0x200], old[0x200], lock[0x200];
+	u32 i;
+	if(!c->on || !c->known[0]){
+		return;
+	}
+	if(make_dir(c->dir)){
+		fprintf(stderr, "failed to create \"%s\"\n", c->dir);
+		return;
+	}
+	entry_path(c, c->crc[0], path, sizeof(path));
+	// one lock for the directory, an entry that moves is removed under it too
+	snprintf(lock, sizeof(lock), "%s/lock", c->dir);
+	if(!settings_create(&st, path, lock)){
+		return;
+	}
+	if(c->file[0]){
+		fprintf(st.f, "file %s\n", c->file);
+	}
+	for(i = 0; i < CACHE_BLOCKS; ++i){
+		if(c->known[i]){
+			fprintf(st.f, "%u 0x%08x\n", i, c->crc[i]);
+		}
+	}
+	// a flash that changed block 0 moves the entry, if the new one isn't
+	// written after all the cart is just not known any more
+	if(c->crc[0] != c->key){
+		entry_path(c, c->key, old, sizeof(old));
+		remove(old);
+	}
+	if(!settings_commit(&st)){
+		c->key = c->crc[0];
+	}
+}
@@ -0,0 +1,55 @@
+#ifndef cache_h__
+#define cache_h__
+
+#include "pl.h"
+#include "../common/common.h"
+
+/*
+cart cache
+===
+what we last wrote to or read from a cart, so a flash doesn't upload the
+blocks the cart already has and a dump doesn't download the blocks there
+is a copy of on disk
+a cart is told by its flash ID and the CRC32 of block 0, the one with the
+header, DFAGB has that without downloading anything, DF_CMD_DUMP + CRC32
+the file <dir>/<id>-<crc32 of block 0> keeps the CRC32 of every block seen
+and the file they were last written from or dumped to
+	file <path>
+	<block> <crc32>
+	...
+entries are written and removed holding <dir>/lock, one for the directory
+an entry is only trusted once CACHE_SAMPLES of its blocks, picked anew every
+time, have the same CRC32 on the cart, it is dropped otherwise
+the directory is UCAGB_CACHE, ~/.usbagb_cache by default, an empty
+UCAGB_CACHE turns the cache off
+*/
+#define CACHE_SAMPLES 3
+#define CACHE_BLOCKS (0x2000000 / AGB_BUF_SIZE)
+
+struct cache {
+	u8 on;
+	u32 id;
+	// block 0 as loaded, the entry is renamed if it changes
+	u32 key;
+	u8 known[CACHE_BLOCKS];
+	u32 crc[CACHE_BLOCKS];
+	char dir[0x100], file[0x200];
+};
+
+// 1 if the cart has an entry, it still has to pass the spot check
+int cache_load(struct cache *c, u32 id, u32 crc0);
+// up to n known blocks other than 0, a different pick every time
+uint cache_samples(const struct cache *c, u32 *blocks, uint n);
+// the spot check failed, nothing of the entry is known any more
+void cache_forget(struct cache *c);
+// 1 if block i of the cart is known to have that CRC32
+int cache_has(const struct cache *c, u32 i, u32 crc);
+// 1 if the CRC32 of block i of the cart is known, whatever it is
+int cache_known(const struct cache *c, u32 i);
+void cache_set(struct cache *c, u32 i, u32 crc);
+// a block that may have been left half written
+void cache_unset(struct cache *c, u32 i);
+// where the blocks can be found on disk, relative paths are made absolute
+void cache_file(struct cache *c, const char *path);
+void cache_save(struct cache *c);
+#endif
@@ -0,0 +1,145 @@
+/*
+the usbagb commands on top of libucagb, files in and out
+shared by the single device main, multi and the daemon
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/common.h"
+#include "ucagb.h"
+#include "cli.h"
+
+static int cli_multiboot(struct ucagb *s, const char *filename){
+	u8 *rom;
+	tSize size;
+	int r;
+	rom = ucagb_load_file(filename, &size, BULK_SIZE << 2);
+	if(rom == NULL){
+		return UCAGB_E_FILE;
+	}
+	r = ucagb_multiboot(s, rom, size);
+	free(rom);
+	return r;
+}
+
+// blocks are counted from 1 on the command line, 0 resumes from the journal
+static int cli_flash(struct ucagb *s, const char *filename, u32 start){
+	return ucagb_flash_file(s, filename, start ? start - 1 : ~0u);
+}
+
+static int cli_dump(struct ucagb *s, u32 mbits, const char *filename){
+	return ucagb_dump_file(s, filename, mbits << 17);
+}
+
+static int cli_write(struct ucagb *s, const char *save_type, const char *filename){
+	u32 size = ucagb_save_size(save_type);
+	tSize fsize;
+	u8 *buf;
+	int r;
+	if(!size){
+		return UCAGB_E_PARAM;
+	}
+	buf = ucagb_load_file(filename, &fsize, size);
+	if(buf == NULL){
+		return UCAGB_E_FILE;
+	}
+	r = ucagb_write_save(s, save_type, buf);
+	free(buf);
+	return r;
+}
+
+static int cli_read(struct ucagb *s, const char *save_type, const char *filename){
+	u32 size = ucagb_save_size(save_type);
+	u8 *buf;
+	int r;
+	if(!size){
+		return UCAGB_E_PARAM;
+	}
+	buf = malloc(size);
+	r = ucagb_read_save(s, save_type, buf);
+	if(r == UCAGB_OK){
+		r = ucagb_save_file(filename, buf, size);
+	}
+	free(buf);
+	return r;
+}
+
+static int cli_bench(struct ucagb *s, const char *out, const char *baseline, const char *filename){
+	u8 *rom = NULL;
+	tSize size = 0;
+	int r;
+	if(filename){
+		rom = ucagb_load_file(filename, &size, BULK_SIZE << 2);
+		if(rom == NULL){
+			return UCAGB_E_FILE;
+		}
+	}
+	r = ucagb_bench(s, out, baseline, rom, size);
+	free(rom);
+	return r;
+}
+
+#define SWEEP_MAX_RATES 0x10
+static const double sweep_rates[] = {0, 1e-7, 1e-6, 3e-6, 1e-5};
+
+static int cli_fault_sweep(struct ucagb *s, const char *out, int argc, const char *argv[]){
+	double rates[SWEEP_MAX_RATES];
+	int i;
+	if(!argc){
+		return ucagb_fault_sweep(s, out, sweep_rates, sizeof(sweep_rates) / sizeof(sweep_rates[0]));
+	}
+	for(i = 0; i < argc && i < SWEEP_MAX_RATES; ++i){
+		rates[i] = atof(argv[i]);
+	}
+	return ucagb_fault_sweep(s, out, rates, i);
+}
+
+int cli_run(struct ucagb *s, int argc, const char *argv[]){
+	if(argc == 2 && !strcmp(argv[0], "multiboot")){
+		// example: usbagb com3 multiboot game.gba
+		return cli_multiboot(s, argv[1]);
+	}else if(argc == 2 && !strcmp(argv[0], "flash")){
+		// an interrupted flash of the same file goes on where it stopped
+		// example: usbagb com3 flash game.gba
+		return cli_flash(s, argv[1], 0);
+	}else if(argc == 3 && !strcmp(argv[0], "flash")){
+		// continue flash starting at specified block
+		// example: usbagb com3 flash game.gba 4
+		return cli_flash(s, argv[1], atoi(argv[2]));
+	}else if(argc == 3 && !strcmp(argv[0], "dump")){
+		// example: usbagb com3 dump 128 dump.gba
+		return cli_dump(s, atoi(argv[1]), argv[2]);
+	}else if(argc == 3 && !strcmp(argv[0], "write")){
+		// example: usbagb com3 write sram256 game.sav
+		return cli_write(s, argv[1], argv[2]);
+	}else if(argc == 3 && !strcmp(argv[0], "read")){
+		// example: usbagb com3 read sram256 game.sav
+		return cli_read(s, argv[1], argv[2]);
+	}else if(argc == 1 && !strcmp(argv[0], "bootloader")){
+		// reset the uCSIO to bootloader
+		// example: usbagb com3 bootloader
+		ucagb_reset_to_bootloader(s);
+		return UCAGB_OK;
+	}else if(argc == 3 && !strcmp(argv[0], "test")){
+		return ucagb_serial_bench(s, atoi(argv[1]), atoi(argv[2]));
+	}else if(argc == 3 && !strcmp(argv[0], "testdf")){
+		return ucagb_df_test(s, strtoul(argv[2], NULL, 0x10));
+	}else if(argc >= 2 && argc <= 4 && !strcmp(argv[0], "bench")){
+		// run the benchmark matrix, optionally compare to an older result
+		// example: usbagb com3 bench new.json old.json dfagb.mb.gba
+		// example: usbagb com3 bench new.json - dfagb.mb.gba
+		return cli_bench(s, argv[1],
+			argc >= 3 && strcmp(argv[2], "-") ? argv[2] : NULL,
+			argc >= 4 ? argv[3] : NULL);
+	}else if(argc >= 2 && !strcmp(argv[0], "faultsweep")){
+		// uploads and dumps at several bit flip rates, against emu/ only
+		// example: usbagb /tmp/ttyEMU faultsweep sweep.json 0 1e-6 1e-5
+		return cli_fault_sweep(s, argv[1], argc - 2, argv + 2);
+	}
+	return UCAGB_E_PARAM;
+}
+
+void cli_usage(const char *name){
+	fprintf(stderr, "invalid parameters, example:\n\t%s COM1 multiboot your_file.gba\n", name);
+}
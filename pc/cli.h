@@ -0,0 +1,10 @@
+#ifndef cli_h__
+#define cli_h__
+
+#include "ucagb.h"
+
+// runs one usbagb command on an open session, argv[0] is the command
+// returns a UCAGB_* code, UCAGB_E_PARAM if the command isn't known
+int cli_run(struct ucagb *s, int argc, const char *argv[]);
+void cli_usage(const char *name);
+#endif
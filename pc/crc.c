@@ -0,0 +1,352 @@
+/*
+host CRC32 engine
+===
+the very same CRC as common/crc32.c: reflected 0xedb88320, inverted in and out
+crc_init picks the fastest implementation the CPU has:
+	PCLMULQDQ folding, 4 x 128 bits at a time, x86 with PCLMUL and SSE4.1
+	slicing-by-8, anywhere else and for what folding leaves over
+crc32_combine gives CRC(A|B) from CRC(A), CRC(B) and the length of B,
+so a whole ROM CRC comes from the block CRCs without reading it again
+*/
+#include <string.h>
+
+#include "pl.h"
+#include "crc.h"
+
+#define CRC_POLY 0xedb88320
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CRC_PCLMUL
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC_TARGET
+#else
+#include <cpuid.h>
+#define CRC_TARGET __attribute__((target("pclmul,sse4.1")))
+#endif
+#endif
+
+static u32 crc_table[8][0x100];
+// x2n_table[k] is x^(2^k) mod P
+static u32 x2n_table[32];
+static int crc_pclmul;
+
+static u32 slice8(u32 crc, const u8 *p, tSize size){
+	u32 a, b;
+	while(size >= 8){
+		// little endian
+		memcpy(&a, p, 4);
+		memcpy(&b, p + 4, 4);
+		a ^= crc;
+		crc = crc_table[7][a & 0xff] ^ crc_table[6][(a >> 8) & 0xff]
+			^ crc_table[5][(a >> 16) & 0xff] ^ crc_table[4][a >> 24]
+			^ crc_table[3][b & 0xff] ^ crc_table[2][(b >> 8) & 0xff]
+			^ crc_table[1][(b >> 16) & 0xff] ^ crc_table[0][b >> 24];
+		p += 8;
+		size -= 8;
+	}
+	while(size--){
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#ifdef CRC_PCLMUL
+/*
+Intel, "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction"
+the constants are the bit reflected k1..k5 and the Barrett P'(x) and mu of 0xedb88320
+size is a multiple of 16, at least 64
+crc comes in and goes out not inverted, like slice8
+*/
+CRC_TARGET static u32 fold(u32 crc, const u8 *p, tSize size){
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596ll, 0x0154442bd4ll);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009ell, 0x01751997d0ll);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124ll);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641ll, 0x01db710641ll);
+
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	p += 0x40;
+	size -= 0x40;
+
+	// 4 lanes of 128 bits
+	while(size >= 0x40){
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		y5 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		p += 0x40;
+		size -= 0x40;
+	}
+
+	// 4 lanes into 1
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while(size >= 0x10){
+		x2 = _mm_loadu_si128((const __m128i *)p);
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		p += 0x10;
+		size -= 0x10;
+	}
+
+	// 128 to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return _mm_extract_epi32(x1, 1);
+}
+
+static int has_pclmul(void){
+#ifdef _MSC_VER
+	int r[4];
+	__cpuid(r, 1);
+	return (r[2] & (1 << 1)) && (r[2] & (1 << 19));
+#else
+	unsigned a, b, c, d;
+	if(!__get_cpuid(1, &a, &b, &c, &d)){
+		return 0;
+	}
+	return (c & bit_PCLMUL) && (c & bit_SSE4_1);
+#endif
+}
+#endif
+
+// a * b mod P, both as reflected polynomials
+static u32 multmodp(u32 a, u32 b){
+	u32 m = 1u << 31, p = 0;
+	while(1){
+		if(a & m){
+			p ^= b;
+			if(!(a & (m - 1))){
+				break;
+			}
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC_POLY : b >> 1;
+	}
+	return p;
+}
+
+// x^(n * 2^k) mod P
+static u32 x2nmodp(u64 n, uint k){
+	u32 p = 1u << 31;
+	while(n){
+		if(n & 1){
+			p = multmodp(x2n_table[k & 31], p);
+		}
+		n >>= 1;
+		++k;
+	}
+	return p;
+}
+
+void crc_init(void){
+	u32 i, j, r, p;
+	for(i = 0; i < 0x100; ++i){
+		r = i;
+		for(j = 0; j < 8; ++j){
+			r = r & 1 ? (r >> 1) ^ CRC_POLY : r >> 1;
+		}
+		crc_table[0][i] = r;
+	}
+	for(i = 0; i < 0x100; ++i){
+		for(j = 1; j < 8; ++j){
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xff];
+		}
+	}
+	// x^1, then squared over and over
+	p = 1u << 30;
+	x2n_table[0] = p;
+	for(i = 1; i < 32; ++i){
+		x2n_table[i] = p = multmodp(p, p);
+	}
+#ifdef CRC_PCLMUL
+	crc_pclmul = has_pclmul();
+#endif
+}
+
+int crc_set_engine(const char *name){
+	if(!strcmp(name, "slice8")){
+		crc_pclmul = 0;
+		return 0;
+	}
+#ifdef CRC_PCLMUL
+	if(!strcmp(name, "pclmul") && has_pclmul()){
+		crc_pclmul = 1;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+const char *crc_engine(void){
+	return crc_pclmul ? "pclmul" : "slice8";
+}
+
+u32 crc32_update(u32 crc, const void *buf, tSize size){
+	const u8 *p = buf;
+	tSize n;
+	crc = ~crc;
+#ifdef CRC_PCLMUL
+	if(crc_pclmul && size >= 0x40){
+		n = size & ~0xf;
+		crc = fold(crc, p, n);
+		p += n;
+		size -= n;
+	}
+#endif
+	return ~slice8(crc, p, size);
+}
+
+u32 crc32_combine(u32 crc1, u32 crc2, u64 len2){
+	// crc1 shifted over len2 bytes of zeros, the inversions cancel out
+	return multmodp(x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+#ifdef CRCTEST
+// gcc -DCRCTEST -O2 crc.c ../common/crc32.c && ./a.out
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../common/crc32.h"
+
+// instead of get_ntime, so the test doesn't need pl.c and all it pulls in
+static u64 now(void){
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static u32 ref_table[CRC32_TABLE_LEN];
+// keeps the timed loops from being optimized away
+static volatile u32 sink;
+
+static double ref_mbps(const u8 *buf, tSize size){
+	u64 t;
+	uint i;
+	t = now();
+	for(i = 0; i < 0x40; ++i){
+		sink ^= crc32(ref_table, i, buf, size);
+	}
+	t = now() - t;
+	return size * 64.0 * 1000 / t;
+}
+
+static double mbps(int engine, const u8 *buf, tSize size){
+	u64 t;
+	uint i;
+	int saved = crc_pclmul;
+	crc_pclmul = engine;
+	t = now();
+	for(i = 0; i < 0x40; ++i){
+		sink ^= crc32_update(i, buf, size);
+	}
+	t = now() - t;
+	crc_pclmul = saved;
+	return size * 64.0 * 1000 / t;
+}
+
+int main(void){
+	tSize size = 0x200000, n, o, i;
+	u8 *buf = malloc(size + 0x10);
+	u32 ref, a, b;
+	int engine, fail = 0;
+
+	init_crc32_table(ref_table);
+	crc_init();
+	srand(1);
+	for(i = 0; i < size + 0x10; ++i){
+		buf[i] = rand() & 0xff;
+	}
+	printf("engine %s\n", crc_engine());
+
+	// every length around the folding thresholds, every alignment
+	for(engine = 0; engine <= crc_pclmul; ++engine){
+		int saved = crc_pclmul;
+		crc_pclmul = engine;
+		for(n = 0; n < 0x240; ++n){
+			for(o = 0; o < 0x10; ++o){
+				ref = crc32(ref_table, 0x12345678, buf + o, n);
+				a = crc32_update(0x12345678, buf + o, n);
+				if(a != ref){
+					printf("%s: length %u offset %u: 0x%08x != 0x%08x\n", crc_engine(), n, o, a, ref);
+					++fail;
+				}
+			}
+		}
+		ref = crc32(ref_table, 0, buf, 0x20000);
+		if(crc32_update(0, buf, 0x20000) != ref){
+			printf("%s: 128KB mismatch\n", crc_engine());
+			++fail;
+		}
+		crc_pclmul = saved;
+	}
+
+	// whole buffer from the CRCs of its 128KB blocks, and uneven splits
+	a = crc32_update(0, buf, 0x20000);
+	for(o = 0x20000; o < size; o += 0x20000){
+		a = crc32_combine(a, crc32_update(0, buf + o, 0x20000), 0x20000);
+	}
+	ref = crc32(ref_table, 0, buf, size);
+	if(a != ref){
+		printf("combine: 0x%08x != 0x%08x\n", a, ref);
+		++fail;
+	}
+	for(n = 0; n < 0x100; n += 7){
+		a = crc32_update(0, buf, n);
+		b = crc32_update(0, buf + n, 0x333);
+		if(crc32_combine(a, b, 0x333) != crc32(ref_table, 0, buf, n + 0x333)){
+			printf("combine: split at %u\n", n);
+			++fail;
+		}
+	}
+
+	printf("byte table %8.1f MB/s\n", ref_mbps(buf, size));
+	printf("slice8     %8.1f MB/s\n", mbps(0, buf, size));
+	if(crc_pclmul){
+		printf("pclmul     %8.1f MB/s\n", mbps(1, buf, size));
+	}
+	printf("%s\n", fail ? "FAILED" : "ok");
+	free(buf);
+	return fail ? -1 : 0;
+}
+#endif
@@ -0,0 +1,16 @@
+#ifndef crc_h__
+#define crc_h__
+
+#include "pl.h"
+
+// once, picks the implementation
+void crc_init(void);
+// "pclmul" or "slice8"
+const char *crc_engine(void);
+// for benchmarks, -1 if the CPU can't
+int crc_set_engine(const char *name);
+// same result as crc32() of common/crc32.c
+u32 crc32_update(u32 crc, const void *buf, tSize size);
+// CRC of A followed by B, from crc1 = CRC(A), crc2 = CRC(B), len2 = length of B
+u32 crc32_combine(u32 crc1, u32 crc2, u64 len2);
+#endif
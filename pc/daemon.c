@@ -0,0 +1,437 @@
+/*
+resident daemon
+===
+	usbagb <port> daemon <socket> [dfagb.mb.gba]
+keeps the adapter open, and DFAGB running on the GBA, between jobs
+so a job costs what the job itself costs: no open, no ping, no multiboot
+
+jobs come in over a Unix domain socket and run one at a time, in order
+of their requests being complete, a client has DAEMON_REQ_MS for its request
+	usbagb <socket> <command> [args]
+is the client side, same commands and arguments as with a port,
+relative file names are relative to the client's working directory
+
+the conversation is text lines, the client sends its working directory,
+the arguments and an empty line, then the daemon sends:
+	queued <jobs ahead>
+	log <line>
+	progress <op> <done> <total>
+	result <UCAGB_* code>
+
+with dfagb.mb.gba, it is multibooted when the daemon starts, and again with
+a fresh session after a job that left the adapter or the GBA not answering
+POSIX only
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "../common/common.h"
+#include "ucagb.h"
+#include "cli.h"
+#include "daemon.h"
+
+#ifdef WINDOWS
+int daemon_run(const char *devname, const char *path, const char *dfagb){
+	fprintf(stderr, "daemon mode needs Unix domain sockets\n");
+	return -1;
+}
+
+int daemon_client(const char *path, int argc, const char *argv[]){
+	fprintf(stderr, "daemon mode needs Unix domain sockets\n");
+	return -1;
+}
+
+int daemon_is_socket(const char *path){
+	return 0;
+}
+#else
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define DAEMON_MAX_ARGS 8
+#define DAEMON_REQ_SIZE 0x1000
+// requests being read at once, and how long a client has for its own
+#define DAEMON_MAX_PENDING 0x10
+#define DAEMON_REQ_MS 1000
+
+struct job {
+	int fd;
+	char req[DAEMON_REQ_SIZE];
+	tSize len;
+	// get_rtime when it was accepted
+	u32 t;
+	const char *cwd, *argv[DAEMON_MAX_ARGS];
+	int argc;
+	struct job *next;
+};
+
+static struct {
+	struct job *head, *tail;
+	uint n;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} queue = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static volatile sig_atomic_t daemon_stop;
+
+static void on_signal(int sig){
+	(void)sig;
+	daemon_stop = 1;
+}
+
+// the client may be gone, that doesn't stop the job
+static void job_printf(struct job *j, const char *fmt, ...){
+	char buf[0x200];
+	va_list ap;
+	int len;
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if(len >= (int)sizeof(buf)){
+		len = sizeof(buf) - 1;
+		buf[len - 1] = '\n';
+	}
+	send(j->fd, buf, len, MSG_NOSIGNAL);
+}
+
+static void job_log(void *user, const char *line){
+	job_printf(user, "log %s\n", line);
+}
+
+static void job_progress(void *user, const char *op, u32 done, u32 total){
+	job_printf(user, "progress %s %u %u\n", op, done, total);
+}
+
+static int valid_command(int argc, const char *argv[]){
+	return argc >= 1 && (!strcmp(argv[0], "multiboot") || !strcmp(argv[0], "flash")
+		|| !strcmp(argv[0], "dump") || !strcmp(argv[0], "write") || !strcmp(argv[0], "read"));
+}
+
+// cwd, args, empty line, all of it within DAEMON_REQ_SIZE
+// reads what has arrived without waiting, 1 once the request is complete,
+// 0 while more is to come, -1 if it is broken or the client is gone
+static int read_request(struct job *j){
+	ssize_t r;
+	char *p, *e;
+	r = recv(j->fd, j->req + j->len, sizeof(j->req) - 1 - j->len, MSG_DONTWAIT);
+	if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+		return 0;
+	}
+	if(r <= 0){
+		return -1;
+	}
+	j->len += r;
+	j->req[j->len] = 0;
+	if(!(j->len == 1 && j->req[0] == '\n') && !strstr(j->req, "\n\n")){
+		return j->len < sizeof(j->req) - 1 ? 0 : -1;
+	}
+	j->cwd = NULL;
+	j->argc = 0;
+	for(p = j->req; (e = strchr(p, '\n')) && e != p; p = e + 1){
+		*e = 0;
+		if(j->cwd == NULL){
+			j->cwd = p;
+		}else if(j->argc < DAEMON_MAX_ARGS){
+			j->argv[j->argc++] = p;
+		}
+	}
+	return j->cwd && valid_command(j->argc, j->argv) ? 1 : -1;
+}
+
+static void reject(struct job *j){
+	job_printf(j, "result %d\n", UCAGB_E_PARAM);
+	close(j->fd);
+	free(j);
+}
+
+static void enqueue(struct job *j){
+	pthread_mutex_lock(&queue.lock);
+	job_printf(j, "queued %u\n", queue.n);
+	j->next = NULL;
+	if(queue.tail){
+		queue.tail->next = j;
+	}else{
+		queue.head = j;
+	}
+	queue.tail = j;
+	++queue.n;
+	pthread_cond_signal(&queue.cond);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+// NULL once stopping and the queue is empty
+static struct job *dequeue(void){
+	struct job *j;
+	pthread_mutex_lock(&queue.lock);
+	while(queue.head == NULL && !daemon_stop){
+		pthread_cond_wait(&queue.cond, &queue.lock);
+	}
+	j = queue.head;
+	if(j){
+		queue.head = j->next;
+		if(queue.head == NULL){
+			queue.tail = NULL;
+		}
+	}
+	pthread_mutex_unlock(&queue.lock);
+	return j;
+}
+
+static void job_done(void){
+	pthread_mutex_lock(&queue.lock);
+	--queue.n;
+	pthread_mutex_unlock(&queue.lock);
+}
+
+struct worker {
+	const char *devname, *dfagb;
+	struct ucagb *s;
+};
+
+// open the adapter and get DFAGB running
+static int session_start(struct worker *w){
+	u8 *rom;
+	tSize size;
+	int r;
+	r = ucagb_open(&w->s, w->devname, NULL);
+	if(r || !w->dfagb){
+		return r;
+	}
+	rom = ucagb_load_file(w->dfagb, &size, BULK_SIZE << 2);
+	if(rom == NULL){
+		return UCAGB_E_FILE;
+	}
+	r = ucagb_multiboot(w->s, rom, size);
+	free(rom);
+	// DFAGB needs a moment before it answers over SIO
+	sleep(500);
+	return r;
+}
+
+static void worker_main(void *arg){
+	struct worker *w = arg;
+	struct job *j;
+	int r;
+	while((j = dequeue())){
+		if(w->s == NULL){
+			r = session_start(w);
+			if(r){
+				fprintf(stderr, "%s: %s\n", w->devname, ucagb_strerror(r));
+				ucagb_close(w->s);
+				w->s = NULL;
+			}
+		}
+		if(w->s == NULL){
+			job_printf(j, "result %d\n", r);
+		}else if(chdir(j->cwd)){
+			job_printf(j, "log can't change directory to %s\n", j->cwd);
+			job_printf(j, "result %d\n", UCAGB_E_FILE);
+		}else{
+			fprintf(stderr, "job %s\n", j->argv[0]);
+			ucagb_set_log(w->s, job_log, j);
+			ucagb_set_progress(w->s, job_progress, j);
+			r = cli_run(w->s, j->argc, j->argv);
+			ucagb_set_log(w->s, NULL, NULL);
+			ucagb_set_progress(w->s, NULL, NULL);
+			job_printf(j, "result %d\n", r);
+			fprintf(stderr, "job %s: %s\n", j->argv[0], r < 0 ? ucagb_strerror(r) : "done");
+			// start over with the next job
+			if(r == UCAGB_E_IO || r == UCAGB_E_TIMEOUT || r == UCAGB_E_GBA){
+				ucagb_close(w->s);
+				w->s = NULL;
+			}
+		}
+		close(j->fd);
+		free(j);
+		job_done();
+	}
+}
+
+// the worker changes directory for every job, whatever is used after that
+// is made absolute first, 0 on success
+static int absolute(const char *p, char *buf, uint size){
+	uint len;
+	if(p[0] == '/'){
+		return snprintf(buf, size, "%s", p) >= (int)size ? -1 : 0;
+	}
+	if(getcwd(buf, size) == NULL){
+		return -1;
+	}
+	len = strlen(buf);
+	return snprintf(buf + len, size - len, "/%s", p) >= (int)(size - len) ? -1 : 0;
+}
+
+int daemon_run(const char *devname, const char *path, const char *dfagb){
+	char dev_abs[0x200], path_abs[0x200], dfagb_abs[0x200];
+	struct sockaddr_un addr;
+	struct pollfd pfd[1 + DAEMON_MAX_PENDING];
+	struct worker w;
+	struct job *j, *pending[DAEMON_MAX_PENDING];
+	tThread t;
+	uint n = 0, i;
+	int fd, r;
+
+	if(absolute(path, path_abs, sizeof(path_abs)) || strlen(path_abs) >= sizeof(addr.sun_path)){
+		fprintf(stderr, "socket path too long\n");
+		return -1;
+	}
+	path = path_abs;
+	// the port is opened again, and DFAGB loaded again, after a failed job
+	if(absolute(devname, dev_abs, sizeof(dev_abs)) || (dfagb && absolute(dfagb, dfagb_abs, sizeof(dfagb_abs)))){
+		fprintf(stderr, "path too long\n");
+		return -1;
+	}
+	devname = dev_abs;
+	dfagb = dfagb ? dfagb_abs : NULL;
+	w.devname = devname;
+	w.dfagb = dfagb;
+	w.s = NULL;
+	r = session_start(&w);
+	if(r){
+		fprintf(stderr, "%s: %s\n", devname, ucagb_strerror(r));
+		ucagb_close(w.s);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if(fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 0x10)){
+		fprintf(stderr, "can't listen on %s: %s\n", path, strerror(errno));
+		ucagb_close(w.s);
+		return -1;
+	}
+	fprintf(stderr, "listening on %s\n", path);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	t = thread_start(worker_main, &w);
+
+	// the requests are read here as they come in, a client that is slow to
+	// send its own doesn't hold up the others, nor the ones behind it
+	while(!daemon_stop){
+		pfd[0].fd = fd;
+		pfd[0].events = n < DAEMON_MAX_PENDING ? POLLIN : 0;
+		for(i = 0; i < n; ++i){
+			pfd[1 + i].fd = pending[i]->fd;
+			pfd[1 + i].events = POLLIN;
+			pfd[1 + i].revents = 0;
+		}
+		if(poll(pfd, 1 + n, 200) < 0){
+			continue;
+		}
+		// from the back, the last one takes the place of one that is done
+		for(i = n; i--;){
+			j = pending[i];
+			r = pfd[1 + i].revents ? read_request(j) : 0;
+			if(!r && get_rtime() - j->t < DAEMON_REQ_MS){
+				continue;
+			}
+			pending[i] = pending[--n];
+			if(r > 0){
+				enqueue(j);
+			}else{
+				reject(j);
+			}
+		}
+		if(!(pfd[0].revents & POLLIN)){
+			continue;
+		}
+		j = malloc(sizeof(struct job));
+		j->fd = accept(fd, NULL, NULL);
+		if(j->fd < 0){
+			free(j);
+			continue;
+		}
+		j->len = 0;
+		j->t = get_rtime();
+		pending[n++] = j;
+	}
+	while(n){
+		reject(pending[--n]);
+	}
+
+	// the job running is finished, the queued ones too
+	fprintf(stderr, "stopping\n");
+	close(fd);
+	unlink(path);
+	pthread_mutex_lock(&queue.lock);
+	pthread_cond_signal(&queue.cond);
+	pthread_mutex_unlock(&queue.lock);
+	thread_join(t);
+	ucagb_close(w.s);
+	return 0;
+}
+
+int daemon_is_socket(const char *path){
+	struct stat st;
+	return !stat(path, &st) && S_ISSOCK(st.st_mode);
+}
+
+int daemon_client(const char *path, int argc, const char *argv[]){
+	struct sockaddr_un addr;
+	char buf[DAEMON_REQ_SIZE], line[0x400], op[0x40];
+	tSize len = 0, line_len = 0;
+	u32 done, total;
+	ssize_t n;
+	int fd, i, r = UCAGB_E_IO;
+	u64 t = get_ntime();
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr))){
+		fprintf(stderr, "can't connect to %s: %s\n", path, strerror(errno));
+		return UCAGB_E_OPEN;
+	}
+
+	if(getcwd(buf, sizeof(buf) - 1) == NULL){
+		close(fd);
+		return UCAGB_E_FILE;
+	}
+	len = strlen(buf);
+	buf[len++] = '\n';
+	for(i = 0; i < argc; ++i){
+		len += snprintf(buf + len, sizeof(buf) - len, "%s\n", argv[i]);
+		if(len >= sizeof(buf) - 1){
+			close(fd);
+			return UCAGB_E_PARAM;
+		}
+	}
+	buf[len++] = '\n';
+	send(fd, buf, len, MSG_NOSIGNAL);
+
+	while((n = recv(fd, buf, sizeof(buf), 0)) > 0){
+		for(i = 0; i < n; ++i){
+			if(buf[i] != '\n'){
+				if(line_len < sizeof(line) - 1){
+					line[line_len++] = buf[i];
+				}
+				continue;
+			}
+			line[line_len] = 0;
+			line_len = 0;
+			if(!strncmp(line, "log ", 4)){
+				fprintf(stderr, "%s\n", line + 4);
+			}else if(sscanf(line, "progress %63s %u %u", op, &done, &total) == 3){
+				fprintf(stderr, "%s %u/%u\n", op, done, total);
+			}else if(sscanf(line, "queued %u", &done) == 1 && done){
+				fprintf(stderr, "%u jobs ahead\n", done);
+			}else if(sscanf(line, "result %d", &r) == 1){
+				fprintf(stderr, "%.3f seconds\n", (get_ntime() - t) / 1e9);
+			}
+		}
+	}
+	close(fd);
+	return r;
+}
+#endif
@@ -0,0 +1,9 @@
+#ifndef daemon_h__
+#define daemon_h__
+
+// serves jobs on the socket until SIGINT/SIGTERM, dfagb can be NULL
+int daemon_run(const char *devname, const char *path, const char *dfagb);
+// sends one job and waits for it, returns its UCAGB_* result
+int daemon_client(const char *path, int argc, const char *argv[]);
+int daemon_is_socket(const char *path);
+#endif
@@ -0,0 +1,130 @@
+/*
+link fault injection
+===
+every byte draws one random number, a flip rate p per bit becomes about
+8p per byte and flips one bit of it, rates are kept as 32 bit thresholds
+so anything below 2^-32 per byte rounds to never
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pl.h"
+#include "fault.h"
+#include "metrics.h"
+
+volatile int fault_on;
+// unsafe=1, faults even if the other end isn't the emulator
+static int unsafe;
+
+static struct {
+	double flip, drop, spike;
+	u32 spike_ms;
+	// which of FAULT_UP and FAULT_DOWN
+	int dir[2];
+	// per byte, and per read_serial call
+	u32 t_flip, t_drop, t_spike;
+	u64 x;
+} cfg = {0, 0, 0, 200, {1, 1}, 0, 0, 0, 0x9e3779b97f4a7c15ull};
+
+// xorshift64*, the high half
+static u32 rnd(void){
+	cfg.x ^= cfg.x >> 12;
+	cfg.x ^= cfg.x << 25;
+	cfg.x ^= cfg.x >> 27;
+	return (u32)((cfg.x * 0x2545f4914f6cdd1dull) >> 32);
+}
+
+static u32 threshold(double p){
+	if(p <= 0){
+		return 0;
+	}
+	return p >= 1 ? 0xffffffff : (u32)(p * 4294967296.0);
+}
+
+static void update(void){
+	// 1 - (1 - p)^8, close enough to 8p for any rate worth measuring
+	cfg.t_flip = threshold(cfg.flip * 8);
+	cfg.t_drop = threshold(cfg.drop);
+	cfg.t_spike = threshold(cfg.spike);
+	fault_on = cfg.t_flip || cfg.t_drop || cfg.t_spike;
+}
+
+int fault_parse(const char *spec){
+	char buf[0x100], *p, *v;
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+	for(p = strtok(buf, ","); p; p = strtok(NULL, ",")){
+		v = strchr(p, '=');
+		if(!v){
+			fprintf(stderr, "invalid fault spec: %s\n", p);
+			return -1;
+		}
+		*v++ = 0;
+		if(!strcmp(p, "flip")){
+			cfg.flip = atof(v);
+		}else if(!strcmp(p, "drop")){
+			cfg.drop = atof(v);
+		}else if(!strcmp(p, "spike")){
+			cfg.spike = atof(v);
+		}else if(!strcmp(p, "spike_ms")){
+			cfg.spike_ms = atoi(v);
+		}else if(!strcmp(p, "seed")){
+			cfg.x = strtoull(v, NULL, 0) * 0x9e3779b97f4a7c15ull | 1;
+		}else if(!strcmp(p, "unsafe")){
+			unsafe = atoi(v);
+		}else if(!strcmp(p, "dir")){
+			cfg.dir[FAULT_UP] = !strcmp(v, "up") || !strcmp(v, "both");
+			cfg.dir[FAULT_DOWN] = !strcmp(v, "down") || !strcmp(v, "both");
+		}else{
+			fprintf(stderr, "invalid fault spec: %s\n", p);
+			return -1;
+		}
+	}
+	update();
+	return 0;
+}
+
+int fault_allowed(int emulator){
+	if(emulator || unsafe){
+		return 0;
+	}
+	fprintf(stderr, "refusing to inject faults, a garbled word can erase or program a flash cart\n"
+		"use emu/ucagbemu, or add unsafe=1 to --faults if there is no cart to lose\n");
+	return -1;
+}
+
+void fault_set_flip(double rate){
+	cfg.flip = rate;
+	update();
+}
+
+tSize fault_apply(int dir, u8 *p, tSize n){
+	tSize i, o = 0;
+	u32 x;
+	if(!cfg.dir[dir] || !(cfg.t_flip || cfg.t_drop)){
+		return n;
+	}
+	for(i = 0; i < n; ++i){
+		x = rnd();
+		if(x < cfg.t_drop){
+			METRIC_INC(M_FAULT_DROPS);
+			continue;
+		}
+		p[o] = p[i];
+		// the same draw, the flip range sits right above the drop range
+		if(x - cfg.t_drop < cfg.t_flip){
+			p[o] ^= 1 << (x & 7);
+			METRIC_INC(M_FAULT_FLIPS);
+		}
+		++o;
+	}
+	return o;
+}
+
+void fault_spike(void){
+	if(cfg.t_spike && rnd() < cfg.t_spike){
+		METRIC_INC(M_FAULT_SPIKES);
+		sleep(cfg.spike_ms);
+	}
+}
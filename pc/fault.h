@@ -0,0 +1,33 @@
+#ifndef fault_h__
+#define fault_h__
+
+#include "pl.h"
+
+/*
+link fault injection
+===
+corrupts the serial stream on the host side of the rings, to measure
+what the retry paths cost, see the faultsweep bench
+the spec is comma separated, rates are per bit (flip) or per byte (drop)
+	flip=1e-6,drop=1e-8,spike=1e-3,spike_ms=200,dir=down,seed=1
+dir is up, down or both (the default), spike is per read_serial call
+corrupted commands can reach DFAGB as anything, an erase or a program
+included, so a session refuses them unless the uCSIO is emu/ucagbemu,
+unsafe=1 in the spec overrides that, never with a flash cart in the slot
+*/
+#define FAULT_UP 0
+#define FAULT_DOWN 1
+
+// nonzero while any rate is set
+extern volatile int fault_on;
+
+int fault_parse(const char *spec);
+// 0 if faults may be injected into a link to that, -1 and why if not
+int fault_allowed(int emulator);
+// the bit flip rate of both directions, for sweeps
+void fault_set_flip(double rate);
+// flips and drops in place, returns how many bytes are left
+tSize fault_apply(int dir, u8 *p, tSize n);
+// before a read, maybe sleeps spike_ms
+void fault_spike(void);
+#endif
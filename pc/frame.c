@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/common.h"
+#include "frame.h"
+#include "metrics.h"
+
+// returns space for n more bytes, the buffer only grows
+// so after the first use it's effectively preallocated
+u8 *frame_reserve(struct frame *f, tSize n){
+	u8 *p;
+	if(f->len + n > f->size){
+		f->size = f->size ? f->size : 0x1000;
+		while(f->len + n > f->size){
+			f->size <<= 1;
+		}
+		f->buf = realloc(f->buf, f->size);
+	}
+	p = f->buf + f->len;
+	f->len += n;
+	return p;
+}
+
+void frame_xfer32(struct frame *f, u32 data){
+	u8 *p = frame_reserve(f, 5);
+	p[0] = CMD_XFER | CMD_FLAG_W | CMD_FLAG_R;
+	memcpy(p + 1, &data, 4);
+	METRIC_INC(M_SIO_WORDS);
+}
+
+void frame_xfer32wo(struct frame *f, u32 data){
+	u8 *p = frame_reserve(f, 5);
+	p[0] = CMD_XFER | CMD_FLAG_W;
+	memcpy(p + 1, &data, 4);
+	METRIC_INC(M_SIO_WORDS);
+}
+
+void frame_xfer32ro(struct frame *f){
+	*frame_reserve(f, 1) = CMD_XFER | CMD_FLAG_R;
+	METRIC_INC(M_SIO_WORDS);
+}
+
+// CMD_XFER | CMD_FLAG_B per BULK_SIZE words, see xfer32bw
+// or CMD_XFERN and its count per bulk words, the last one gets the rest
+void frame_xfer32bw(struct frame *f, const u8 *data, tSize size, uint bulk){
+	tSize n = size / (BULK_SIZE << 2), i, k, words = size >> 2;
+	u8 *p;
+	if(bulk){
+		p = frame_reserve(f, (words + bulk - 1) / bulk * 2 + (words << 2));
+		for(i = 0; i < words; i += k){
+			k = words - i < bulk ? words - i : bulk;
+			*p++ = CMD_XFERN | CMD_FLAG_W | CMD_FLAG_B;
+			*p++ = (u8)k;
+			memcpy(p, data, k << 2);
+			p += k << 2;
+			data += k << 2;
+		}
+		METRIC_ADD(M_SIO_WORDS, words);
+		return;
+	}
+	p = frame_reserve(f, n * (1 + (BULK_SIZE << 2)));
+	for(i = 0; i < n; ++i){
+		*p++ = CMD_XFER | CMD_FLAG_W | CMD_FLAG_B;
+		memcpy(p, data, BULK_SIZE << 2);
+		p += BULK_SIZE << 2;
+		data += BULK_SIZE << 2;
+	}
+	METRIC_ADD(M_SIO_WORDS, n * BULK_SIZE);
+}
+
+// the read counterpart, words is a multiple of BULK_SIZE without bulk
+void frame_xfer32br(struct frame *f, tSize words, uint bulk){
+	tSize i, k;
+	u8 *p;
+	METRIC_ADD(M_SIO_WORDS, words);
+	if(!bulk){
+		memset(frame_reserve(f, words / BULK_SIZE), CMD_XFER | CMD_FLAG_R | CMD_FLAG_B, words / BULK_SIZE);
+		return;
+	}
+	p = frame_reserve(f, (words + bulk - 1) / bulk * 2);
+	for(i = 0; i < words; i += k){
+		k = words - i < bulk ? words - i : bulk;
+		*p++ = CMD_XFERN | CMD_FLAG_R | CMD_FLAG_B;
+		*p++ = (u8)k;
+	}
+}
+
+// a CMD_XFER | CMD_FLAG_W per word, see xfer32sbw
+void frame_xfer32sbw(struct frame *f, const u8 *data, tSize size){
+	tSize n = size / (BULK_SIZE << 2) * BULK_SIZE, i;
+	u8 *p = frame_reserve(f, n * 5);
+	for(i = 0; i < n; ++i){
+		*p++ = CMD_XFER | CMD_FLAG_W;
+		memcpy(p, data, 4);
+		p += 4;
+		data += 4;
+	}
+	METRIC_ADD(M_SIO_WORDS, n);
+}
+
+void frame_send(tDev d, struct frame *f){
+	tSize i, n;
+	for(i = 0; i < f->len; i += n){
+		n = f->len - i;
+		if(n > FRAME_WRITE_MAX){
+			n = FRAME_WRITE_MAX;
+		}
+		write_serial(d, f->buf + i, n);
+	}
+	f->len = 0;
+}
+
+void frame_free(struct frame *f){
+	free(f->buf);
+	f->buf = NULL;
+	f->len = 0;
+	f->size = 0;
+}
@@ -0,0 +1,22 @@
+#include "pl.h"
+
+// a transmit frame, the entire command stream (command bytes interleaved
+// with payload) is laid out here first and goes out in a few large writes
+struct frame {
+	u8 *buf;
+	tSize len, size;
+};
+
+// WriteFile fails if a single write goes too big
+#define FRAME_WRITE_MAX 0x10000
+
+u8 *frame_reserve(struct frame *f, tSize n);
+void frame_xfer32(struct frame *f, u32 data);
+void frame_xfer32wo(struct frame *f, u32 data);
+void frame_xfer32ro(struct frame *f);
+// bulk is the CMD_XFERN word limit, 0 for the BULK_SIZE bulks every uCSIO has
+void frame_xfer32bw(struct frame *f, const u8 *data, tSize size, uint bulk);
+void frame_xfer32br(struct frame *f, tSize words, uint bulk);
+void frame_xfer32sbw(struct frame *f, const u8 *data, tSize size);
+void frame_send(tDev d, struct frame *f);
+void frame_free(struct frame *f);
@@ -1,107 +1,194 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "pl.h"
 #include "../common/common.h"
 #include "gba.h"
 #include "gbaencryption.h"
+#include "frame.h"
+#include "trace.h"
+#include "metrics.h"
+
+/*
+transaction queue
+===
+transfers are posted to the frame, replies are collected later in the same order
+uCSIO handles commands strictly in order, so the replies are simply
+the next 4 bytes on the line, we only have to count them
+at most XQ_INFLIGHT replies are left on the line, more than that and
+they are pulled into the reply ring so the OS buffer never fills up
+the blocking xfer32* below are thin wrappers of these
+every device has its own, allocated on first use and freed by gba_free
+*/
+#define XQ_INFLIGHT 0x100
+#define XQ_RING 0x400 // must be a power of 2 and >= XQ_INFLIGHT
+
+struct xq {
+	// reused by every bulk transfer, it only grows
+	struct frame tx;
+	u32 ring[XQ_RING];
+	uint head, tail, inflight;
+};
+
+static struct xq *xq_of(tDev d){
+	if(!d->xq){
+		d->xq = calloc(1, sizeof(struct xq));
+	}
+	return d->xq;
+}
+
+void gba_free(tDev d){
+	if(d->xq){
+		frame_free(&d->xq->tx);
+		free(d->xq);
+		d->xq = NULL;
+	}
+}
+
+// send everything posted, pull the replies on the line into the ring
+static void xq_drain(tDev d){
+	struct xq *q = xq_of(d);
+	uint i, n = q->inflight;
+	u32 r[XQ_INFLIGHT];
+	frame_send(d, &q->tx);
+	if(!n){
+		return;
+	}
+	if(q->tail - q->head + n > XQ_RING){
+		dev_printf(d, "xq: %d replies not collected\n", q->tail - q->head);
+	}
+	read_serial(d, r, n << 2);
+	for(i = 0; i < n; ++i){
+		q->ring[q->tail++ & (XQ_RING - 1)] = r[i];
+	}
+	q->inflight = 0;
+}
+
+static void xq_expect(tDev d){
+	if(++xq_of(d)->inflight >= XQ_INFLIGHT){
+		xq_drain(d);
+	}
+}
+
+void xq_post32(tDev d, u32 data){
+	frame_xfer32(&xq_of(d)->tx, data);
+	xq_expect(d);
+}
+
+void xq_post32wo(tDev d, u32 data){
+	frame_xfer32wo(&xq_of(d)->tx, data);
+}
+
+void xq_post32ro(tDev d){
+	frame_xfer32ro(&xq_of(d)->tx);
+	xq_expect(d);
+}
+
+void xq_flush(tDev d){
+	frame_send(d, &xq_of(d)->tx);
+}
+
+u32 xq_collect32(tDev d){
+	struct xq *q = xq_of(d);
+	if(q->head == q->tail){
+		xq_drain(d);
+	}
+	if(q->head == q->tail){
+		dev_printf(d, "xq: nothing to collect\n");
+		return 0;
+	}
+	return q->ring[q->head++ & (XQ_RING - 1)];
+}
 
 u32 xfer32(tDev d, u32 data){
-	u8 c[5];
-	c[0] = CMD_XFER | CMD_FLAG_W | CMD_FLAG_R;
-	*(u32*)&c[1] = data;
-	write_serial(d, c, 5);
-	read_serial(d, c, 4);
-	return *(u32*)c;
+	xq_post32(d, data);
+	return xq_collect32(d);
 }
 
 // write only
 void xfer32wo(tDev d, u32 data){
-	u8 c[5];
-	c[0] = CMD_XFER | CMD_FLAG_W;
-	*(u32*)&c[1] = data;
-	write_serial(d, c, 5);
+	xq_post32wo(d, data);
+	xq_flush(d);
 }
 
 // read only
 u32 xfer32ro(tDev d){
-	u8 c[4];
-	c[0] = CMD_XFER | CMD_FLAG_R;
-	write_serial(d, c, 1);
-	read_serial(d, c, 4);
-	return *(u32*)c;
+	xq_post32ro(d);
+	return xq_collect32(d);
 }
 
 // PC -> uC use bulk read/write in a single CMD_XWB command
 // so uC -> GBA will use bulk xfer too
 // this need set_wait(22) to work with multiboot
 void xfer32bw(tDev d, const u8* data, tSize size){
-	u8 c = CMD_XFER | CMD_FLAG_W | CMD_FLAG_B;
-	uint i;
-	for(i = 0; i < size / (BULK_SIZE << 2); ++i){
-		write_serial(d, &c, 1);
-		write_serial(d, data + i * (BULK_SIZE << 2), BULK_SIZE << 2);
-	}
+	frame_xfer32bw(&xq_of(d)->tx, data, size, d->bulk_w);
+	frame_send(d, &xq_of(d)->tx);
 }
 
+// bulk read commands are sent XFER_BR_WINDOW words at a time
+// the reader thread keeps draining the device, so a window can be large,
+// it only has to fit in the receive ring
+#define XFER_BR_WINDOW (0x400 * BULK_SIZE)
 void xfer32br(tDev d, u8* data, tSize size){
-	u8 c = CMD_XFER | CMD_FLAG_R | CMD_FLAG_B;
-	uint i;
-	for(i = 0; i < size / (BULK_SIZE << 2); ++i){
-		write_serial(d, &c, 1);
-		read_serial(d, data + i * (BULK_SIZE << 2), BULK_SIZE << 2);
+	uint i, n, total = size >> 2;
+	xq_drain(d);
+	for(i = 0; i < total; i += n){
+		n = total - i;
+		if(n > XFER_BR_WINDOW){
+			n = XFER_BR_WINDOW;
+		}
+		frame_xfer32br(&xq_of(d)->tx, n, d->bulk_r);
+		frame_send(d, &xq_of(d)->tx);
+		read_serial(d, data + (i << 2), n << 2);
 	}
 }
 
-// semi bulk mode, PC -> uC use bulk write, but that's just an array of CMD_XW
-// well this one works with multiboot with set_wait(0)
-static void xfer32sbw(tDev d, u8* data, tSize size){
-	u8 c[BULK_SIZE * 5];
-	uint i, j;
-	for(i = 0; i < BULK_SIZE; ++i){
-		c[i * 5] = CMD_XFER | CMD_FLAG_W;
-	}
-	for(i = 0; i < size / (BULK_SIZE << 2); ++i){
-		for(j = 0; j < BULK_SIZE; ++j){
-			*(u32*)(c + j * 5 + 1) = *(u32*)(data + (i * BULK_SIZE + j) * 4);
-		}
-		write_serial(d, c, BULK_SIZE * 5);
-	}
+// write a command word followed by a bulk payload, all in one frame
+void xfer32wbw(tDev d, u32 cmd, const u8* data, tSize size){
+	frame_xfer32wo(&xq_of(d)->tx, cmd);
+	frame_xfer32bw(&xq_of(d)->tx, data, size, d->bulk_w);
+	frame_send(d, &xq_of(d)->tx);
 }
 
+// semi bulk mode, PC -> uC use bulk write, but that's just an array of CMD_XW
+// well this one works with multiboot with set_wait(0)
+// gba_send_main puts it straight into tx with frame_xfer32sbw
 static uint xfer16(tDev d, uint data){
 	return xfer32(d, data & 0xffff) >> 16;
 }
 
-static void xfer16wo(tDev d, uint data){
-	xfer32wo(d, data & 0xffff);
-}
-
 int gba_ready(tDev d){
 	uint ret, timeout = 0x100;
+	TRACE_BEGIN(t0);
 	do {
 		ret = xfer16(d, 0x6202);
-		fprintf(stderr, "\rwaiting: received 0x%04x", ret);
+		dev_printf(d, "\rwaiting: received 0x%04x", ret);
 		--timeout;
 		sleep(1000/0x10);
 	}while(ret != 0x7202 && timeout);
+	TRACE_END(t0, "mb_ready");
 	if(ret != 0x7202){
-		fprintf(stderr, "\nwaiting timeout\n");
+		dev_printf(d, "\nwaiting timeout\n");
 		return -1;
 	}
-	fprintf(stderr, "\nready\n");
+	dev_printf(d, "\nready\n");
 	return 0;
 }
 
 static int gba_send_header(tDev d, const u8 *header){
 	uint i, ret;
-	xfer16wo(d, 0x6100);
-	fprintf(stderr, "sending header...\n");
+	TRACE_BEGIN(t0);
+	frame_xfer32wo(&xq_of(d)->tx, 0x6100);
+	dev_printf(d, "sending header...\n");
 	for (i = 0; i < 0x60; ++i){
-		xfer16wo(d, ((u16 *)header)[i]);
-		// fprintf(stderr, "\rheader (%d%%): received 0x%04x", (i * 100) / 0x60, ret);
+		frame_xfer32wo(&xq_of(d)->tx, ((u16 *)header)[i]);
+		// dev_printf(d, "\rheader (%d%%): received 0x%04x", (i * 100) / 0x60, ret);
 	}
-	ret = xfer16(d, 0x6200);
-	fprintf(stderr, "\rheader complete: received 0x%04x\n", ret);
+	xq_post32(d, 0x6200);
+	ret = xq_collect32(d) >> 16;
+	TRACE_END(t0, "mb_header");
+	dev_printf(d, "\rheader complete: received 0x%04x\n", ret);
 	return 0;
 }
 
@@ -112,12 +199,15 @@ static int gba_send_header(tDev d, const u8 *header){
 static void gba_exchange_keys(tDev d, uint size, struct gbaCrcState *pcrc, struct gbaEncryptionState *penc){
 	uint ret, seed, hh, rr;
 	u8 pp = 0x81 + P_COLOR * 0x10 + P_DIR * 0x8 + P_SPEED * 0x2;
+	TRACE_BEGIN(t0);
 
-	ret = xfer16(d, 0x6300 | pp);
-	fprintf(stderr, "send encryption key: received 0x%04x\n", ret);
+	xq_post32(d, 0x6300 | pp);
+	xq_post32(d, 0x6300 | pp);
+	ret = xq_collect32(d) >> 16;
+	dev_printf(d, "send encryption key: received 0x%04x\n", ret);
 
-	ret = xfer16(d, 0x6300 | pp);
-	fprintf(stderr, "get encryption key: received 0x%04x\n", ret);
+	ret = xq_collect32(d) >> 16;
+	dev_printf(d, "get encryption key: received 0x%04x\n", ret);
 	if ((ret >> 8) != 0x73){
 		return;
 	}
@@ -126,69 +216,87 @@ static void gba_exchange_keys(tDev d, uint size, struct gbaCrcState *pcrc, struc
 	hh = (ret + 0x0f) & 0xff;
 
 	ret = xfer16(d, 0x6400 | hh);
-	fprintf(stderr, "encryption confirmation: received 0x%04x\n", ret);
+	dev_printf(d, "encryption confirmation: received 0x%04x\n", ret);
 
 	sleep(1000/16);
 
 	ret = xfer16(d, ((size - 0xc0) >> 2) - 0x34);
-	fprintf(stderr, "size exchange: received 0x%04x\n", ret);
+	dev_printf(d, "size exchange: received 0x%04x\n", ret);
 	rr = ret & 0xff;
 
 	gbaCrcInit(hh, rr, pcrc);
 	gbaEncryptionInit(seed, penc);
+	TRACE_END(t0, "mb_keys");
 }
 
+// a multiple of BULK_SIZE words
+#define MB_CHUNK 0x2000
+
 static int gba_send_main(tDev d, u8 *rom, tSize size){
-	uint ret, offset, timeout;
+	uint ret, offset, n, timeout;
 	u32 *p;
 	struct gbaCrcState crc;
 	struct gbaEncryptionState enc;
+	u64 t0;
 
 	ret = xfer16(d, 0x6202);
-	fprintf(stderr, "sending command: received 0x%04x\n", ret);
+	dev_printf(d, "sending command: received 0x%04x\n", ret);
 
 	gba_exchange_keys(d, size, &crc, &enc);
 
 #define USE_BULK 1
 #if USE_BULK
-	fprintf(stderr, "encrypting main block...\n");
+	// a chunk is handed to the writer thread while the next one is encrypted
+	dev_printf(d, "encrypting and sending main block...\n");
+	t0 = trace_on ? get_ntime() : 0;
+	for(offset = 0xc0; offset < size; offset += n){
+		TRACE_BEGIN(t1);
+		n = size - offset > MB_CHUNK ? MB_CHUNK : size - offset;
+		p = (u32*)&rom[offset];
+		gbaCrcAddBlock(p, n >> 2, &crc);
+		gbaEncryptBlock(p, n >> 2, offset, &enc);
+		TRACE_END_ARG(t1, "mb_encrypt", "bytes", n);
+		frame_xfer32sbw(&xq_of(d)->tx, rom + offset, n);
+		// the last one waits for 0x0065
+		if(offset + n < size){
+			xq_flush(d);
+		}
+	}
 #else
-	fprintf(stderr, "encrypting and sending main block...\n");
-#endif
+	dev_printf(d, "encrypting and sending main block...\n");
 	for(offset = 0xc0, p = (u32*)&rom[offset]; offset < size; offset += 4, ++p){
 		gbaCrcAdd(*p, &crc);
 		*p = gbaEncrypt(*p, offset, &enc);
-#if USE_BULK
-	}
-	fprintf(stderr, "sending main block...\n");
-	xfer32sbw(d, rom + 0xc0, size - 0xc0);
-#else
-		xfer32wo(d, *p);
+		xq_post32wo(d, *p);
 	}
 #endif
 
+	// goes out in the same frame as the main block
+	xq_post32(d, 0x0065);
+	ret = xq_collect32(d) >> 16;
+	TRACE_END_ARG(t0, "mb_main", "bytes", size - 0xc0);
+	dev_printf(d, "\rmain block complete: received 0x%04x\n", ret);
 
-	ret = xfer16(d, 0x0065);
-	fprintf(stderr, "\rmain block complete: received 0x%04x\n", ret);
-
+	t0 = trace_on ? get_ntime() : 0;
 	timeout = 0x20;
 	do{
 		ret = xfer16(d, 0x0065);
-		fprintf(stderr, "\rchecksum wait: received 0x%04x", ret);
+		dev_printf(d, "\rchecksum wait: received 0x%04x", ret);
 		--timeout;
 		sleep(1000/0x10);
 	}while(ret != 0x0075 && timeout);
 	if(ret != 0x0075){
-		fprintf(stderr, "\nchecksum waiting timeout\n");
+		dev_printf(d, "\nchecksum waiting timeout\n");
 		return -1;
 	}
 
 	ret = xfer16(d, 0x0066);
-	fprintf(stderr, "\nchecksum tx: received 0x%04x\n", ret);
+	dev_printf(d, "\nchecksum tx: received 0x%04x\n", ret);
 	gbaCrcFinalize(ret, &crc);
 
 	ret = xfer16(d, crc.crc);
-	fprintf(stderr, "checksum rx: received 0x%04x expected 0x%04x\n", ret, crc.crc & 0xffff);
+	dev_printf(d, "checksum rx: received 0x%04x expected 0x%04x\n", ret, crc.crc & 0xffff);
+	TRACE_END(t0, "mb_checksum");
 
 	return 0;
 }
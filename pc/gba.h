@@ -1,11 +1,20 @@
 #include "pl.h"
 
+void xq_post32(tDev d, u32 data);
+void xq_post32wo(tDev d, u32 data);
+void xq_post32ro(tDev d);
+void xq_flush(tDev d);
+u32 xq_collect32(tDev d);
+
 u32 xfer32(tDev d, u32 data);
 void xfer32wo(tDev d, u32 data);
 u32 xfer32ro(tDev d);
 
 void xfer32bw(tDev d, const u8* data, tSize size);
 void xfer32br(tDev d, u8* data, tSize size);
+void xfer32wbw(tDev d, u32 cmd, const u8* data, tSize size);
 
 int gba_ready(tDev d);
 int gba_multiboot(tDev d, u8 *rom, tSize size);
+// frees the per device transfer state, before close_serial
+void gba_free(tDev d);
@@ -56,3 +56,177 @@ unsigned gbaEncrypt(unsigned data, unsigned ptr, struct gbaEncryptionState *stat
     data = (state->seed ^ data)^(ptr ^ state->kk);
     return data;
 }
+
+/*
+block versions, same results as the word at a time functions above
+the CRC goes a byte at a time through a table of the 0xc37b polynomial
+the keystream is the LCG seed = seed * 0x6F646573 + 1, GBA_LANES words
+are encrypted side by side, every lane jumping GBA_LANES steps ahead at once
+so the compiler can keep them in vector registers
+*/
+#define GBA_CRC_XX 0xc37b
+#define GBA_LCG_A 0x6F646573
+#define GBA_LANES 8
+
+static const unsigned short gbaCrcTable[0x100] = {
+	0x0000, 0x9ca4, 0xbfbf, 0x231b, 0xf989, 0x652d, 0x4636, 0xda92,
+	0x75e5, 0xe941, 0xca5a, 0x56fe, 0x8c6c, 0x10c8, 0x33d3, 0xaf77,
+	0xebca, 0x776e, 0x5475, 0xc8d1, 0x1243, 0x8ee7, 0xadfc, 0x3158,
+	0x9e2f, 0x028b, 0x2190, 0xbd34, 0x67a6, 0xfb02, 0xd819, 0x44bd,
+	0x5163, 0xcdc7, 0xeedc, 0x7278, 0xa8ea, 0x344e, 0x1755, 0x8bf1,
+	0x2486, 0xb822, 0x9b39, 0x079d, 0xdd0f, 0x41ab, 0x62b0, 0xfe14,
+	0xbaa9, 0x260d, 0x0516, 0x99b2, 0x4320, 0xdf84, 0xfc9f, 0x603b,
+	0xcf4c, 0x53e8, 0x70f3, 0xec57, 0x36c5, 0xaa61, 0x897a, 0x15de,
+	0xa2c6, 0x3e62, 0x1d79, 0x81dd, 0x5b4f, 0xc7eb, 0xe4f0, 0x7854,
+	0xd723, 0x4b87, 0x689c, 0xf438, 0x2eaa, 0xb20e, 0x9115, 0x0db1,
+	0x490c, 0xd5a8, 0xf6b3, 0x6a17, 0xb085, 0x2c21, 0x0f3a, 0x939e,
+	0x3ce9, 0xa04d, 0x8356, 0x1ff2, 0xc560, 0x59c4, 0x7adf, 0xe67b,
+	0xf3a5, 0x6f01, 0x4c1a, 0xd0be, 0x0a2c, 0x9688, 0xb593, 0x2937,
+	0x8640, 0x1ae4, 0x39ff, 0xa55b, 0x7fc9, 0xe36d, 0xc076, 0x5cd2,
+	0x186f, 0x84cb, 0xa7d0, 0x3b74, 0xe1e6, 0x7d42, 0x5e59, 0xc2fd,
+	0x6d8a, 0xf12e, 0xd235, 0x4e91, 0x9403, 0x08a7, 0x2bbc, 0xb718,
+	0xc37b, 0x5fdf, 0x7cc4, 0xe060, 0x3af2, 0xa656, 0x854d, 0x19e9,
+	0xb69e, 0x2a3a, 0x0921, 0x9585, 0x4f17, 0xd3b3, 0xf0a8, 0x6c0c,
+	0x28b1, 0xb415, 0x970e, 0x0baa, 0xd138, 0x4d9c, 0x6e87, 0xf223,
+	0x5d54, 0xc1f0, 0xe2eb, 0x7e4f, 0xa4dd, 0x3879, 0x1b62, 0x87c6,
+	0x9218, 0x0ebc, 0x2da7, 0xb103, 0x6b91, 0xf735, 0xd42e, 0x488a,
+	0xe7fd, 0x7b59, 0x5842, 0xc4e6, 0x1e74, 0x82d0, 0xa1cb, 0x3d6f,
+	0x79d2, 0xe576, 0xc66d, 0x5ac9, 0x805b, 0x1cff, 0x3fe4, 0xa340,
+	0x0c37, 0x9093, 0xb388, 0x2f2c, 0xf5be, 0x691a, 0x4a01, 0xd6a5,
+	0x61bd, 0xfd19, 0xde02, 0x42a6, 0x9834, 0x0490, 0x278b, 0xbb2f,
+	0x1458, 0x88fc, 0xabe7, 0x3743, 0xedd1, 0x7175, 0x526e, 0xceca,
+	0x8a77, 0x16d3, 0x35c8, 0xa96c, 0x73fe, 0xef5a, 0xcc41, 0x50e5,
+	0xff92, 0x6336, 0x402d, 0xdc89, 0x061b, 0x9abf, 0xb9a4, 0x2500,
+	0x30de, 0xac7a, 0x8f61, 0x13c5, 0xc957, 0x55f3, 0x76e8, 0xea4c,
+	0x453b, 0xd99f, 0xfa84, 0x6620, 0xbcb2, 0x2016, 0x030d, 0x9fa9,
+	0xdb14, 0x47b0, 0x64ab, 0xf80f, 0x229d, 0xbe39, 0x9d22, 0x0186,
+	0xaef1, 0x3255, 0x114e, 0x8dea, 0x5778, 0xcbdc, 0xe8c7, 0x7463,
+};
+
+void gbaCrcAddBlock(const unsigned *data, unsigned count, struct gbaCrcState *state) {
+    unsigned crc = state->crc, d, i;
+
+    if (state->xx != GBA_CRC_XX) {
+        for (i = 0 ; i < count ; i++) gbaCrcAdd(data[i], state);
+        return;
+    }
+    for (i = 0 ; i < count ; i++)
+    {
+        d = data[i];
+        crc = (crc >> 8) ^ gbaCrcTable[(crc ^ d) & 0xff];
+        crc = (crc >> 8) ^ gbaCrcTable[(crc ^ (d >> 8)) & 0xff];
+        crc = (crc >> 8) ^ gbaCrcTable[(crc ^ (d >> 16)) & 0xff];
+        crc = (crc >> 8) ^ gbaCrcTable[(crc ^ (d >> 24)) & 0xff];
+    }
+    state->crc = crc;
+}
+
+// n steps of the LCG as a single seed * a + c
+static void gbaLcgJump(unsigned n, unsigned *pa, unsigned *pc) {
+    unsigned a = GBA_LCG_A, c = 1, ra = 1, rc = 0;
+    while (n)
+    {
+        if (n & 1) {
+            ra *= a;
+            rc = rc * a + c;
+        }
+        c = c * a + c;
+        a *= a;
+        n >>= 1;
+    }
+    *pa = ra;
+    *pc = rc;
+}
+
+void gbaEncryptBlock(unsigned *data, unsigned count, unsigned ptr, struct gbaEncryptionState *state) {
+    unsigned seed[GBA_LANES], neg[GBA_LANES], kk = state->kk, a, c, i, j;
+
+    // lane j starts j + 1 steps ahead, like gbaEncrypt it advances before use
+    for (j = 0 ; j < GBA_LANES ; j++)
+    {
+        gbaLcgJump(j + 1, &a, &c);
+        seed[j] = state->seed * a + c;
+        neg[j] = ~(ptr + j * 4 + 0x02000000) + 1;
+    }
+    gbaLcgJump(GBA_LANES, &a, &c);
+
+    for (i = 0 ; i + GBA_LANES <= count ; i += GBA_LANES)
+    {
+        for (j = 0 ; j < GBA_LANES ; j++)
+        {
+            data[i + j] ^= seed[j] ^ neg[j] ^ kk;
+            seed[j] = seed[j] * a + c;
+            neg[j] -= GBA_LANES * 4;
+        }
+    }
+    for (j = 0 ; i + j < count ; j++) data[i + j] ^= seed[j] ^ neg[j] ^ kk;
+
+    gbaLcgJump(count, &a, &c);
+    state->seed = state->seed * a + c;
+}
+
+#ifdef GBAENCTEST
+// gcc -DGBAENCTEST -O2 gbaencryption.c && ./a.out
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+    unsigned n = 0x40000 >> 2, *a = malloc(n * 4), *b = malloc(n * 4), i, count, fail = 0;
+    struct gbaCrcState ca, cb;
+    struct gbaEncryptionState ea, eb;
+    double t;
+
+    srand(1);
+    for (i = 0 ; i < n ; i++) a[i] = rand() ^ (rand() << 16);
+    // every length up to a few rounds of lanes, then a whole multiboot image
+    for (count = 0 ; count <= n ; count = count < 0x40 ? count + 1 : n)
+    {
+        memcpy(b, a, n * 4);
+        gbaCrcInit(0x12, 0x34, &ca); gbaCrcInit(0x12, 0x34, &cb);
+        gbaEncryptionInit(0xffff7381, &ea); gbaEncryptionInit(0xffff7381, &eb);
+        for (i = 0 ; i < count ; i++)
+        {
+            gbaCrcAdd(a[i], &ca);
+            a[i] = gbaEncrypt(a[i], 0xc0 + i * 4, &ea);
+        }
+        gbaCrcAddBlock(b, count, &cb);
+        gbaEncryptBlock(b, count, 0xc0, &eb);
+        if (memcmp(a, b, count * 4) || ca.crc != cb.crc || ea.seed != eb.seed)
+        {
+            printf("mismatch at %u words\n", count);
+            fail++;
+        }
+        memcpy(a, b, n * 4);
+        if (count == n) break;
+    }
+
+    t = now();
+    for (count = 0 ; count < 0x40 ; count++)
+    {
+        for (i = 0 ; i < n ; i++)
+        {
+            gbaCrcAdd(a[i], &ca);
+            a[i] = gbaEncrypt(a[i], 0xc0 + i * 4, &ea);
+        }
+    }
+    printf("word at a time %8.1f MB/s\n", n * 4 * 0x40 / (now() - t) / 1e6);
+    t = now();
+    for (count = 0 ; count < 0x40 ; count++)
+    {
+        gbaCrcAddBlock(b, n, &cb);
+        gbaEncryptBlock(b, n, 0xc0, &eb);
+    }
+    printf("block          %8.1f MB/s\n", n * 4 * 0x40 / (now() - t) / 1e6);
+    if (ca.crc != cb.crc || memcmp(a, b, n * 4)) fail++;
+    printf("%s\n", fail ? "FAILED" : "ok");
+    return fail;
+}
+#endif
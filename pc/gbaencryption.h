@@ -28,3 +28,5 @@ void gbaCrcAdd(unsigned data, struct gbaCrcState *state);
 unsigned gbaCrcFinalize(unsigned data, struct gbaCrcState *state);
 void gbaEncryptionInit(unsigned seed, struct gbaEncryptionState *state);
 unsigned gbaEncrypt(unsigned data, unsigned ptr, struct gbaEncryptionState *state);
+void gbaCrcAddBlock(const unsigned *data, unsigned count, struct gbaCrcState *state);
+void gbaEncryptBlock(unsigned *data, unsigned count, unsigned ptr, struct gbaEncryptionState *state);
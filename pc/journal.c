@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/common.h"
+#include "pl.h"
+#include "journal.h"
+
+// a new journal with nothing but the header
+static int journal_create(struct journal *j){
+	j->f = fopen(j->path, "w");
+	if(!j->f || fputs(j->header, j->f) < 0 || fflush(j->f)){
+		fprintf(stderr, "failed to open \"%s\" for write, the job can't be resumed\n", j->path);
+		if(j->f){
+			fclose(j->f);
+			j->f = NULL;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+int journal_open(struct journal *j, const char *file, const char *op, u32 size, u32 image, u32 cart){
+	char line[0x80];
+	FILE *f;
+	u32 i, crc, n = 0;
+	memset(j, 0, sizeof(*j));
+	snprintf(j->path, sizeof(j->path), "%s.journal", file);
+	snprintf(j->header, sizeof(j->header), "usbagb journal %d %s %u 0x%08x 0x%08x\n",
+		JOURNAL_VERSION, op, size, image, cart);
+	j->blocks = (size + AGB_BUF_SIZE - 1) / AGB_BUF_SIZE;
+	j->done = calloc(j->blocks, 1);
+	j->crc = calloc(j->blocks, sizeof(u32));
+	f = fopen(j->path, "r");
+	if(f){
+		if(fgets(line, sizeof(line), f) && !strcmp(line, j->header)){
+			// a line cut short by a crash doesn't parse, it is simply left out
+			while(fgets(line, sizeof(line), f)){
+				if(sscanf(line, "%u 0x%x", &i, &crc) == 2 && i < j->blocks && strchr(line, '\n')){
+					j->done[i] = 1;
+					j->crc[i] = crc;
+					++n;
+				}
+			}
+		}
+		fclose(f);
+	}
+	if(!n){
+		return journal_create(j);
+	}
+	// rewritten, the cut short line wouldn't let anything after it parse
+	if(journal_create(j)){
+		return -1;
+	}
+	for(i = 0; i < j->blocks; ++i){
+		if(j->done[i]){
+			fprintf(j->f, "%u 0x%08x\n", i, j->crc[i]);
+		}
+	}
+	fflush(j->f);
+	return 0;
+}
+
+u32 journal_resume(const struct journal *j){
+	u32 i;
+	for(i = 0; i < j->blocks && j->done[i]; ++i);
+	return i;
+}
+
+void journal_block(struct journal *j, u32 i, u32 crc){
+	if(i >= j->blocks){
+		return;
+	}
+	j->done[i] = 1;
+	j->crc[i] = crc;
+	if(j->f){
+		fprintf(j->f, "%u 0x%08x\n", i, crc);
+		fflush(j->f);
+	}
+}
+
+void journal_reset(struct journal *j){
+	memset(j->done, 0, j->blocks);
+	memset(j->crc, 0, j->blocks * sizeof(u32));
+	if(j->f){
+		fclose(j->f);
+		journal_create(j);
+	}
+}
+
+void journal_close(struct journal *j, int complete){
+	if(j->f){
+		fclose(j->f);
+		if(complete){
+			remove(j->path);
+		}
+	}
+	free(j->done);
+	free(j->crc);
+	j->f = NULL;
+	j->done = NULL;
+	j->crc = NULL;
+}
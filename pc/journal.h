@@ -0,0 +1,46 @@
+#ifndef journal_h__
+#define journal_h__
+
+#include <stdio.h>
+
+#include "pl.h"
+
+/*
+job journal
+===
+a flash or a dump to a file keeps <file>.journal next to it, so the same
+command run again after a cable pull or a crash goes on from the first
+block that wasn't verified, instead of block 0
+	usbagb journal 1 <op> <size> <image> <cart>
+	<block> <crc32>
+	...
+the header names the job, op is flash or dump, size in bytes, image the
+CRC32 of the ROM to flash (0 for a dump), cart the flash ID for a flash and
+the CRC32 of block 0, the one with the cart header, for a dump
+a line per block is appended and flushed once the block is verified, so a
+crash loses the block in flight at most
+a journal with another header is started over, a finished job removes it
+*/
+#define JOURNAL_VERSION 1
+
+struct journal {
+	// NULL if the journal couldn't be written, everything is a no-op then
+	FILE *f;
+	char path[0x200], header[0x80];
+	u32 blocks;
+	// per block, 1 once verified, with its CRC32
+	u8 *done;
+	u32 *crc;
+};
+
+// loads what a journal with the same header has, starts a new one otherwise
+// -1 if it can't be written, the job runs without it then
+int journal_open(struct journal *j, const char *file, const char *op, u32 size, u32 image, u32 cart);
+// the first block not verified yet, j->blocks if all are
+u32 journal_resume(const struct journal *j);
+void journal_block(struct journal *j, u32 i, u32 crc);
+// the journal turned out to be about another cart, nothing of it counts
+void journal_reset(struct journal *j);
+// complete removes it, anything else keeps it for the next run
+void journal_close(struct journal *j, int complete);
+#endif
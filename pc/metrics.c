@@ -0,0 +1,207 @@
+/*
+metrics
+===
+counters and histograms are always kept, they are only relaxed atomic adds
+with metrics_open a thread writes them out every interval seconds:
+	*.json: one JSON object per line, appended, for log shippers
+	anything else: Prometheus text format, rewritten through a temporary file
+	so it can be picked up by the node_exporter textfile collector
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pl.h"
+#include "metrics.h"
+
+static const struct {
+	const char *name, *labels, *help;
+} metric_info[M_COUNT] = {
+	{"ucagb_bytes_total", "dir=\"up\"", "bytes written to / read from the adapter"},
+	{"ucagb_bytes_total", "dir=\"down\"", NULL},
+	{"ucagb_sio_words_total", NULL, "32 bit words exchanged over SIO"},
+	{"ucagb_crc_mismatch_total", "op=\"upload\"", "CRC32 mismatches between PC and DFAGB"},
+	{"ucagb_crc_mismatch_total", "op=\"dump\"", NULL},
+	{"ucagb_crc_mismatch_total", "op=\"save_write\"", NULL},
+	{"ucagb_crc_mismatch_total", "op=\"save_read\"", NULL},
+	{"ucagb_retries_total", "op=\"upload\"", "operations repeated after a failure"},
+	{"ucagb_retries_total", "op=\"erase\"", NULL},
+	{"ucagb_retries_total", "op=\"program\"", NULL},
+	{"ucagb_retries_total", "op=\"dump\"", NULL},
+	{"ucagb_flash_failures_total", "op=\"erase\"", "erase/program not answered with 0x80"},
+	{"ucagb_flash_failures_total", "op=\"program\"", NULL},
+	{"ucagb_blocks_total", "op=\"flash\"", "128KB blocks processed"},
+	{"ucagb_blocks_total", "op=\"skip\"", NULL},
+	{"ucagb_blocks_total", "op=\"dump\"", NULL},
+	{"ucagb_blocks_total", "op=\"cached\"", NULL},
+	{"ucagb_wait_polls_total", NULL, "DFAGB state polls in df_wait"},
+	{"ucagb_read_timeouts_total", NULL, "read_serial timeouts"},
+	{"ucagb_resyncs_total", NULL, "adapter and DFAGB brought back in step after a timeout"},
+	{"ucagb_faults_total", "kind=\"flip\"", "faults injected by --faults"},
+	{"ucagb_faults_total", "kind=\"drop\"", NULL},
+	{"ucagb_faults_total", "kind=\"spike\"", NULL},
+	{"ucagb_rate_changes_total", "dir=\"slower\"", "SIO wait changes by the rate control"},
+	{"ucagb_rate_changes_total", "dir=\"faster\"", NULL},
+	{"ucagb_frame_errors_total", "kind=\"nak\"", "DFAGB v2 frames dropped, results not matching their command"},
+	{"ucagb_frame_errors_total", "kind=\"result\"", NULL},
+};
+
+static const struct {
+	const char *name, *labels, *help;
+} hist_info[H_COUNT] = {
+	{"ucagb_block_seconds", "op=\"flash\"", "latency of a whole 128KB block"},
+	{"ucagb_block_seconds", "op=\"dump\"", NULL},
+	{"ucagb_worker_seconds", NULL, "latency of a DFAGB worker command"},
+};
+
+volatile u64 metrics[M_COUNT];
+static volatile u64 hist[H_COUNT][HIST_BUCKETS], hist_sum[H_COUNT];
+
+static char *metrics_file;
+static uint metrics_interval, metrics_json;
+static volatile int metrics_stop;
+static tThread metrics_thread;
+
+void metric_observe(enum hist h, u64 ns){
+	uint i = 0;
+	while(i < HIST_BUCKETS - 1 && ns > (1ull << (HIST_MIN_SHIFT + i))){
+		++i;
+	}
+	atomic_add(&hist[h][i], 1);
+	atomic_add(&hist_sum[h], ns);
+}
+
+static void write_prom(FILE *f){
+	uint i, j;
+	u64 n;
+	for(i = 0; i < M_COUNT; ++i){
+		if(metric_info[i].help){
+			fprintf(f, "# HELP %s %s\n# TYPE %s counter\n",
+				metric_info[i].name, metric_info[i].help, metric_info[i].name);
+		}
+		if(metric_info[i].labels){
+			fprintf(f, "%s{%s} %llu\n", metric_info[i].name, metric_info[i].labels, metrics[i]);
+		}else{
+			fprintf(f, "%s %llu\n", metric_info[i].name, metrics[i]);
+		}
+	}
+	for(i = 0; i < H_COUNT; ++i){
+		const char *l = hist_info[i].labels;
+		if(hist_info[i].help){
+			fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n",
+				hist_info[i].name, hist_info[i].help, hist_info[i].name);
+		}
+		n = 0;
+		for(j = 0; j < HIST_BUCKETS; ++j){
+			n += hist[i][j];
+			fprintf(f, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", hist_info[i].name,
+				l ? l : "", l ? "," : "", (1ull << (HIST_MIN_SHIFT + j)) / 1e9, n);
+		}
+		fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", hist_info[i].name, l ? l : "", l ? "," : "", n);
+		fprintf(f, "%s_sum%s%s%s %.9f\n", hist_info[i].name,
+			l ? "{" : "", l ? l : "", l ? "}" : "", hist_sum[i] / 1e9);
+		fprintf(f, "%s_count%s%s%s %llu\n", hist_info[i].name,
+			l ? "{" : "", l ? l : "", l ? "}" : "", n);
+	}
+}
+
+// labels become part of the key, ucagb_bytes_total{dir="up"} -> "ucagb_bytes_total.up"
+static void json_key(FILE *f, const char *name, const char *labels){
+	const char *p;
+	fprintf(f, "\"%s", name);
+	if(labels && (p = strchr(labels, '"'))){
+		fprintf(f, ".%.*s", (int)(strchr(p + 1, '"') - p - 1), p + 1);
+	}
+	fprintf(f, "\"");
+}
+
+static void write_json(FILE *f){
+	uint i, j, last;
+	fprintf(f, "{\"time\":%llu", (u64)time(NULL));
+	for(i = 0; i < M_COUNT; ++i){
+		fprintf(f, ",");
+		json_key(f, metric_info[i].name, metric_info[i].labels);
+		fprintf(f, ":%llu", metrics[i]);
+	}
+	// buckets as a plain array, trailing empty ones left out
+	for(i = 0; i < H_COUNT; ++i){
+		for(last = 0, j = 0; j < HIST_BUCKETS; ++j){
+			if(hist[i][j]){
+				last = j + 1;
+			}
+		}
+		fprintf(f, ",");
+		json_key(f, hist_info[i].name, hist_info[i].labels);
+		fprintf(f, ":{\"sum\":%.9f,\"min_shift\":%u,\"buckets\":[", hist_sum[i] / 1e9, HIST_MIN_SHIFT);
+		for(j = 0; j < last; ++j){
+			fprintf(f, "%s%llu", j ? "," : "", hist[i][j]);
+		}
+		fprintf(f, "]}");
+	}
+	fprintf(f, "}\n");
+}
+
+static void metrics_write(void){
+	FILE *f;
+	char *tmp;
+	if(metrics_json){
+		f = fopen(metrics_file, "a");
+		if(!f){
+			fprintf(stderr, "failed to open \"%s\" for write\n", metrics_file);
+			return;
+		}
+		write_json(f);
+		fclose(f);
+		return;
+	}
+	tmp = malloc(strlen(metrics_file) + 5);
+	sprintf(tmp, "%s.tmp", metrics_file);
+	f = fopen(tmp, "w");
+	if(!f){
+		fprintf(stderr, "failed to open \"%s\" for write\n", tmp);
+		free(tmp);
+		return;
+	}
+	write_prom(f);
+	fclose(f);
+#ifdef WINDOWS
+	remove(metrics_file);
+#endif
+	rename(tmp, metrics_file);
+	free(tmp);
+}
+
+static void metrics_main(void *arg){
+	uint t = get_rtime();
+	(void)arg;
+	while(!metrics_stop){
+		sleep(100);
+		if(get_rtime() - t >= metrics_interval * 1000){
+			t = get_rtime();
+			metrics_write();
+		}
+	}
+}
+
+int metrics_open(const char *filename, uint interval){
+	tSize len = strlen(filename);
+	metrics_file = malloc(len + 1);
+	strcpy(metrics_file, filename);
+	metrics_json = len >= 5 && !strcmp(filename + len - 5, ".json");
+	metrics_interval = interval ? interval : 1;
+	metrics_stop = 0;
+	metrics_thread = thread_start(metrics_main, NULL);
+	return 0;
+}
+
+void metrics_close(void){
+	if(!metrics_file){
+		return;
+	}
+	metrics_stop = 1;
+	thread_join(metrics_thread);
+	metrics_write();
+	free(metrics_file);
+	metrics_file = NULL;
+}
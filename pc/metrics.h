@@ -0,0 +1,59 @@
+#ifndef metrics_h__
+#define metrics_h__
+
+#include "pl.h"
+
+// cumulative counters, see metric_info in metrics.c for names and labels
+enum metric {
+	M_BYTES_UP,
+	M_BYTES_DOWN,
+	M_SIO_WORDS,
+	M_CRC_MISMATCH_UPLOAD,
+	M_CRC_MISMATCH_DUMP,
+	M_CRC_MISMATCH_SAVE_WRITE,
+	M_CRC_MISMATCH_SAVE_READ,
+	M_RETRY_UPLOAD,
+	M_RETRY_ERASE,
+	M_RETRY_PROGRAM,
+	M_RETRY_DUMP,
+	M_ERASE_FAIL,
+	M_PROGRAM_FAIL,
+	M_BLOCKS_FLASHED,
+	M_BLOCKS_SKIPPED,
+	M_BLOCKS_DUMPED,
+	M_BLOCKS_CACHED,
+	M_WAIT_POLLS,
+	M_READ_TIMEOUTS,
+	M_RESYNCS,
+	M_FAULT_FLIPS,
+	M_FAULT_DROPS,
+	M_FAULT_SPIKES,
+	M_RATE_SLOWER,
+	M_RATE_FASTER,
+	M_FRAME_NAK,
+	M_FRAME_RESULT,
+	M_COUNT
+};
+
+// log2 latency histograms, bucket i counts samples <= 2^(HIST_MIN_SHIFT + i) ns
+enum hist {
+	H_FLASH_BLOCK,
+	H_DUMP_BLOCK,
+	H_WORKER,
+	H_COUNT
+};
+#define HIST_MIN_SHIFT 12
+#define HIST_BUCKETS 32
+
+extern volatile u64 metrics[M_COUNT];
+
+#define METRIC_ADD(_m, _v) atomic_add(&metrics[(_m)], (_v))
+#define METRIC_INC(_m) atomic_add(&metrics[(_m)], 1)
+void metric_observe(enum hist h, u64 ns);
+
+// filename ending in .json gets a JSON line appended every interval,
+// anything else is rewritten in Prometheus text format
+int metrics_open(const char *filename, uint interval);
+// writes the final values
+void metrics_close(void);
+#endif
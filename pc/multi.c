@@ -0,0 +1,144 @@
+/*
+multiple adapters
+===
+	usbagb multi <dev,dev,...|auto> <command> [args]
+runs the same job on every listed device at once, auto means every
+uCSIO (16C0:047A) found, every device gets its own thread which opens it,
+pings it, runs the command and closes it, like a single usbagb run would
+
+log lines are prefixed by the device name, see dev_printf
+for flash the image is loaded and its block CRCs computed once,
+then shared read only by all the threads
+for dump and read, ".<n>" is appended to the output file name,
+n being the position of the device in the list
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pl.h"
+#include "ucagb.h"
+#include "cli.h"
+#include "multi.h"
+
+#define MULTI_MAX 0x40
+#define UCSIO_VID 0x16c0
+#define UCSIO_PID 0x047a
+
+struct job {
+	const char *devname;
+	char name[0x40], out[0x400];
+	int argc;
+	const char **argv;
+	const struct ucagb_image *img;
+	tThread t;
+	int result;
+};
+
+static void job_main(void *arg){
+	struct job *j = arg;
+	const char *argv[3];
+	struct ucagb *s;
+	int i;
+
+	j->result = ucagb_open(&s, j->devname, j->name);
+	if(j->result){
+		fprintf(stderr, "[%s] %s: %s\n", j->name, j->devname, ucagb_strerror(j->result));
+		return;
+	}
+
+	if(!strcmp(j->argv[0], "flash")){
+		j->result = ucagb_flash(s, j->img, j->argc == 3 ? atoi(j->argv[2]) - 1 : 0);
+	}else{
+		// same command, with the per device output file
+		for(i = 0; i < j->argc; ++i){
+			argv[i] = j->argv[i];
+		}
+		if(j->out[0]){
+			argv[j->argc - 1] = j->out;
+		}
+		j->result = cli_run(s, j->argc, argv);
+	}
+	if(j->result < 0){
+		dev_printf(s->d, "%s\n", ucagb_strerror(j->result));
+	}
+
+	ucagb_close(s);
+}
+
+static int valid_command(int argc, const char *argv[]){
+	return (argc == 2 && !strcmp(argv[0], "multiboot"))
+		|| ((argc == 2 || argc == 3) && !strcmp(argv[0], "flash"))
+		|| (argc == 3 && !strcmp(argv[0], "dump"))
+		|| (argc == 3 && !strcmp(argv[0], "write"))
+		|| (argc == 3 && !strcmp(argv[0], "read"));
+}
+
+// argv[0] is the device list, the command follows
+int multi(int argc, const char *argv[]){
+	static char found[MULTI_MAX][0x40];
+	static char list[0x1000];
+	const char *devs[MULTI_MAX], *p;
+	struct job *jobs;
+	struct ucagb_image img;
+	int n = 0, i, failed = 0;
+
+	if(argc < 2 || !valid_command(argc - 1, argv + 1)){
+		fprintf(stderr, "invalid parameters, example:\n\tusbagb multi auto flash game.gba\n"
+			"\tusbagb multi /dev/ttyACM0,/dev/ttyACM1 dump 128 dump.gba\n");
+		return -1;
+	}
+
+	if(!strcmp(argv[0], "auto")){
+		n = discover_serial(UCSIO_VID, UCSIO_PID, found, MULTI_MAX);
+		for(i = 0; i < n; ++i){
+			devs[i] = found[i];
+		}
+	}else{
+		strncpy(list, argv[0], sizeof(list) - 1);
+		for(p = strtok(list, ","); p && n < MULTI_MAX; p = strtok(NULL, ",")){
+			devs[n++] = p;
+		}
+	}
+	if(!n){
+		fprintf(stderr, "no device\n");
+		return -1;
+	}
+
+	img.data = NULL;
+	if(!strcmp(argv[1], "flash") && ucagb_image_load(&img, argv[2])){
+		return -1;
+	}
+
+	jobs = calloc(n, sizeof(struct job));
+	for(i = 0; i < n; ++i){
+		jobs[i].devname = devs[i];
+		p = strrchr(devs[i], '/');
+		strncpy(jobs[i].name, p ? p + 1 : devs[i], sizeof(jobs[i].name) - 1);
+		jobs[i].argc = argc - 1;
+		jobs[i].argv = argv + 1;
+		jobs[i].img = &img;
+		if(!strcmp(argv[1], "dump") || !strcmp(argv[1], "read")){
+			snprintf(jobs[i].out, sizeof(jobs[i].out), "%s.%d", argv[3], i);
+		}
+		fprintf(stderr, "[%s] %s %s\n", jobs[i].name, devs[i], argv[1]);
+		jobs[i].t = thread_start(job_main, &jobs[i]);
+	}
+
+	for(i = 0; i < n; ++i){
+		thread_join(jobs[i].t);
+	}
+	for(i = 0; i < n; ++i){
+		fprintf(stderr, "[%s] %s\n", jobs[i].name, jobs[i].result ? "FAILED" : "done");
+		if(jobs[i].result){
+			++failed;
+		}
+	}
+	fprintf(stderr, "%d of %d devices done\n", n - failed, n);
+
+	free(jobs);
+	if(img.data){
+		ucagb_image_free(&img);
+	}
+	return failed ? -1 : 0;
+}
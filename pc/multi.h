@@ -0,0 +1,6 @@
+#ifndef multi_h__
+#define multi_h__
+
+// argv[0] is a comma separated device list or "auto", the command follows
+int multi(int argc, const char *argv[]);
+#endif
@@ -1,16 +1,37 @@
+#ifndef WINDOWS
+#define _GNU_SOURCE
+#endif
 #include "pl.h"
+#include "trace.h"
+#include "metrics.h"
+#include "transcript.h"
+#include "fault.h"
+#include "zfile.h"
 #include "stdio.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+// thread_start hands these to thread_main
+struct thread_arg {
+	void (*f)(void *);
+	void *arg;
+};
 
 #ifdef WINDOWS
-tDev open_serial(const char* devname){
+#include <setupapi.h>
+// discover_serial and serial_number, build.cmd doesn't link it otherwise
+#pragma comment(lib, "setupapi.lib")
+
+static tHandle raw_open(const char* devname){
 	return CreateFile(devname, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
 }
 
-boolean validate_serial(tDev d){
-	return d == INVALID_HANDLE_VALUE;
+static boolean raw_invalid(tHandle h){
+	return h == INVALID_HANDLE_VALUE;
 }
 
-void setup_serial(tDev d){
+static void raw_setup(tHandle d){
 	// https://www.pjrc.com/teensy/serial_read.c
 	COMMCONFIG cfg;
 	COMMTIMEOUTS timeout;
@@ -38,39 +59,909 @@ void setup_serial(tDev d){
 	cfg.dcb.StopBits = ONESTOPBIT;
 	SetCommConfig(d, &cfg, n);
 
+	// the reader thread wants whatever arrived as soon as it arrived
+	// MAXDWORD/MAXDWORD/constant does exactly that, see COMMTIMEOUTS on MSDN
 	GetCommTimeouts(d, &timeout);
-	timeout.ReadIntervalTimeout = 250;
-	timeout.ReadTotalTimeoutMultiplier = 1;
-	timeout.ReadTotalTimeoutConstant = 500;
+	timeout.ReadIntervalTimeout = MAXDWORD;
+	timeout.ReadTotalTimeoutMultiplier = MAXDWORD;
+	timeout.ReadTotalTimeoutConstant = 100;
 	timeout.WriteTotalTimeoutMultiplier = 1;
 	timeout.WriteTotalTimeoutConstant = 500;
 	SetCommTimeouts(d, &timeout);
 }
 
-void last_err(void){
+static void raw_close(tHandle h){
+	CloseHandle(h);
+}
+
+static int last_err(void){
 	char *buf;
 	DWORD err = GetLastError();
 	FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER
 		| FORMAT_MESSAGE_FROM_SYSTEM,
 		NULL, err, 0, (LPTSTR)&buf, 0, NULL);
 	fprintf(stderr, "error code: 0x%08x, message: %s\n", err, buf);
-	exit(err);
+	LocalFree(buf);
+	return err;
 }
 
-void write_serial(tDev d, const void *data, tSize size){
+// returns the error code, 0 on success
+static int raw_write(tHandle d, const void *data, tSize size){
 	tSize written;
 	BOOL ret = WriteFile(d, data, size, &written, NULL);
 	if(!ret){
-		last_err();
+		return last_err();
 	}
+	return 0;
 }
 
-void read_serial(tDev d, void *data, tSize size){
+// returns 0 on timeout
+static tSize raw_read(tHandle d, void *data, tSize size, int *err){
 	tSize read;
 	BOOL ret = ReadFile(d, data, size, &read, NULL);
 	if(!ret){
-		last_err();
+		*err = last_err();
+		return 0;
+	}
+	return read;
+}
+
+static DWORD WINAPI writer_main(LPVOID arg);
+static DWORD WINAPI reader_main(LPVOID arg);
+#define THREAD_RET DWORD WINAPI
+#define THREAD_RET_VAL 0
+
+static void start_threads(tDev d){
+	d->writer = CreateThread(NULL, 0, writer_main, d, 0, NULL);
+	d->reader = CreateThread(NULL, 0, reader_main, d, 0, NULL);
+}
+
+static void join_threads(tDev d){
+	WaitForSingleObject(d->writer, INFINITE);
+	WaitForSingleObject(d->reader, INFINITE);
+	CloseHandle(d->writer);
+	CloseHandle(d->reader);
+}
+
+static DWORD WINAPI thread_main(LPVOID arg);
+
+tThread thread_start(void (*f)(void *), void *arg){
+	struct thread_arg *a = malloc(sizeof(struct thread_arg));
+	a->f = f;
+	a->arg = arg;
+	return CreateThread(NULL, 0, thread_main, a, 0, NULL);
+}
+
+void thread_join(tThread t){
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+
+void atomic_add(volatile u64 *p, u64 v){
+	InterlockedExchangeAdd64((volatile LONG64 *)p, v);
+}
+
+// plain volatile only orders like this with /volatile:ms, which ARM builds
+// don't default to, the interlocked calls are full barriers on every target
+// the rings and file_writer only pass 32 bit tSize and int here
+#define load_acquire(_p) ((tSize)InterlockedCompareExchange((volatile LONG *)(_p), 0, 0))
+#define store_release(_p, _v) InterlockedExchange((volatile LONG *)(_p), (LONG)(_v))
+
+u64 get_ntime(void){
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER c;
+	if(!freq.QuadPart){
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&c);
+	return (u64)(c.QuadPart / freq.QuadPart) * 1000000000ull
+		+ (u64)(c.QuadPart % freq.QuadPart) * 1000000000ull / freq.QuadPart;
+}
+
+int map_file(struct map *m, const char *filename){
+	m->data = NULL;
+	m->f = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(m->f == INVALID_HANDLE_VALUE){
+		return -1;
+	}
+	m->size = GetFileSize(m->f, NULL);
+	m->m = m->size ? CreateFileMapping(m->f, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	if(m->m == NULL){
+		CloseHandle(m->f);
+		return -1;
+	}
+	m->data = MapViewOfFile(m->m, FILE_MAP_READ, 0, 0, 0);
+	if(m->data == NULL){
+		CloseHandle(m->m);
+		CloseHandle(m->f);
+		return -1;
+	}
+	return 0;
+}
+
+void unmap_file(struct map *m){
+	if(m->data){
+		UnmapViewOfFile(m->data);
+		CloseHandle(m->m);
+		CloseHandle(m->f);
+		m->data = NULL;
+	}
+}
+
+// GUID_DEVCLASS_PORTS, without devguid.h and initguid.h
+static const GUID ports_class = {0x4d36e978, 0xe325, 0x11ce, {0xbf, 0xc1, 0x08, 0x00, 0x2b, 0xe1, 0x03, 0x18}};
+
+// port i of the COM ports present, its device instance id, like
+// USB\VID_16C0&PID_047A\<serial>, and its name, like COM3
+// 1 if it has both, 0 if not, -1 after the last one
+static int port_info(HDEVINFO set, DWORD i, char id[0x100], char port[0x40]){
+	SP_DEVINFO_DATA dev;
+	DWORD size = 0x40, type;
+	HKEY k;
+	LONG r;
+	dev.cbSize = sizeof(dev);
+	if(!SetupDiEnumDeviceInfo(set, i, &dev)){
+		return -1;
+	}
+	if(!SetupDiGetDeviceInstanceId(set, &dev, id, 0x100, NULL)){
+		return 0;
+	}
+	k = SetupDiOpenDevRegKey(set, &dev, DICS_FLAG_GLOBAL, 0, DIREG_DEV, KEY_READ);
+	if(k == INVALID_HANDLE_VALUE){
+		return 0;
+	}
+	r = RegQueryValueEx(k, "PortName", NULL, &type, (LPBYTE)port, &size);
+	RegCloseKey(k);
+	if(r != ERROR_SUCCESS || type != REG_SZ || !size){
+		return 0;
+	}
+	port[size < 0x40 ? size : 0x3f] = 0;
+	return 1;
+}
+
+int discover_serial(u16 vid, u16 pid, char names[][0x40], int max){
+	HDEVINFO set = SetupDiGetClassDevs(&ports_class, NULL, NULL, DIGCF_PRESENT);
+	char id[0x100], port[0x40], want[0x20];
+	DWORD i;
+	int n = 0, r;
+	if(set == INVALID_HANDLE_VALUE){
+		return 0;
+	}
+	sprintf(want, "VID_%04X&PID_%04X", vid, pid);
+	for(i = 0; n < max && (r = port_info(set, i, id, port)) >= 0; ++i){
+		if(r && strstr(id, want)){
+			strcpy(names[n++], port);
+		}
+	}
+	SetupDiDestroyDeviceInfoList(set);
+	return n;
+}
+
+// the serial is the last part of the device instance id, Windows makes one
+// up with '&' in it for a device that has none, the caller keeps the port name then
+int serial_number(const char *devname, char *buf, uint size){
+	HDEVINFO set = SetupDiGetClassDevs(&ports_class, NULL, NULL, DIGCF_PRESENT);
+	char id[0x100], port[0x40], *p;
+	DWORD i;
+	int r = -1, k;
+	if(set == INVALID_HANDLE_VALUE){
+		return -1;
+	}
+	// \\.\COM10 is COM10
+	if(!strncmp(devname, "\\\\.\\", 4)){
+		devname += 4;
+	}
+	for(i = 0; (k = port_info(set, i, id, port)) >= 0; ++i){
+		if(k && !_stricmp(port, devname)){
+			p = strrchr(id, '\\');
+			if(p && !strchr(++p, '&') && *p && strlen(p) < size){
+				strcpy(buf, p);
+				r = 0;
+			}
+			break;
+		}
+	}
+	SetupDiDestroyDeviceInfoList(set);
+	return r;
+}
+
+int make_dir(const char *path){
+	return !CreateDirectory(path, NULL) && GetLastError() != ERROR_ALREADY_EXISTS;
+}
+
+int full_path(const char *path, char *buf, uint size){
+	DWORD n = GetFullPathName(path, size, buf, NULL);
+	return n == 0 || n >= size;
+}
+
+// LockFileEx locks are per handle, so sessions of one process exclude each other too
+int file_lock(struct file_lock *l, const char *path){
+	OVERLAPPED o;
+	l->f = CreateFile(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(l->f == INVALID_HANDLE_VALUE){
+		return -1;
+	}
+	memset(&o, 0, sizeof(o));
+	if(!LockFileEx(l->f, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &o)){
+		CloseHandle(l->f);
+		return -1;
+	}
+	return 0;
+}
+
+void file_unlock(struct file_lock *l){
+	OVERLAPPED o;
+	memset(&o, 0, sizeof(o));
+	UnlockFileEx(l->f, 0, 1, 0, &o);
+	CloseHandle(l->f);
+}
+
+static void ring_pause(uint *spin){
+	if(++*spin < 0x100){
+		SwitchToThread();
+	}else{
+		Sleep(1);
+	}
+}
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
+
+static tHandle raw_open(const char* devname){
+	return open(devname, O_RDWR | O_NOCTTY);
+}
+
+static boolean raw_invalid(tHandle h){
+	return h < 0;
+}
+
+static int env_int(const char *name, int def){
+	const char *v = getenv(name);
+	return v ? atoi(v) : def;
+}
+
+static void raw_setup(tHandle d){
+	struct termios tio;
+	int bits = TIOCM_DTR | TIOCM_RTS;
+
+	tcgetattr(d, &tio);
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+	cfsetispeed(&tio, B115200);
+	cfsetospeed(&tio, B115200);
+	tio.c_cc[VMIN] = env_int("UCAGB_VMIN", SERIAL_VMIN);
+	tio.c_cc[VTIME] = env_int("UCAGB_VTIME", SERIAL_VTIME);
+	tcsetattr(d, TCSANOW, &tio);
+	// like DTR_CONTROL_ENABLE/RTS_CONTROL_ENABLE, a pty doesn't care
+	ioctl(d, TIOCMBIS, &bits);
+	tcflush(d, TCIOFLUSH);
+}
+
+static void raw_close(tHandle h){
+	close(h);
+}
+
+static int last_err(void){
+	int err = errno;
+	fprintf(stderr, "error code: %d, message: %s\n", err, strerror(err));
+	return err;
+}
+
+u32 get_rtime(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u32)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+u64 get_ntime(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint read_hex(const char *path){
+	FILE *f = fopen(path, "r");
+	uint v = 0;
+	if(f){
+		if(fscanf(f, "%x", &v) != 1){
+			v = 0;
+		}
+		fclose(f);
+	}
+	return v;
+}
+
+// /sys/class/tty/ttyACM*/device is the CDC interface, its parent the USB device
+int discover_serial(u16 vid, u16 pid, char names[][0x40], int max){
+	DIR *dir = opendir("/sys/class/tty");
+	struct dirent *e;
+	char path[0x100];
+	int n = 0;
+	if(!dir){
+		return 0;
+	}
+	while(n < max && (e = readdir(dir))){
+		if(strncmp(e->d_name, "ttyACM", 6)){
+			continue;
+		}
+		// a name that doesn't fit isn't any ttyACM
+		if(snprintf(path, sizeof(path), "/sys/class/tty/%s/device/../idVendor", e->d_name) >= (int)sizeof(path)
+			|| read_hex(path) != vid){
+			continue;
+		}
+		if(snprintf(path, sizeof(path), "/sys/class/tty/%s/device/../idProduct", e->d_name) >= (int)sizeof(path)
+			|| read_hex(path) != pid || snprintf(names[n], 0x40, "/dev/%s", e->d_name) >= 0x40){
+			continue;
+		}
+		++n;
+	}
+	closedir(dir);
+	return n;
+}
+
+// symlinks like /dev/serial/by-id/... are followed to the ttyACM* first
+int serial_number(const char *devname, char *buf, uint size){
+	char real[0x100], path[0x100], *base;
+	FILE *f;
+	int r = -1;
+	if(!realpath(devname, real)){
+		return -1;
+	}
+	base = strrchr(real, '/');
+	if(snprintf(path, sizeof(path), "/sys/class/tty/%s/device/../serial", base ? base + 1 : real) >= (int)sizeof(path)){
+		return -1;
+	}
+	f = fopen(path, "r");
+	if(f){
+		if(fgets(buf, size, f)){
+			buf[strcspn(buf, "\r\n")] = 0;
+			r = buf[0] ? 0 : -1;
+		}
+		fclose(f);
+	}
+	return r;
+}
+
+int make_dir(const char *path){
+	return mkdir(path, 0755) && errno != EEXIST;
+}
+
+// realpath wants PATH_MAX bytes
+int full_path(const char *path, char *buf, uint size){
+	char *p = realpath(path, NULL);
+	int r;
+	if(!p){
+		return -1;
+	}
+	r = snprintf(buf, size, "%s", p) >= (int)size;
+	free(p);
+	return r;
+}
+
+// flock, not fcntl, whose locks belong to the process and wouldn't keep
+// the sessions of multi apart
+int file_lock(struct file_lock *l, const char *path){
+	l->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(l->fd < 0){
+		return -1;
+	}
+	while(flock(l->fd, LOCK_EX)){
+		if(errno != EINTR){
+			close(l->fd);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void file_unlock(struct file_lock *l){
+	flock(l->fd, LOCK_UN);
+	close(l->fd);
+}
+
+int map_file(struct map *m, const char *filename){
+	struct stat st;
+	void *p;
+	int fd = open(filename, O_RDONLY);
+	m->data = NULL;
+	if(fd < 0){
+		return -1;
+	}
+	if(fstat(fd, &st) || !st.st_size){
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// the mapping keeps the file
+	close(fd);
+	if(p == MAP_FAILED){
+		return -1;
+	}
+	posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+	m->data = p;
+	m->size = st.st_size;
+	return 0;
+}
+
+void unmap_file(struct map *m){
+	if(m->data){
+		munmap((void *)m->data, m->size);
+		m->data = NULL;
+	}
+}
+
+// the whole buffer goes to a single write(), loop only on short writes
+// returns the error code, 0 on success
+static int raw_write(tHandle d, const void *data, tSize size){
+	const u8 *p = data;
+	ssize_t ret;
+	while(size){
+		ret = write(d, p, size);
+		if(ret < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return last_err();
+		}
+		p += ret;
+		size -= ret;
+	}
+	return 0;
+}
+
+// returns 0 if VTIME expired
+static tSize raw_read(tHandle d, void *data, tSize size, int *err){
+	ssize_t ret;
+	do{
+		ret = read(d, data, size);
+	}while(ret < 0 && errno == EINTR);
+	if(ret < 0){
+		*err = last_err();
+		return 0;
+	}
+	return ret;
+}
+
+static void *writer_main(void *arg);
+static void *reader_main(void *arg);
+#define THREAD_RET void *
+#define THREAD_RET_VAL NULL
+
+static void start_threads(tDev d){
+	pthread_create(&d->writer, NULL, writer_main, d);
+	pthread_create(&d->reader, NULL, reader_main, d);
+}
+
+static void join_threads(tDev d){
+	pthread_join(d->writer, NULL);
+	pthread_join(d->reader, NULL);
+}
+
+static void *thread_main(void *arg);
+
+tThread thread_start(void (*f)(void *), void *arg){
+	tThread t;
+	struct thread_arg *a = malloc(sizeof(struct thread_arg));
+	a->f = f;
+	a->arg = arg;
+	pthread_create(&t, NULL, thread_main, a);
+	return t;
+}
+
+void thread_join(tThread t){
+	pthread_join(t, NULL);
+}
+
+void atomic_add(volatile u64 *p, u64 v){
+	__atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+}
+
+#define load_acquire(_p) __atomic_load_n((_p), __ATOMIC_ACQUIRE)
+#define store_release(_p, _v) __atomic_store_n((_p), (_v), __ATOMIC_RELEASE)
+
+static void ring_pause(uint *spin){
+	if(++*spin < 0x100){
+		sched_yield();
+	}else{
+		usleep(50);
 	}
 }
 #endif
 
+/*
+I/O engine
+===
+write_serial only copies into tx and returns, the writer thread
+pushes tx to the device in as large pieces as it can get
+the reader thread moves whatever the device has into rx,
+read_serial only copies out of rx
+both rings are SPSC, the caller thread is the only producer of tx
+and the only consumer of rx, so a device must be driven by one thread
+*/
+
+static THREAD_RET thread_main(void *arg){
+	struct thread_arg a = *(struct thread_arg *)arg;
+	free(arg);
+	a.f(a.arg);
+	return THREAD_RET_VAL;
+}
+
+static void ring_init(struct ring *r, tSize size){
+	r->buf = malloc(size);
+	r->size = size;
+	r->head = 0;
+	r->tail = 0;
+}
+
+static THREAD_RET writer_main(void *arg){
+	tDev d = arg;
+	struct ring *r = &d->tx;
+	tSize head, tail, n;
+	uint spin = 0;
+	while(1){
+		head = load_acquire(&r->head);
+		tail = r->tail;
+		if(head == tail){
+			if(d->stop){
+				break;
+			}
+			ring_pause(&spin);
+			continue;
+		}
+		spin = 0;
+		// up to the end of the buffer, the rest goes in the next round
+		n = head - tail;
+		if(n > r->size - (tail & (r->size - 1))){
+			n = r->size - (tail & (r->size - 1));
+		}
+		if(!d->err){
+			d->err = raw_write(d->h, r->buf + (tail & (r->size - 1)), n);
+		}
+		// after an error everything is thrown away, so flush_serial returns
+		store_release(&r->tail, tail + n);
+	}
+	return THREAD_RET_VAL;
+}
+
+static THREAD_RET reader_main(void *arg){
+	tDev d = arg;
+	struct ring *r = &d->rx;
+	tSize head, tail, n;
+	uint spin = 0;
+	int err = 0;
+	while(!d->stop){
+		head = r->head;
+		tail = load_acquire(&r->tail);
+		n = r->size - (head - tail);
+		if(!n){
+			// nobody is reading, don't let the device run us over
+			ring_pause(&spin);
+			continue;
+		}
+		spin = 0;
+		if(n > r->size - (head & (r->size - 1))){
+			n = r->size - (head & (r->size - 1));
+		}
+		n = raw_read(d->h, r->buf + (head & (r->size - 1)), n, &err);
+		if(err){
+			d->err = err;
+			break;
+		}
+		store_release(&r->head, head + n);
+	}
+	return THREAD_RET_VAL;
+}
+
+/*
+file writer
+===
+the same SPSC scheme with whole blocks, the caller fills slot[head]
+the thread writes slot[tail], both wrap at FILE_WRITER_SLOTS
+every block is flushed, so what was written survives if we die
+a compressed file is compressed here too, while the next block comes in
+*/
+static void file_writer_main(void *arg){
+	struct file_writer *w = arg;
+	tSize tail;
+	uint spin = 0;
+	while(1){
+		tail = w->tail;
+		if(load_acquire(&w->head) == tail){
+			// stop is set after the last push
+			if(load_acquire(&w->stop) && load_acquire(&w->head) == tail){
+				break;
+			}
+			ring_pause(&spin);
+			continue;
+		}
+		spin = 0;
+		if(!w->err && (zfile_write(w->f, w->slot[tail % FILE_WRITER_SLOTS], w->block) || zfile_flush(w->f))){
+			w->err = 1;
+		}
+		store_release(&w->tail, tail + 1);
+	}
+}
+
+struct file_writer *file_writer_open(const char *filename, tSize block, tSize offset){
+	struct file_writer *w;
+	uint i;
+	struct zfile *f = zfile_create(filename, offset);
+	if(!f){
+		fprintf(stderr, "failed to open \"%s\" for write\n", filename);
+		return NULL;
+	}
+	w = calloc(1, sizeof(struct file_writer));
+	w->f = f;
+	w->block = block;
+	for(i = 0; i < FILE_WRITER_SLOTS; ++i){
+		w->slot[i] = malloc(block);
+	}
+	w->t = thread_start(file_writer_main, w);
+	return w;
+}
+
+u8 *file_writer_slot(struct file_writer *w){
+	uint spin = 0;
+	while(w->head - load_acquire(&w->tail) >= FILE_WRITER_SLOTS){
+		ring_pause(&spin);
+	}
+	return w->slot[w->head % FILE_WRITER_SLOTS];
+}
+
+void file_writer_push(struct file_writer *w){
+	store_release(&w->head, w->head + 1);
+}
+
+int file_writer_close(struct file_writer *w){
+	int err;
+	uint i;
+	store_release(&w->stop, 1);
+	thread_join(w->t);
+	err = w->err | zfile_close(w->f);
+	for(i = 0; i < FILE_WRITER_SLOTS; ++i){
+		free(w->slot[i]);
+	}
+	free(w);
+	return err;
+}
+
+tDev open_serial(const char* devname){
+	tDev d;
+	TRANSCRIPT_BEGIN(tr0);
+	tHandle h = raw_open(devname);
+	if(raw_invalid(h)){
+		return NULL;
+	}
+	d = malloc(sizeof(*d));
+	memset(d, 0, sizeof(*d));
+	d->h = h;
+	TRANSCRIPT_RECORD(d, TR_OPEN, tr0, 0, devname, strlen(devname));
+	return d;
+}
+
+boolean validate_serial(tDev d){
+	return d == NULL;
+}
+
+void setup_serial(tDev d){
+	raw_setup(d->h);
+	ring_init(&d->tx, SERIAL_RING_SIZE);
+	ring_init(&d->rx, SERIAL_RING_SIZE);
+	d->stop = 0;
+	start_threads(d);
+}
+
+// blocks until the writer handed everything in tx to the OS
+void flush_serial(tDev d){
+	uint spin = 0;
+	while(load_acquire(&d->tx.tail) != d->tx.head && !d->err){
+		ring_pause(&spin);
+	}
+}
+
+// throws away whatever arrived and clears a read timeout so I/O goes on
+// the caller has to get the device back in step, -1 after any other error
+int reset_serial(tDev d){
+	if(d->err && d->err != SERIAL_ETIMEOUT){
+		return -1;
+	}
+	flush_serial(d);
+	// the device may not be done answering
+	sleep(100);
+	store_release(&d->rx.tail, load_acquire(&d->rx.head));
+	d->err = 0;
+	return 0;
+}
+
+// lets the writer drain tx, then stops both threads
+void close_serial(tDev d){
+	flush_serial(d);
+	d->stop = 1;
+	join_threads(d);
+	raw_close(d->h);
+	free(d->tx.buf);
+	free(d->rx.buf);
+	free(d);
+}
+
+// blocks only while tx is full
+void write_serial(tDev d, const void *data, tSize size){
+	struct ring *r = &d->tx;
+	const u8 *p = data;
+	tSize head, tail, n, o, total = size;
+	uint spin = 0;
+	TRACE_BEGIN(t0);
+	TRANSCRIPT_BEGIN(tr0);
+	while(size && !d->err){
+		head = r->head;
+		tail = load_acquire(&r->tail);
+		n = r->size - (head - tail);
+		if(!n){
+			ring_pause(&spin);
+			continue;
+		}
+		spin = 0;
+		if(n > size){
+			n = size;
+		}
+		o = head & (r->size - 1);
+		if(n > r->size - o){
+			n = r->size - o;
+		}
+		memcpy(r->buf + o, p, n);
+		store_release(&r->head, head + (fault_on ? fault_apply(FAULT_UP, r->buf + o, n) : n));
+		p += n;
+		size -= n;
+	}
+	TRACE_END_ARG(t0, "write_serial", "bytes", total);
+	TRANSCRIPT_RECORD(d, TR_WRITE, tr0, total, data, total);
+	METRIC_ADD(M_BYTES_UP, total);
+}
+
+// returns less than size only if nothing arrived for SERIAL_TIMEOUT after
+// the writer has sent everything, like ReadFile does
+tSize read_serial(tDev d, void *data, tSize size){
+	struct ring *r = &d->rx;
+	u8 *p = data;
+	tSize read_size = 0, head, tail, n, o;
+	uint spin = 0, t = get_rtime();
+	TRACE_BEGIN(t0);
+	TRANSCRIPT_BEGIN(tr0);
+	if(fault_on){
+		fault_spike();
+	}
+	while(read_size < size && !d->err){
+		head = load_acquire(&r->head);
+		tail = r->tail;
+		n = head - tail;
+		if(!n){
+			// like the old blocking WriteFile, the clock starts once everything is sent
+			if(load_acquire(&d->tx.tail) != d->tx.head){
+				t = get_rtime();
+			}else if(get_rtime() - t > SERIAL_TIMEOUT){
+				dev_printf(d, "read timeout, %u of %u bytes\n", read_size, size);
+				METRIC_INC(M_READ_TIMEOUTS);
+				// the replies are out of step from now on
+				d->err = SERIAL_ETIMEOUT;
+				break;
+			}
+			ring_pause(&spin);
+			continue;
+		}
+		spin = 0;
+		if(n > size - read_size){
+			n = size - read_size;
+		}
+		o = tail & (r->size - 1);
+		if(n > r->size - o){
+			n = r->size - o;
+		}
+		memcpy(p + read_size, r->buf + o, n);
+		store_release(&r->tail, tail + n);
+		read_size += fault_on ? fault_apply(FAULT_DOWN, p + read_size, n) : n;
+		t = get_rtime();
+	}
+	TRACE_END_ARG(t0, "read_serial", "bytes", read_size);
+	TRANSCRIPT_RECORD(d, TR_READ, tr0, size, data, read_size);
+	METRIC_ADD(M_BYTES_DOWN, read_size);
+	return read_size;
+}
+
+// with a name, lines are prefixed and go out whole so devices running
+// concurrently don't tear each other's lines, a \r starts the line over
+// so only the last state of a progress line is shown
+void dev_printf(tDev d, const char *fmt, ...){
+	va_list ap;
+	char buf[0x400], *p;
+	va_start(ap, fmt);
+	if(d == NULL || (d->name == NULL && d->log == NULL)){
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+		return;
+	}
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	for(p = buf; *p; ++p){
+		if(*p == '\r'){
+			d->line_len = 0;
+		}else if(*p == '\n'){
+			if(d->line_len && d->log){
+				d->line[d->line_len] = 0;
+				d->log(d->log_user, d->line);
+			}else if(d->line_len){
+				// a single fprintf is atomic
+				fprintf(stderr, "[%s] %.*s\n", d->name, d->line_len, d->line);
+			}
+			d->line_len = 0;
+		}else if(d->line_len < sizeof(d->line) - 1){
+			d->line[d->line_len++] = *p;
+		}
+	}
+}
+
+#ifdef PLTEST
+// pty loopback, no hardware needed
+// the rings record transcripts and inject faults, file_writer goes through zfile
+// gcc -DPLTEST -pthread pl.c trace.c metrics.c transcript.c fault.c zfile.c crc.c $(sh zflags.sh) && ./a.out
+
+#define TEST_SIZE 0x20000
+
+static int master;
+static u8 tx[TEST_SIZE], rx[TEST_SIZE];
+
+static void *echo(void *arg){
+	u8 buf[0x1000];
+	ssize_t n;
+	while((n = read(master, buf, sizeof(buf))) > 0){
+		write(master, buf, n);
+	}
+	return NULL;
+}
+
+int main(int argc, const char* argv[]){
+	pthread_t te;
+	tDev d;
+	u32 i, t;
+	tSize n;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(master < 0 || grantpt(master) || unlockpt(master)){
+		return last_err();
+	}
+	d = open_serial(ptsname(master));
+	if(validate_serial(d)){
+		return last_err();
+	}
+	setup_serial(d);
+
+	for(i = 0; i < TEST_SIZE; ++i){
+		tx[i] = i * 7 + (i >> 8);
+	}
+	pthread_create(&te, NULL, echo, NULL);
+	// full duplex, the writer thread keeps sending while we are reading
+	t = get_rtime();
+	write_serial(d, tx, TEST_SIZE);
+	n = read_serial(d, rx, TEST_SIZE);
+	t = get_rtime() - t;
+	fprintf(stderr, "loopback %u of %u bytes in %u ms, %s\n",
+		n, TEST_SIZE, t, memcmp(tx, rx, TEST_SIZE) ? "mismatch" : "match");
+
+	// nothing more to read, this should time out after SERIAL_TIMEOUT
+	t = get_rtime();
+	n = read_serial(d, rx, 4);
+	t = get_rtime() - t;
+	fprintf(stderr, "timeout read returned %u bytes after %u ms\n", n, t);
+	close_serial(d);
+	return n != 0 || memcmp(tx, rx, TEST_SIZE);
+}
+#endif
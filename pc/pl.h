@@ -1,19 +1,151 @@
+#ifndef pl_h__
+#define pl_h__
+
+#include <stdio.h>
+
 #ifdef WINDOWS
 #include <windows.h>
-typedef HANDLE tDev;
+typedef HANDLE tHandle;
+typedef HANDLE tThread;
+#else
+#include <unistd.h>
+#include <pthread.h>
+typedef int tHandle;
+typedef pthread_t tThread;
+typedef int boolean;
 #endif
 
 typedef unsigned int tSize;
 typedef unsigned int uint;
+typedef unsigned long long u64;
 typedef unsigned int u32;
 typedef unsigned short u16;
 typedef unsigned char u8;
 
+// single producer single consumer ring, lock free
+// head (producer) and tail (consumer) only ever grow, size is a power of 2
+struct ring {
+	u8 *buf;
+	tSize size;
+	volatile tSize head, tail;
+};
+
+// the I/O engine, every device gets a writer and a reader thread
+// write_serial/read_serial only talk to them through the tx/rx rings
+// so the line is kept busy in both directions at once
+struct dev {
+	tHandle h;
+	struct ring tx, rx;
+	tThread writer, reader;
+	volatile int stop;
+	// sticky, the OS error code or SERIAL_ETIMEOUT, 0 if all is well
+	// once set, writes are dropped and reads return short right away
+	volatile int err;
+	// dev_printf prefix, NULL when there is only one device
+	const char *name;
+	char line[0x100];
+	uint line_len;
+	// if set, dev_printf hands whole lines here instead of stderr
+	void (*log)(void *user, const char *line);
+	void *log_user;
+	// transaction queue and frame of gba.c
+	struct xq *xq;
+	// replies df_wait couldn't make sense of, for the rate control
+	u32 garbled;
+	// words per CMD_XFERN in bulk writes and reads, 0 for CMD_XFER | CMD_FLAG_B
+	uint bulk_w, bulk_r;
+};
+typedef struct dev *tDev;
+
+#define SERIAL_RING_SIZE 0x40000
+// read_serial gives up after this long without a single byte
+#define SERIAL_TIMEOUT 500
+#define SERIAL_ETIMEOUT -1
+
+// monotonic nanoseconds, for measuring rather than timeouts
+u64 get_ntime(void);
+
+#ifdef WINDOWS
 #define get_rtime() GetTickCount()
 #define sleep(_x) Sleep((_x))
+#else
+// termios read timeouts of the reader thread, the counterpart of COMMTIMEOUTS
+// VMIN = 0 and VTIME > 0 makes read() return as soon as anything arrived,
+// or 0 after VTIME * 100ms of silence, so the reader can notice close_serial
+// both can be overridden by UCAGB_VMIN and UCAGB_VTIME in the environment
+#define SERIAL_VMIN 0
+#define SERIAL_VTIME 1
+u32 get_rtime(void);
+#define sleep(_x) usleep((_x) * 1000)
+#endif
 
 tDev open_serial(const char* devname);
 boolean validate_serial(tDev d);
 void setup_serial(tDev d);
+void close_serial(tDev d);
+void flush_serial(tDev d);
+int reset_serial(tDev d);
 void write_serial(tDev d, const void *data, tSize size);
-void read_serial(tDev d, void *data, tSize size);
+tSize read_serial(tDev d, void *data, tSize size);
+void dev_printf(tDev d, const char *fmt, ...);
+// finds USB CDC devices by VID:PID, returns how many names were filled
+int discover_serial(u16 vid, u16 pid, char names[][0x40], int max);
+// the USB serial number of the adapter behind devname, 0 if there is one,
+// -1 if it has none or it can't be found, rates and costs go by devname then
+int serial_number(const char *devname, char *buf, uint size);
+// 0 if the directory is there afterwards
+int make_dir(const char *path);
+// the absolute path of an existing file, 0 on success
+int full_path(const char *path, char *buf, uint size);
+
+// an exclusive advisory lock on a file, created if it isn't there, waits
+// while another process or another session of this one has it
+struct file_lock {
+#ifdef WINDOWS
+	HANDLE f;
+#else
+	int fd;
+#endif
+};
+int file_lock(struct file_lock *l, const char *path);
+void file_unlock(struct file_lock *l);
+
+// read only view of a whole file, nothing is read until it is touched
+struct map {
+	const u8 *data;
+	tSize size;
+#ifdef WINDOWS
+	HANDLE f, m;
+#endif
+};
+int map_file(struct map *m, const char *filename);
+void unmap_file(struct map *m);
+
+// writes fixed size blocks to a file, in order, from its own thread
+// so disk I/O overlaps whatever the caller does next
+// file_writer_slot hands out a buffer, file_writer_push queues it for writing
+// .gz and .zst files are compressed on the way, see zfile.h
+#define FILE_WRITER_SLOTS 4
+struct zfile;
+struct file_writer {
+	struct zfile *f;
+	tSize block;
+	u8 *slot[FILE_WRITER_SLOTS];
+	volatile tSize head, tail;
+	volatile int stop, err;
+	tThread t;
+};
+// offset 0 starts a new file, anything else goes on writing an existing one there
+struct file_writer *file_writer_open(const char *filename, tSize block, tSize offset);
+// waits for a free slot if the disk is behind
+u8 *file_writer_slot(struct file_writer *w);
+void file_writer_push(struct file_writer *w);
+// waits until everything is written, non 0 if anything failed
+int file_writer_close(struct file_writer *w);
+
+// plain threads for the rest of the client
+tThread thread_start(void (*f)(void *), void *arg);
+void thread_join(tThread t);
+// relaxed, for statistics
+void atomic_add(volatile u64 *p, u64 v);
+#endif
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pl.h"
+#include "crc.h"
+#include "plan.h"
+#include "settings.h"
+
+static const char *op_name[PLAN_OPS] = {"survey", "upload", "erase", "program"};
+static const u64 op_cost[PLAN_OPS] = {
+	PLAN_COST_SURVEY, PLAN_COST_UPLOAD, PLAN_COST_ERASE, PLAN_COST_PROGRAM,
+};
+
+void plan_init(struct plan *p, u32 blocks, const char *key){
+	char path[0x100], line[0x100];
+	u32 us[PLAN_OPS];
+	u8 *blank;
+	int i;
+	memset(p, 0, sizeof(*p));
+	p->blocks = blocks;
+	p->cls = calloc(blocks, 1);
+	snprintf(p->key, sizeof(p->key), "%s", key);
+	blank = malloc(AGB_BUF_SIZE);
+	memset(blank, 0xff, AGB_BUF_SIZE);
+	p->blank = crc32_update(0, blank, AGB_BUF_SIZE);
+	free(blank);
+	for(i = 0; i < PLAN_OPS; ++i){
+		p->cost[i] = op_cost[i] * 1000;
+	}
+	if(settings_path("UCAGB_COSTS", ".usbagb_costs", path, sizeof(path))
+		|| settings_find(path, p->key, line, sizeof(line))
+		|| sscanf(line, "%*s %u %u %u %u", &us[0], &us[1], &us[2], &us[3]) != 4){
+		return;
+	}
+	for(i = 0; i < PLAN_OPS; ++i){
+		p->cost[i] = (u64)us[i] * 1000;
+	}
+	p->loaded = 1;
+}
+
+void plan_free(struct plan *p){
+	free(p->cls);
+	p->cls = NULL;
+}
+
+void plan_survey(struct plan *p, u32 i){
+	if(i < p->blocks){
+		++p->ops[PLAN_OP_SURVEY];
+	}
+}
+
+int plan_block(struct plan *p, u32 i, u32 rom, u32 cart){
+	int c;
+	if(i >= p->blocks){
+		return PLAN_SAME;
+	}
+	if(rom == cart){
+		c = PLAN_SAME;
+	}else if(rom == p->blank){
+		c = PLAN_ERASE;
+		++p->ops[PLAN_OP_ERASE];
+	}else if(cart == p->blank){
+		c = PLAN_PROGRAM;
+		++p->ops[PLAN_OP_UPLOAD];
+		++p->ops[PLAN_OP_PROGRAM];
+	}else{
+		c = PLAN_WRITE;
+		++p->ops[PLAN_OP_UPLOAD];
+		++p->ops[PLAN_OP_ERASE];
+		++p->ops[PLAN_OP_PROGRAM];
+	}
+	p->cls[i] = c;
+	++p->count[c];
+	return c;
+}
+
+void plan_time(struct plan *p, int op, u32 n, u64 ns){
+	p->done[op] += n;
+	p->took[op] += ns;
+}
+
+u64 plan_predict(const struct plan *p, int op){
+	u64 t = 0;
+	int i;
+	for(i = 0; i < PLAN_OPS; ++i){
+		if(op == PLAN_OPS || op == i){
+			t += p->ops[i] * p->cost[i];
+		}
+	}
+	return t;
+}
+
+void plan_report(const struct plan *p, tDev d){
+	u64 took = 0;
+	int i, head = 0;
+	for(i = 0; i < PLAN_OPS; ++i){
+		if(!p->ops[i] && !p->done[i]){
+			continue;
+		}
+		if(!head++){
+			dev_printf(d, "plan: %-8s %5s %10s %10s\n", "op", "n", "predicted", "actual");
+		}
+		// retries are ops the plan didn't have
+		dev_printf(d, "plan: %-8s %5u %9.2fs %9.2fs%s\n", op_name[i], p->done[i],
+			plan_predict(p, i) / 1e9, p->took[i] / 1e9, p->done[i] > p->ops[i] ? ", with retries" : "");
+		took += p->took[i];
+	}
+	dev_printf(d, "plan: predicted %.2fs, took %.2fs\n", plan_predict(p, PLAN_OPS) / 1e9, took / 1e9);
+}
+
+void plan_save(const struct plan *p){
+	struct settings st;
+	char path[0x100];
+	u64 c[PLAN_OPS];
+	int i, n = 0;
+	for(i = 0; i < PLAN_OPS; ++i){
+		c[i] = p->cost[i];
+		if(p->done[i]){
+			// half what was loaded, half what was measured now, a guess doesn't count
+			c[i] = p->loaded ? (c[i] + p->took[i] / p->done[i]) / 2 : p->took[i] / p->done[i];
+			++n;
+		}
+	}
+	if(!n || settings_path("UCAGB_COSTS", ".usbagb_costs", path, sizeof(path)) || !settings_create(&st, path, NULL)){
+		return;
+	}
+	settings_keep(&st, p->key);
+	fprintf(st.f, "%s %u %u %u %u\n", p->key, (u32)(c[0] / 1000), (u32)(c[1] / 1000),
+		(u32)(c[2] / 1000), (u32)(c[3] / 1000));
+	settings_commit(&st);
+}
@@ -0,0 +1,70 @@
+#ifndef plan_h__
+#define plan_h__
+
+#include "pl.h"
+#include "../common/common.h"
+
+/*
+flash plan
+===
+before a flash every block the cart cache doesn't know is surveyed,
+DUMP + CRC32 on the GBA, PLAN_SURVEY_FRAME blocks to a frame, nothing is
+downloaded, and each block gets one of
+	PLAN_SAME	the cart has it already, nothing to do
+	PLAN_ERASE	the ROM block is blank, an erase is all it takes, no upload
+	PLAN_PROGRAM	the cart block is blank, upload and program, no erase
+	PLAN_WRITE	upload, erase and program
+the erases go first, DF_FRAME_MAX to a frame, every block left is blank
+after that and is uploaded and programmed in order, nothing is erased that
+doesn't have to be
+
+every op is predicted from what it took on this adapter before, kept per
+adapter serial number like the rates, in the file named by UCAGB_COSTS,
+~/.usbagb_costs by default, one "serial survey upload erase program" per
+line, microseconds per 128KB block, until then PLAN_COST_* are the guess
+the upload includes checking its CRC32 and its retries, a program that
+failed is done again after another erase, that isn't timed
+after the flash predicted vs actual is reported per op and saved
+*/
+enum {PLAN_SAME, PLAN_ERASE, PLAN_PROGRAM, PLAN_WRITE, PLAN_CLASSES};
+enum {PLAN_OP_SURVEY, PLAN_OP_UPLOAD, PLAN_OP_ERASE, PLAN_OP_PROGRAM, PLAN_OPS};
+#define PLAN_SURVEY_FRAME (DF_FRAME_MAX / 2)
+// I28F128J3 typicals, a block erase and 4096 buffered 32 byte programs,
+// the survey is a 16MHz CRC32, the upload a guess
+#define PLAN_COST_SURVEY 140000
+#define PLAN_COST_UPLOAD 250000
+#define PLAN_COST_ERASE 1000000
+#define PLAN_COST_PROGRAM 900000
+
+struct plan {
+	u32 blocks;
+	// PLAN_CLASSES per block, PLAN_SAME for the ones not to be flashed
+	u8 *cls;
+	u32 count[PLAN_CLASSES];
+	// CRC32 of a blank block
+	u32 blank;
+	// ns per op, predicted, and what the ops done so far took
+	u64 cost[PLAN_OPS], took[PLAN_OPS];
+	// ops the plan has, and how many of them were timed
+	u32 ops[PLAN_OPS], done[PLAN_OPS];
+	// the costs came from the file, not PLAN_COST_*
+	u8 loaded;
+	char key[0x40];
+};
+
+// key is the adapter, the costs measured on it are loaded
+void plan_init(struct plan *p, u32 blocks, const char *key);
+void plan_free(struct plan *p);
+// block i is to be surveyed
+void plan_survey(struct plan *p, u32 i);
+// what block i needs, from the CRC32 of the ROM block and the cart's
+int plan_block(struct plan *p, u32 i, u32 rom, u32 cart);
+// n ops took ns in all
+void plan_time(struct plan *p, int op, u32 n, u64 ns);
+// ns the ops of the plan are predicted to take, PLAN_OPS for all of them
+u64 plan_predict(const struct plan *p, int op);
+// predicted vs actual per op, through dev_printf
+void plan_report(const struct plan *p, tDev d);
+// the costs measured, averaged with the ones loaded
+void plan_save(const struct plan *p);
+#endif
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pl.h"
+#include "rate.h"
+#include "settings.h"
+#include "metrics.h"
+
+// the file keeps set_wait values, those are what anyone would recognize
+static u16 wait_level(uint wait){
+	return wait == 1 || wait > 0xff ? RATE_HANDSHAKE : wait;
+}
+
+void rate_init(struct rate *r, const char *devname){
+	char path[0x100], line[0x100];
+	uint wait;
+	memset(r, 0, sizeof(*r));
+	r->stable = RATE_NONE;
+	r->saved = RATE_NONE;
+	if(serial_number(devname, r->key, sizeof(r->key))){
+		snprintf(r->key, sizeof(r->key), "%s", devname);
+	}
+	if(settings_path("UCAGB_RATES", ".usbagb_rates", path, sizeof(path))
+		|| settings_find(path, r->key, line, sizeof(line)) || sscanf(line, "%*s %u", &wait) != 1){
+		return;
+	}
+	r->level = wait_level(wait);
+	r->stable = r->level;
+	r->saved = r->level;
+}
+
+u8 rate_wait(const struct rate *r){
+	return r->level == RATE_HANDSHAKE ? 1 : (u8)r->level;
+}
+
+int rate_block(struct rate *r, int ok){
+	u16 level = r->level;
+	if(r->fixed){
+		return 0;
+	}
+	if(!ok){
+		r->clean = 0;
+		// a probe below the stable level failed, anything else means the line got worse
+		if(r->level >= r->stable){
+			r->stable = RATE_NONE;
+		}
+		r->level = r->level < 2 ? 2 : r->level * 2;
+		if(r->level > 0xff){
+			r->level = RATE_HANDSHAKE;
+		}
+		if(r->level != level){
+			METRIC_INC(M_RATE_SLOWER);
+		}
+	}else if(++r->clean >= RATE_STREAK){
+		r->clean = 0;
+		r->stable = r->level;
+		// 1 is the handshake, the shortest loop is 2
+		r->level = r->level < RATE_STEP + 2 ? 0 : r->level - RATE_STEP;
+		if(r->level != level){
+			METRIC_INC(M_RATE_FASTER);
+		}
+	}
+	return r->level != level;
+}
+
+void rate_save(const struct rate *r){
+	struct settings st;
+	char path[0x100];
+	if(r->fixed || r->stable == RATE_NONE || r->stable == r->saved){
+		return;
+	}
+	if(settings_path("UCAGB_RATES", ".usbagb_rates", path, sizeof(path)) || !settings_create(&st, path, NULL)){
+		return;
+	}
+	settings_keep(&st, r->key);
+	fprintf(st.f, "%s %u\n", r->key, r->stable == RATE_HANDSHAKE ? 1 : r->stable);
+	settings_commit(&st);
+}
@@ -0,0 +1,50 @@
+#ifndef rate_h__
+#define rate_h__
+
+#include "pl.h"
+
+/*
+SIO rate control
+===
+the uCSIO waits before every SIO word, set_wait(wait_p0) picks how:
+0 not at all, 2..255 a nop loop of that length, 1 until DFAGB pulls SI low,
+the gbatek handshake, which is always right but costs a poll per word
+
+levels put all of them in one order, 0 the fastest, then the nop loops,
+RATE_HANDSHAKE the slowest
+AIMD over the levels, per 128KB block: a CRC mismatch or a reply df_wait
+couldn't place doubles the level, RATE_STREAK clean blocks in a row take
+RATE_STEP off again, so a good cable ends up without any wait and a bad one
+saw-tooths right above where it breaks, instead of retrying every block
+
+the last level that made it through a whole streak is kept per adapter,
+by its USB serial number (the port name if it has none), in the file named
+by UCAGB_RATES, ~/.usbagb_rates by default, one "serial wait_p0" per line
+*/
+#define RATE_HANDSHAKE 0x100
+#define RATE_STREAK 16
+#define RATE_STEP 8
+#define RATE_NONE 0xffff
+
+struct rate {
+	u16 level;
+	// the last level that made it through a streak, or RATE_NONE
+	u16 stable;
+	// stable as rate_init loaded it, the same isn't saved again
+	u16 saved;
+	// clean blocks since the last change
+	u32 clean;
+	// ucagb_set_wait pins the level, nothing is adapted or saved then
+	u8 fixed;
+	char key[0x40];
+};
+
+// starts from the saved level of the adapter, the fastest if there is none
+void rate_init(struct rate *r, const char *devname);
+u8 rate_wait(const struct rate *r);
+// after every block, ok if it went through without a retry
+// 1 if the level changed and has to be sent with set_wait
+int rate_block(struct rate *r, int ok);
+// stores the stable level, if it changed since rate_init
+void rate_save(const struct rate *r);
+#endif
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pl.h"
+#include "settings.h"
+
+int settings_path(const char *env, const char *name, char *path, uint size){
+	const char *v = getenv(env);
+	if(v){
+		return v[0] && snprintf(path, size, "%s", v) < (int)size ? 0 : -1;
+	}
+#ifdef WINDOWS
+	v = getenv("USERPROFILE");
+#else
+	v = getenv("HOME");
+#endif
+	if(!v){
+		return -1;
+	}
+	return snprintf(path, size, "%s/%s", v, name) < (int)size ? 0 : -1;
+}
+
+int settings_find(const char *path, const char *key, char *line, uint size){
+	char buf[0x100], k[0x40];
+	FILE *f = fopen(path, "r");
+	int r = -1;
+	if(!f){
+		return -1;
+	}
+	while(fgets(buf, sizeof(buf), f)){
+		if(sscanf(buf, "%63s", k) == 1 && !strcmp(k, key)){
+			snprintf(line, size, "%s", buf);
+			r = 0;
+		}
+	}
+	fclose(f);
+	return r;
+}
+
+FILE *settings_create(struct settings *st, const char *path, const char *lock){
+	snprintf(st->path, sizeof(st->path), "%s", path);
+	if(lock){
+		snprintf(st->tmp, sizeof(st->tmp), "%s", lock);
+	}else{
+		snprintf(st->tmp, sizeof(st->tmp), "%s.lock", path);
+	}
+	st->f = NULL;
+	if(file_lock(&st->lock, st->tmp)){
+		fprintf(stderr, "failed to lock \"%s\"\n", st->tmp);
+		return NULL;
+	}
+	// only the one holding the lock writes it
+	snprintf(st->tmp, sizeof(st->tmp), "%s.tmp", path);
+	st->f = fopen(st->tmp, "w");
+	if(!st->f){
+		fprintf(stderr, "failed to open \"%s\" for write\n", st->tmp);
+		file_unlock(&st->lock);
+	}
+	return st->f;
+}
+
+void settings_keep(struct settings *st, const char *key){
+	char line[0x100], k[0x40];
+	FILE *f = fopen(st->path, "r");
+	if(!f){
+		return;
+	}
+	while(fgets(line, sizeof(line), f)){
+		if(sscanf(line, "%63s", k) == 1 && strcmp(k, key)){
+			fputs(line, st->f);
+		}
+	}
+	fclose(f);
+}
+
+int settings_commit(struct settings *st){
+	int r = -1;
+	if(fclose(st->f)){
+		remove(st->tmp);
+	}else{
+#ifdef WINDOWS
+		r = MoveFileEx(st->tmp, st->path, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+		r = rename(st->tmp, st->path) ? -1 : 0;
+#endif
+	}
+	file_unlock(&st->lock);
+	return r;
+}
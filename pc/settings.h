@@ -0,0 +1,40 @@
+#ifndef settings_h__
+#define settings_h__
+
+#include <stdio.h>
+
+#include "pl.h"
+
+/*
+settings files
+===
+what is kept from one session to the next, the rates, the flash costs and
+the cart cache entries, each in a small text file in the home directory
+that an environment variable can move somewhere else or, empty, turn off
+keyed files have one line per adapter, "key values...", a save replaces
+its own line and keeps every other one
+a file is written to a temp file next to it and renamed over it, a reader
+sees the old file or the new one, never half of it
+a save holds <file>.lock, or a lock file of its own choosing, from reading
+the old file to the rename, sessions saving at once, multi or separate
+processes, wait for each other and each keeps the lines the others wrote
+lock files are never removed, another process may be holding or waiting on one
+*/
+struct settings {
+	char path[0x200], tmp[0x220];
+	FILE *f;
+	struct file_lock lock;
+};
+
+// env if it is set, ~/name otherwise, -1 if that is empty or there is no home
+int settings_path(const char *env, const char *name, char *path, uint size);
+// the last line of key, 0 if there is one
+int settings_find(const char *path, const char *key, char *line, uint size);
+// locks the file, the new one is to be written to st->f, NULL if it can't be
+// lock is the lock file, NULL for <path>.lock
+FILE *settings_create(struct settings *st, const char *path, const char *lock);
+// every line of the old file but the one of key goes to the new one
+void settings_keep(struct settings *st, const char *key);
+// the new file takes the place of the old one, non 0 if it couldn't be written
+int settings_commit(struct settings *st);
+#endif
@@ -0,0 +1,94 @@
+/*
+tracing
+===
+writes Chrome trace_event JSON, load it in chrome://tracing or ui.perfetto.dev
+every span is a complete ("X") event, timestamps are microseconds with ns fractions
+relative to trace_open
+
+when no trace file is open, TRACE_BEGIN/TRACE_END only test trace_on
+*/
+#include <stdio.h>
+
+#include "pl.h"
+#include "trace.h"
+
+#ifdef WINDOWS
+#define THREAD_LOCAL __declspec(thread)
+static volatile LONG lock;
+static void trace_lock(void){
+	while(InterlockedExchange(&lock, 1)){
+		SwitchToThread();
+	}
+}
+static void trace_unlock(void){
+	InterlockedExchange(&lock, 0);
+}
+#else
+#include <sched.h>
+#define THREAD_LOCAL __thread
+static volatile int lock;
+static void trace_lock(void){
+	while(__atomic_exchange_n(&lock, 1, __ATOMIC_ACQUIRE)){
+		sched_yield();
+	}
+}
+static void trace_unlock(void){
+	__atomic_store_n(&lock, 0, __ATOMIC_RELEASE);
+}
+#endif
+
+volatile int trace_on;
+static FILE *trace_file;
+static u64 trace_t0;
+static uint trace_events, trace_tids;
+static THREAD_LOCAL uint trace_tid;
+
+int trace_open(const char *filename){
+	trace_file = fopen(filename, "w");
+	if(!trace_file){
+		fprintf(stderr, "failed to open \"%s\" for write\n", filename);
+		return -1;
+	}
+	fprintf(trace_file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	trace_t0 = get_ntime();
+	trace_events = 0;
+	trace_on = 1;
+	return 0;
+}
+
+void trace_close(void){
+	if(!trace_file){
+		return;
+	}
+	trace_lock();
+	trace_on = 0;
+	fprintf(trace_file, "\n]}\n");
+	fclose(trace_file);
+	trace_file = NULL;
+	trace_unlock();
+	fprintf(stderr, "%u trace events written\n", trace_events);
+}
+
+void trace_span(const char *name, u64 t0, u64 t1, const char *arg_name, long long arg){
+	trace_lock();
+	if(!trace_file){
+		trace_unlock();
+		return;
+	}
+	if(!trace_tid){
+		trace_tid = ++trace_tids;
+	}
+	// begun before trace_open
+	t0 = t0 < trace_t0 ? 0 : t0 - trace_t0;
+	t1 -= trace_t0;
+	fprintf(trace_file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+		"\"ts\":%llu.%03u,\"dur\":%llu.%03u",
+		trace_events ? ",\n" : "", name, trace_tid,
+		t0 / 1000, (uint)(t0 % 1000), (t1 - t0) / 1000, (uint)((t1 - t0) % 1000));
+	if(arg_name && arg >= 0){
+		fprintf(trace_file, ",\"args\":{\"%s\":%lld}", arg_name, arg);
+	}
+	fprintf(trace_file, "}");
+	++trace_events;
+	trace_unlock();
+}
@@ -0,0 +1,23 @@
+#ifndef trace_h__
+#define trace_h__
+
+#include "pl.h"
+
+// nonzero while a trace file is open, everything else is skipped when it's not
+extern volatile int trace_on;
+
+int trace_open(const char *filename);
+void trace_close(void);
+// a complete event, t0 and t1 from get_ntime, arg < 0 is left out
+void trace_span(const char *name, u64 t0, u64 t1, const char *arg_name, long long arg);
+
+// scoped spans, a local holds the start time
+// TRACE_BEGIN(t); ... TRACE_END(t, "name");
+#define TRACE_BEGIN(_t) u64 _t = trace_on ? get_ntime() : 0
+#define TRACE_END(_t, _name) do{ \
+	if(trace_on) trace_span((_name), (_t), get_ntime(), NULL, -1); \
+}while(0)
+#define TRACE_END_ARG(_t, _name, _arg_name, _arg) do{ \
+	if(trace_on) trace_span((_name), (_t), get_ntime(), (_arg_name), (_arg)); \
+}while(0)
+#endif
@@ -0,0 +1,130 @@
+/*
+SIO transcript
+===
+written from whichever thread drives the device, records of different devices
+are interleaved in the order they ended, see transcript.h for the format
+
+when no transcript is open, TRANSCRIPT_RECORD only tests transcript_on
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "pl.h"
+#include "transcript.h"
+
+#ifdef WINDOWS
+static volatile LONG lock;
+static void transcript_lock(void){
+	while(InterlockedExchange(&lock, 1)){
+		SwitchToThread();
+	}
+}
+static void transcript_unlock(void){
+	InterlockedExchange(&lock, 0);
+}
+#else
+#include <sched.h>
+static volatile int lock;
+static void transcript_lock(void){
+	while(__atomic_exchange_n(&lock, 1, __ATOMIC_ACQUIRE)){
+		sched_yield();
+	}
+}
+static void transcript_unlock(void){
+	__atomic_store_n(&lock, 0, __ATOMIC_RELEASE);
+}
+#endif
+
+#define TRANSCRIPT_DEVS 0x100
+
+volatile int transcript_on;
+static FILE *transcript_file;
+static u64 transcript_t;
+static u64 transcript_records, transcript_bytes;
+// the index is the dev of the records
+static tDev devs[TRANSCRIPT_DEVS];
+static uint n_devs;
+
+int transcript_open(const char *filename){
+	transcript_file = fopen(filename, "wb");
+	if(!transcript_file){
+		fprintf(stderr, "failed to open \"%s\" for write\n", filename);
+		return -1;
+	}
+	setvbuf(transcript_file, NULL, _IOFBF, 1 << 20);
+	fwrite(TRANSCRIPT_MAGIC, 1, TRANSCRIPT_MAGIC_LEN, transcript_file);
+	transcript_t = get_ntime();
+	transcript_records = 0;
+	transcript_bytes = TRANSCRIPT_MAGIC_LEN;
+	n_devs = 0;
+	transcript_on = 1;
+	return 0;
+}
+
+void transcript_close(void){
+	if(!transcript_file){
+		return;
+	}
+	transcript_lock();
+	transcript_on = 0;
+	fclose(transcript_file);
+	transcript_file = NULL;
+	transcript_unlock();
+	fprintf(stderr, "%llu transcript records, %llu bytes written\n",
+		transcript_records, transcript_bytes);
+}
+
+static uint put_varint(u8 *p, u64 v){
+	uint n = 0;
+	while(v >= 0x80){
+		p[n++] = (u8)v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = (u8)v;
+	return n;
+}
+
+// the newest first, a closed device's pointer can come back for the next one
+static int dev_index(tDev d){
+	uint i;
+	for(i = n_devs; i--; ){
+		if(devs[i % TRANSCRIPT_DEVS] == d){
+			return i % TRANSCRIPT_DEVS;
+		}
+	}
+	return -1;
+}
+
+void transcript_record(tDev d, u8 type, u64 t0, u64 t1, tSize req, const void *data, tSize n){
+	u8 head[2 + 10 * 4];
+	uint len = 0;
+	long long dt;
+	int dev;
+	transcript_lock();
+	// t0 is 0 if the call began before transcript_open
+	if(!transcript_file || !t0){
+		transcript_unlock();
+		return;
+	}
+	if(type == TR_OPEN){
+		dev = n_devs++ % TRANSCRIPT_DEVS;
+		devs[dev] = d;
+	}else if((dev = dev_index(d)) < 0){
+		// opened before the transcript
+		transcript_unlock();
+		return;
+	}
+	dt = (long long)(t0 - transcript_t);
+	transcript_t = t0;
+	head[len++] = type;
+	head[len++] = (u8)dev;
+	len += put_varint(head + len, dt < 0 ? ((u64)~dt << 1) | 1 : (u64)dt << 1);
+	len += put_varint(head + len, t1 - t0);
+	len += put_varint(head + len, req);
+	len += put_varint(head + len, n);
+	fwrite(head, 1, len, transcript_file);
+	fwrite(data, 1, n, transcript_file);
+	++transcript_records;
+	transcript_bytes += len + n;
+	transcript_unlock();
+}
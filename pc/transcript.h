@@ -0,0 +1,40 @@
+#ifndef transcript_h__
+#define transcript_h__
+
+#include "pl.h"
+
+/*
+SIO transcript
+===
+every write_serial and read_serial, bytes included, for replay/ to play back
+the file is TRANSCRIPT_MAGIC then one record per call:
+	u8 type, u8 dev
+	varint t	ns since the previous record started, zigzag signed
+	varint dur	ns spent in the call
+	varint req	bytes asked for, the same as n for writes
+	varint n	bytes written or read, n < req is a read timeout
+	u8 data[n]
+a TR_OPEN record comes first for every device, data is the device name
+varints are 7 bits per byte, low bits first, the top bit set on all but the last
+*/
+#define TRANSCRIPT_MAGIC "UCTR\1\0\0\0"
+#define TRANSCRIPT_MAGIC_LEN 8
+
+#define TR_OPEN 0
+#define TR_WRITE 1
+#define TR_READ 2
+
+// nonzero while a transcript is being written
+extern volatile int transcript_on;
+
+int transcript_open(const char *filename);
+void transcript_close(void);
+// t0 and t1 from get_ntime
+void transcript_record(tDev d, u8 type, u64 t0, u64 t1, tSize req, const void *data, tSize n);
+
+// TRANSCRIPT_BEGIN(t); ... TRANSCRIPT_RECORD(d, TR_WRITE, t, size, data, size);
+#define TRANSCRIPT_BEGIN(_t) u64 _t = transcript_on ? get_ntime() : 0
+#define TRANSCRIPT_RECORD(_d, _type, _t0, _req, _data, _n) do{ \
+	if(transcript_on) transcript_record((_d), (_type), (_t0), get_ntime(), (_req), (_data), (_n)); \
+}while(0)
+#endif
@@ -0,0 +1,1562 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/common.h"
+#include "pl.h"
+#include "crc.h"
+#include "gba.h"
+#include "ucagb.h"
+#include "journal.h"
+#include "cache.h"
+#include "zfile.h"
+#include "plan.h"
+#include "trace.h"
+#include "metrics.h"
+#include "fault.h"
+
+// df_wait replies that are neither BUSY nor IDLE before giving up
+#define DF_WAIT_GARBLED 8
+// a dump block is downloaded again this many times before giving up
+#define DUMP_RETRIES 3
+// a garbled transfer length can be up to 64MB, the NOPs double every try
+// up to 32MB, so 64MB worth are sent within 10 tries
+#define RESYNC_TRIES 12
+// a garbled worker command can keep DFAGB busy for a while, in ms
+#define RESYNC_BUSY 30000
+// a v2 frame not taken this many times in a row means DFAGB is out of step
+#define DF_FRAME_TRIES 3
+
+void ucagb_init(void){
+	crc_init();
+}
+
+u32 ucagb_crc32(const void *buf, u32 size){
+	return crc32_update(0, buf, size);
+}
+
+const char *ucagb_strerror(int err){
+	switch(err){
+		case UCAGB_OK: return "success";
+		case UCAGB_E_OPEN: return "can't open the serial port";
+		case UCAGB_E_PING: return "uCSIO not answering";
+		case UCAGB_E_IO: return "serial port error";
+		case UCAGB_E_TIMEOUT: return "serial port timeout";
+		case UCAGB_E_GBA: return "GBA not answering";
+		case UCAGB_E_CRC: return "CRC mismatch";
+		case UCAGB_E_FLASH: return "unsupported flash or flash failure";
+		case UCAGB_E_PARAM: return "invalid parameter";
+		case UCAGB_E_FILE: return "file error";
+		default: return "unknown error";
+	}
+}
+
+// the sticky serial error as a UCAGB_E_*
+static int dev_err(struct ucagb *s){
+	if(!s->d->err){
+		return UCAGB_OK;
+	}
+	return s->d->err == SERIAL_ETIMEOUT ? UCAGB_E_TIMEOUT : UCAGB_E_IO;
+}
+
+static void progress(struct ucagb *s, const char *op, u32 done, u32 total){
+	if(s->progress){
+		s->progress(s->progress_user, op, done, total);
+	}
+}
+
+static uint align(uint a, uint b){
+	return (a + b - 1) & (~(b - 1));
+}
+
+u8 *ucagb_load_file(const char *filename, tSize *psize, tSize a){
+	struct zfile *z = zfile_open(filename);
+	tSize size = 0, cap, n;
+	u8 *data;
+	if(!z){
+		fprintf(stderr, "failed to open \"%s\" for read\n", filename);
+		return NULL;
+	}
+	// a compressed file may not tell its size, the buffer grows then
+	cap = zfile_size(z);
+	cap = align((cap ? cap : ZFILE_BUF) + 1, a);
+	data = malloc(cap);
+	while((n = zfile_read(z, data + size, cap - size))){
+		size += n;
+		if(size == cap){
+			cap *= 2;
+			data = realloc(data, cap);
+		}
+	}
+	if(z->err){
+		fprintf(stderr, "\"%s\" is cut short or broken\n", filename);
+		zfile_close(z);
+		free(data);
+		return NULL;
+	}
+	zfile_close(z);
+	*psize = align(size, a);
+	if(*psize > cap){
+		data = realloc(data, *psize);
+	}
+	memset(data + size, 0, *psize - size);
+	return data;
+}
+
+int ucagb_save_file(const char *filename, const void *buf, tSize size){
+	struct zfile *z = zfile_create(filename, 0);
+	if(!z){
+		fprintf(stderr, "failed to open \"%s\" for write\n", filename);
+		return UCAGB_E_FILE;
+	}
+	zfile_write(z, buf, size);
+	return zfile_close(z) ? UCAGB_E_FILE : UCAGB_OK;
+}
+
+#define PING_PATTERN 0xff00aa55
+static int validate_uC(tDev d){
+	u8 c[5];
+	c[0] = CMD_PING | CMD_FLAG_W | CMD_FLAG_R;
+	*((u32*)&c[1]) = PING_PATTERN;
+	write_serial(d, c, 5);
+	read_serial(d, c, 4);
+	dev_printf(d, "ping returned 0x%08x, expecting 0x%08x\n", *((u32*)c), ~(u32)PING_PATTERN);
+	return (*((u32*)c)) ^ (~(u32)PING_PATTERN);
+}
+
+static const char *mcu_name(u32 mcu){
+	switch(mcu){
+		case CAPS_MCU_ATMEGA32U4: return "ATmega32U4";
+		case CAPS_MCU_AT90USB1286: return "AT90USB1286";
+		case CAPS_MCU_AT90USB162: return "AT90USB162";
+		case CAPS_MCU_EMU: return "emulator";
+		default: return "unknown MCU";
+	}
+}
+
+// the bulk sizes come from here, a uCSIO from before CMD_CAPS gets
+// the fixed BULK_SIZE bulks
+// reads are a whole number of IN packets, the last one isn't held back
+static void read_caps(struct ucagb *s){
+	tDev d = s->d;
+	struct ucagb_caps *c = &s->caps;
+	u8 cmd[(BULK_SIZE << 2) + 1];
+	u32 w[BULK_SIZE];
+	const char *v = getenv("UCAGB_BULK");
+	uint bulk, packet;
+	memset(cmd, 0, sizeof(cmd));
+	memset(w, 0, sizeof(w));
+	cmd[0] = CMD_CAPS | CMD_FLAG_W | CMD_FLAG_R | CMD_FLAG_B;
+	write_serial(d, cmd, sizeof(cmd));
+	read_serial(d, w, BULK_SIZE << 2);
+	memset(c, 0, sizeof(*c));
+	if(w[CAPS_W_MAGIC] != CAPS_MAGIC){
+		c->features = CAPS_F_COUNTER | CAPS_F_SET_WAIT | CAPS_F_BOOTLOADER;
+		c->bulk_max = BULK_SIZE;
+		dev_printf(d, "uCSIO without CMD_CAPS, %d word bulks\n", BULK_SIZE);
+		return;
+	}
+	c->version = w[CAPS_W_VERSION];
+	c->mcu = w[CAPS_W_MCU] & 0xff;
+	c->board = (w[CAPS_W_MCU] >> 8) & 0xff;
+	c->ep_in = w[CAPS_W_EP] & 0xffff;
+	c->ep_out = w[CAPS_W_EP] >> 16;
+	c->bulk_max = w[CAPS_W_BULK_MAX] > 0xff ? 0xff : w[CAPS_W_BULK_MAX];
+	c->ram = w[CAPS_W_RAM];
+	c->features = w[CAPS_W_FEATURES];
+	bulk = c->features & CAPS_F_XFERN ? c->bulk_max : 0;
+	if(v && (uint)atoi(v) < bulk){
+		bulk = atoi(v);
+	}
+	d->bulk_w = bulk;
+	packet = c->ep_in >> 2;
+	d->bulk_r = packet && bulk > packet ? bulk / packet * packet : bulk;
+	dev_printf(d, "uCSIO v%d, %s, endpoints %d/%d bytes, %d bytes free, %d word bulks\n",
+		c->version, mcu_name(c->mcu), c->ep_in, c->ep_out, c->ram, bulk ? bulk : BULK_SIZE);
+}
+
+// DFAGB in its IDLE state answers two DF_CMD_BUILD with the same id and IDLE
+// in between, an upload in progress gives nothing but IDLE, a download its data
+// 1 if in step, -1 while a worker is running
+static int df_in_step(tDev d){
+	u32 r[4];
+	xq_post32(d, DF_CMD_BUILD);
+	xq_post32(d, DF_CMD_NOP);
+	xq_post32(d, DF_CMD_BUILD);
+	xq_post32(d, DF_CMD_NOP);
+	r[0] = xq_collect32(d);
+	r[1] = xq_collect32(d);
+	r[2] = xq_collect32(d);
+	r[3] = xq_collect32(d);
+	if(r[1] == DF_STATE_BUSY && r[3] == DF_STATE_BUSY){
+		return -1;
+	}
+	return !d->err && r[1] == r[3] && r[1] != DF_STATE_IDLE && r[2] == DF_STATE_IDLE;
+}
+
+// after a timeout or a garbled command, the uCSIO may be in the middle of a
+// command and DFAGB in the middle of an upload or download of any length,
+// or running a worker it was never asked for
+// zeros finish the command (0 is no command), blocks of NOPs the transfer
+int ucagb_resync(struct ucagb *s){
+	tDev d = s->d;
+	// the longest command there is, CMD_XFERN with 255 words
+	u8 zero[(0xff << 2) + 2];
+	u32 i, j, t;
+	int r;
+	if(reset_serial(d)){
+		return UCAGB_E_IO;
+	}
+	METRIC_INC(M_RESYNCS);
+	dev_printf(d, "resync\n");
+	gba_free(d);
+	memset(zero, 0, sizeof(zero));
+	write_serial(d, zero, sizeof(zero));
+	reset_serial(d);
+	if(validate_uC(d)){
+		return d->err ? dev_err(s) : UCAGB_E_PING;
+	}
+	// whatever got us here counts against the line
+	if(rate_block(&s->rate, 0)){
+		s->wait_p0 = rate_wait(&s->rate);
+	}
+	s->garbled = d->garbled;
+	set_wait(d, s->wait_p0, 0);
+	for(i = 0; i < AGB_BUF_SIZE >> 2; ++i){
+		((u32*)s->buf)[i] = DF_CMD_NOP;
+	}
+	t = get_rtime();
+	for(i = 0; i < RESYNC_TRIES && !d->err; ){
+		r = df_in_step(d);
+		if(r > 0){
+			return UCAGB_OK;
+		}else if(r < 0){
+			if(get_rtime() - t > RESYNC_BUSY){
+				break;
+			}
+			sleep(1000/0x10);
+			continue;
+		}
+		// twice as many NOPs every time
+		for(j = 0; j < 1u << (i < 8 ? i : 8) && !d->err; ++j){
+			xfer32bw(d, s->buf, AGB_BUF_SIZE);
+		}
+		++i;
+	}
+	return d->err ? dev_err(s) : UCAGB_E_GBA;
+}
+
+int ucagb_open(struct ucagb **ps, const char *devname, const char *name){
+	struct ucagb *s;
+	tDev d;
+	int faults = fault_on;
+	*ps = NULL;
+	d = open_serial(devname);
+	if(validate_serial(d)){
+		fprintf(stderr, "can't open %s\n", devname);
+		return UCAGB_E_OPEN;
+	}
+	d->name = name;
+	setup_serial(d);
+	s = calloc(1, sizeof(struct ucagb));
+	s->d = d;
+	rate_init(&s->rate, devname);
+	s->wait_p0 = rate_wait(&s->rate);
+	s->buf = malloc(AGB_BUF_SIZE);
+	if(validate_uC(d)){
+		dev_printf(d, "ping %s failed\n", devname);
+		ucagb_close(s);
+		return UCAGB_E_PING;
+	}
+	dev_printf(d, "ping %s success\n", devname);
+	// what is on the other end has to be read over a clean line
+	fault_on = 0;
+	read_caps(s);
+	fault_on = faults;
+	if(d->err){
+		ucagb_close(s);
+		return UCAGB_E_PING;
+	}
+	if(fault_on && fault_allowed(s->caps.mcu == CAPS_MCU_EMU)){
+		ucagb_close(s);
+		return UCAGB_E_PARAM;
+	}
+	*ps = s;
+	return UCAGB_OK;
+}
+
+// whatever is still in the transmit ring goes out before we leave
+void ucagb_close(struct ucagb *s){
+	if(s == NULL){
+		return;
+	}
+	rate_save(&s->rate);
+	gba_free(s->d);
+	close_serial(s->d);
+	free(s->buf);
+	free(s);
+}
+
+void ucagb_set_progress(struct ucagb *s, ucagb_progress f, void *user){
+	s->progress = f;
+	s->progress_user = user;
+}
+
+void ucagb_set_log(struct ucagb *s, ucagb_log f, void *user){
+	s->d->log = f;
+	s->d->log_user = user;
+}
+
+void ucagb_set_wait(struct ucagb *s, u8 wait_p0){
+	s->wait_p0 = wait_p0;
+	s->rate.fixed = 1;
+}
+
+// every 128KB block goes through here, see rate.h
+// a reply df_wait had to skip since the last block fails it as well
+// 1 if the wait changed
+static int link_block(struct ucagb *s, int ok){
+	tDev d = s->d;
+	ok = ok && d->garbled == s->garbled;
+	s->garbled = d->garbled;
+	if(!rate_block(&s->rate, ok)){
+		return 0;
+	}
+	s->wait_p0 = rate_wait(&s->rate);
+	dev_printf(d, "link %s, ", ok ? "clean" : "errors");
+	set_wait(d, s->wait_p0, 0);
+	return 1;
+}
+
+void set_wait(tDev d, u8 wait_p0, u8 wait_p1){
+	u8 c[] = {CMD_SET_WAIT | CMD_FLAG_W, wait_p0, wait_p1, 0, 0};
+	dev_printf(d, "set_wait(%d, %d)\n", wait_p0, wait_p1);
+	write_serial(d, &c, 5);
+}
+
+// the CRC32 of the DF_BUILD_TAG string, 0 if rom isn't a DFAGB which has one
+static u32 rom_build_id(const u8 *rom, tSize size){
+	tSize n = sizeof(DF_BUILD_TAG) - 1, i, j;
+	for(i = 0; i + n <= size; ++i){
+		if(!memcmp(rom + i, DF_BUILD_TAG, n)){
+			for(j = i + n; j < size && rom[j]; ++j);
+			return ucagb_crc32(rom + i, j - i);
+		}
+	}
+	return 0;
+}
+
+// a running DFAGB answers NOP with IDLE, it is asked for its build id then
+// the BIOS multiboot slave never answers IDLE
+static int df_probe(struct ucagb *s, u32 *build){
+	tDev d = s->d;
+	set_wait(d, s->wait_p0, 0);
+	xfer32(d, DF_CMD_NOP);
+	if(xfer32(d, DF_CMD_NOP) != DF_STATE_IDLE){
+		return 0;
+	}
+	xfer32(d, DF_CMD_BUILD);
+	*build = xfer32(d, DF_CMD_NOP);
+	return 1;
+}
+
+int ucagb_multiboot(struct ucagb *s, const u8 *rom, tSize size){
+	tDev d = s->d;
+	u8 *buf;
+	uint t;
+	u64 t0;
+	u32 id, running;
+	int r = UCAGB_OK;
+
+	if(size < 0xc0 || size > 0x40000){
+		return UCAGB_E_PARAM;
+	}
+
+	// the same DFAGB is already there, gba_ready would only reset it
+	id = s->cold ? 0 : rom_build_id(rom, size);
+	if(id && df_probe(s, &running)){
+		if(running == id){
+			dev_printf(d, "DFAGB build 0x%08x already running, multiboot skipped\n", id);
+			progress(s, "multiboot", size, size);
+			return dev_err(s);
+		}
+		dev_printf(d, "DFAGB build 0x%08x running, 0x%08x wanted, rebooting it\n", running, id);
+	}
+	// encrypted in place
+	buf = malloc(align(size, BULK_SIZE << 2));
+	memset(buf, 0, align(size, BULK_SIZE << 2));
+	memcpy(buf, rom, size);
+	size = align(size, BULK_SIZE << 2);
+
+	set_wait(d, 0, 0);
+
+	t0 = trace_on ? get_ntime() : 0;
+	progress(s, "multiboot", 0, size);
+	if(gba_ready(d)){
+		r = UCAGB_E_GBA;
+	}else{
+		t = get_rtime();
+		if(gba_multiboot(d, buf, size)){
+			r = UCAGB_E_GBA;
+		}else{
+			TRACE_END_ARG(t0, "multiboot", "bytes", size);
+			s->proto = 0;
+			t = get_rtime() - t;
+			dev_printf(d, "transfer time: %.2f seconds, average speed %.2f Kbps(%.2f KB/s)\n",
+				t / 1000.0, size * 8.0 / t, size * 1.0 / t);
+			progress(s, "multiboot", size, size);
+		}
+	}
+	free(buf);
+	return dev_err(s) ? dev_err(s) : r;
+}
+
+void ucagb_reset_to_bootloader(struct ucagb *s){
+	u8 c = CMD_BOOTLOADER;
+	write_serial(s->d, &c, 1);
+	dev_printf(s->d, "reset to bootloader command sent\n");
+}
+
+int ucagb_serial_bench(struct ucagb *s, int mode, int length){
+	tDev d = s->d;
+	uint i, t0, dt;
+	u8 c[BULK_SIZE * 5], *p = 0;
+	const char *mode_str;
+
+	length = align(length, BULK_SIZE << 2);
+	c[0] = CMD_COUNTER;
+	write_serial(d, c, 1);
+
+	dev_printf(d, "starting %d bytes serial speed test\n", length);
+	t0 = get_rtime();
+	if(mode == 0){
+		// 4 bytes per write, the simplest and slowest
+		mode_str = "32 bit";
+		c[0] = CMD_FLAG_W;
+		c[1] = 0; c[2] = 0; c[3] = 0; c[4] = 0;
+		for(i = 0; i < length / 4; ++i){
+			write_serial(d, c, 5);
+		}
+	}else if(mode == 1){
+		// transfer the entire file with a single write, massive performance improve
+		// only works with the simplified benchmark only uC firmware
+		// but if the file goes to big, WriteFile will fail
+		mode_str = "single bulk";
+		p = malloc(length / 4 * 5);
+		memset(p, 0, length / 4 * 5);
+		for(i = 0; i < length / 4; ++i){
+			p[i * 5] = CMD_FLAG_W;
+		}
+		write_serial(d, p, length / 4 * 5);
+	}else if(mode == 2){
+		// BULK_SIZE per write, performance close to mode 1 in this test
+		// but overall real world multiboot performance is only a tiny bit better than mode 0
+		mode_str = "32 bytes semi bulks";
+		memset(c, 0, BULK_SIZE * 5);
+		for(i = 0; i < BULK_SIZE; ++i){
+			c[i * 5] = CMD_FLAG_W;
+		}
+		for(i = 0; i < length / BULK_SIZE / 4; ++i){
+			write_serial(d, c, BULK_SIZE * 5);
+		}
+	}else if(mode = 3){
+		// similar to mode 2 but uses a single CMD_WB instead of a series of CMD_W
+		// better than mode 2, I guess that's because the reduced write amp(5/4 -> 33/32)
+		// but multiboot need a huge wait between xfer, overall multiboot performance worse than mode 2
+		mode_str = "32 bytes bulks";
+		c[0] = CMD_FLAG_W | CMD_FLAG_B;
+		for(i = 0; i < length / BULK_SIZE / 4; ++i){
+			write_serial(d, c, 1 + (BULK_SIZE << 2));
+		}
+	}
+
+	dt = get_rtime() - t0;
+	dev_printf(d, "%s mode, transfer time: %.2f seconds, average speed %.2f Kbps, %.2f KB/s\n",
+		mode_str, dt / 1000.0, length *  8.0 / dt, length * 1.0 / dt);
+
+	if(p != 0){
+		free(p);
+	}
+
+	// read the counter
+	c[0] = CMD_COUNTER | CMD_FLAG_R | CMD_FLAG_B;
+	write_serial(d, c, 1);
+	read_serial(d, c, BULK_SIZE << 2);
+	dev_printf(d, "uC counter: r = %d, w = %d, x = %d\n",
+		((u32*)c)[0], ((u32*)c)[1], ((u32*)c)[2]);
+
+	return dev_err(s);
+}
+
+// the caller may have posted the first DF_CMD_NOP already
+// only sleeps when DFAGB is not IDLE yet, short workers don't pay a poll interval
+// anything but BUSY and IDLE means a garbled command left DFAGB in a transfer,
+// it would never end, that is handled like a timeout, see ucagb_resync
+void df_wait(tDev d, const char *msg, int posted){
+	u32 r, polls = 0, garbled = 0;
+	TRACE_BEGIN(t0);
+	while(!d->err){
+		if(!posted){
+			xq_post32(d, DF_CMD_NOP);
+		}
+		posted = 0;
+		r = xq_collect32(d);
+		++polls;
+		dev_printf(d, "\r%s, response: 0x%08x", msg, r);
+		if(r == DF_STATE_IDLE){
+			break;
+		}
+		if(r != DF_STATE_BUSY){
+			++d->garbled;
+			if(++garbled >= DF_WAIT_GARBLED){
+				dev_printf(d, "\nDFAGB out of step\n");
+				d->err = SERIAL_ETIMEOUT;
+				break;
+			}
+		}
+		TRACE_BEGIN(t1);
+		sleep(1000/0x10);
+		TRACE_END(t1, "poll_sleep");
+	}
+	TRACE_END_ARG(t0, "df_wait", "polls", polls);
+	METRIC_ADD(M_WAIT_POLLS, polls);
+}
+
+void df_upload(tDev d, const void * buf, u32 size){
+	unsigned t;
+	TRACE_BEGIN(t0);
+	// df_wait(d, "waiting for DFAGB", 0);
+	dev_printf(d, "uploading %d bytes to DFAGB...\n", size);
+	t = get_rtime();
+	xfer32wbw(d, DF_CMD_UPLOAD | (size >> 2), buf, size);
+	flush_serial(d);
+	TRACE_END_ARG(t0, "df_upload", "bytes", size);
+	t = get_rtime() - t;
+	dev_printf(d, "upload to DFAGB complete, %.2f seconds, average speed %.2f Kbps(%.2f KB/s)\n",
+		t / 1000.0, size * 8.0 / t, size * 1.0 / t);
+}
+
+void df_download(tDev d, void *buf, u32 size){
+	unsigned t;
+	TRACE_BEGIN(t0);
+	dev_printf(d, "downloading %d bytes from DFAGB...\n", size);
+	t = get_rtime();
+	xfer32wo(d, DF_CMD_DOWNLOAD | (size >> 2));
+	xfer32br(d, buf, size);
+	TRACE_END_ARG(t0, "df_download", "bytes", size);
+	t = get_rtime() - t;
+	dev_printf(d, "download from DFAGB complete, %.2f seconds, average speed %.2f Kbps(%.2f KB/s)\n",
+		t / 1000.0, size * 8.0 / t, size * 1.0 / t);
+}
+
+// trace span names of the worker commands
+static const char *df_cmd_name(u32 cmd){
+	switch(cmd & DF_CMD_MASK){
+		case DF_CMD_CRC32: return "worker CRC32";
+		case DF_CMD_READ_SRAM: return "worker READ_SRAM";
+		case DF_CMD_WRITE_SRAM: return "worker WRITE_SRAM";
+		case DF_CMD_READ_FLASH: return "worker READ_FLASH";
+		case DF_CMD_WRITE_FLASH: return "worker WRITE_FLASH";
+		case DF_CMD_READ_EEPROM: return "worker READ_EEPROM";
+		case DF_CMD_WRITE_EEPROM: return "worker WRITE_EEPROM";
+		case DF_CMD_DUMP: return "worker DUMP";
+		case DF_CMD_VERIFY: return "worker VERIFY";
+		case DF_CMD_ID: return "worker ID";
+		case DF_CMD_UNLOCK: return "worker UNLOCK";
+		case DF_CMD_ERASE: return "worker ERASE";
+		case DF_CMD_PROGRAM: return "worker PROGRAM";
+		default: return "worker";
+	}
+}
+
+u32 df_worker(tDev d, u32 cmd, const char *msg0, const char *msg1, const char *msg2){
+	u32 t, r;
+	u64 t0 = get_ntime();
+	if(msg0){
+		dev_printf(d, "%s", msg0);
+	}
+	t = get_rtime();
+	// command and the first poll share a frame, so do READ and its reply
+	xq_post32wo(d, cmd);
+	xq_post32(d, DF_CMD_NOP);
+	df_wait(d, msg1, 1);
+	xq_post32wo(d, DF_CMD_READ);
+	xq_post32ro(d);
+	r = xq_collect32(d);
+	TRACE_END_ARG(t0, df_cmd_name(cmd), "response", r);
+	metric_observe(H_WORKER, get_ntime() - t0);
+	t = get_rtime() - t;
+	dev_printf(d, "\n%s, response: 0x%08x, %.2f seconds\n",
+		msg2, r, t / 1000.0);
+	return r;
+}
+
+// a worker command of a v2 frame, r is its result
+struct df_job {
+	u32 cmd, offset, length, r;
+};
+
+// v2 answers DF_CMD_PROTO with DF_PROTO_V2, an older DFAGB with IDLE
+// every operation starts here, the first of a session waits for a worker
+// a session that died may have left running, DFAGB would drop the commands
+static int df_proto(struct ucagb *s){
+	tDev d = s->d;
+	const char *v;
+	u32 r;
+	if(s->proto){
+		return s->proto;
+	}
+	df_wait(d, "waiting for DFAGB", 0);
+	v = getenv("UCAGB_PROTO");
+	if(v && atoi(v) == 1){
+		s->proto = 1;
+		return 1;
+	}
+	xq_post32wo(d, DF_CMD_PROTO);
+	xq_post32(d, DF_CMD_NOP);
+	r = xq_collect32(d);
+	if(d->err){
+		return 1;
+	}
+	s->proto = r == DF_PROTO_V2 ? 2 : 1;
+	dev_printf(d, "DFAGB protocol v%d\n", s->proto);
+	return s->proto;
+}
+
+// the single word command of a job, cart offsets in 256 byte units
+static u32 df_v1(const struct df_job *j){
+	switch(j->cmd){
+		case DF_CMD_CRC32:
+		case DF_CMD_READ_SRAM:
+		case DF_CMD_WRITE_SRAM:
+		case DF_CMD_READ_FLASH:
+		case DF_CMD_WRITE_FLASH:
+		case DF_CMD_READ_EEPROM:
+		case DF_CMD_WRITE_EEPROM:
+			return j->cmd | j->length;
+		default:
+			return j->cmd | j->offset >> 8;
+	}
+}
+
+// n worker commands, DF_FRAME_MAX at most, one after the other
+// v2 sends them in one frame with the first poll, and reads all the results
+// in one go once DFAGB is IDLE, v1 runs a df_worker for each
+// a result that never came back with its id and sequence is DF_STATE_NAK
+static int df_batch(struct ucagb *s, struct df_job *j, uint n, const char *msg){
+	tDev d = s->d;
+	u32 w[DF_FRAME_MAX * DF_FRAME_WORDS + 2], hdr[DF_FRAME_MAX], r, v, i, k, t, tries;
+	u32 idx, left, got = 0;
+	u64 t0;
+	if(df_proto(s) < 2){
+		for(i = 0; i < n && !d->err; ++i){
+			j[i].r = df_worker(d, df_v1(&j[i]), NULL, msg, "done");
+		}
+		return dev_err(s);
+	}
+	t0 = get_ntime();
+	t = get_rtime();
+	k = 0;
+	w[k++] = DF_CMD_FRAME | n;
+	for(i = 0; i < n; ++i){
+		++s->seq;
+		hdr[i] = DF_RESULT | j[i].cmd >> 16 | s->seq;
+		w[k++] = j[i].cmd >> 24 | s->seq << 8;
+		w[k++] = j[i].offset;
+		w[k++] = j[i].length;
+	}
+	for(i = 0, r = 0; i < k; ++i){
+		r += w[i];
+	}
+	w[k++] = ~r;
+	for(tries = 0; !d->err; ){
+		for(i = 0; i < k; ++i){
+			xq_post32wo(d, w[i]);
+		}
+		// the reply to the checksum, then the first poll
+		xq_post32(d, DF_CMD_NOP);
+		xq_post32(d, DF_CMD_NOP);
+		r = xq_collect32(d);
+		if(r == DF_STATE_BUSY){
+			df_wait(d, msg, 1);
+			break;
+		}
+		// the ack could have been garbled on its way back, the poll can't
+		// be IDLE yet if the frame was taken, workers start at VBlank
+		if(xq_collect32(d) == DF_STATE_BUSY){
+			df_wait(d, msg, 0);
+			break;
+		}
+		++d->garbled;
+		METRIC_INC(M_FRAME_NAK);
+		dev_printf(d, "frame not taken, response: 0x%08x\n", r);
+		if(++tries == DF_FRAME_TRIES){
+			dev_printf(d, "DFAGB out of step\n");
+			d->err = SERIAL_ETIMEOUT;
+			break;
+		}
+		// NOPs fill up and drop whatever is left of a frame DFAGB is still in
+		for(i = 0; i < DF_FRAME_MAX * DF_FRAME_WORDS + 1; ++i){
+			xq_post32(d, DF_CMD_NOP);
+		}
+		for(i = 0; i < DF_FRAME_MAX * DF_FRAME_WORDS + 1; ++i){
+			xq_collect32(d);
+		}
+	}
+	// results are matched by sequence, one whose DF_CMD_RESULT got garbled
+	// is still there for the next round
+	for(i = 0; i < n; ++i){
+		j[i].r = DF_STATE_NAK;
+	}
+	for(left = n, tries = 0; left && !d->err && tries < DF_FRAME_TRIES; ++tries){
+		for(i = 0; i < left; ++i){
+			xq_post32wo(d, DF_CMD_RESULT);
+			xq_post32(d, DF_CMD_NOP);
+			xq_post32(d, DF_CMD_NOP);
+		}
+		for(i = 0, k = left; i < k; ++i){
+			r = xq_collect32(d);
+			v = xq_collect32(d);
+			idx = (u8)(r - hdr[0]);
+			if(idx < n && r == hdr[idx] && !(got & 1 << idx)){
+				got |= 1 << idx;
+				j[idx].r = v;
+				--left;
+			}else{
+				++d->garbled;
+				dev_printf(d, "\nresult 0x%08x not expected\n", r);
+			}
+		}
+	}
+	if(left){
+		METRIC_ADD(M_FRAME_RESULT, left);
+	}
+	TRACE_END_ARG(t0, "worker frame", "commands", n);
+	metric_observe(H_WORKER, get_ntime() - t0);
+	t = get_rtime() - t;
+	dev_printf(d, "\ndone, %d commands, %.2f seconds\n", n, t / 1000.0);
+	return dev_err(s);
+}
+
+int ucagb_df_test(struct ucagb *s, unsigned seed){
+	tDev d = s->d;
+	u8 *buf = s->buf;
+	unsigned i, crc;
+	set_wait(d, s->wait_p0, 0);
+	// dev_printf(d, "RAND_MAX = 0x%08x\n", RAND_MAX);
+	srand(seed);
+	for(i = 0; i < AGB_BUF_SIZE; ++i){
+		buf[i] = rand() & 0xff;
+	}
+	crc = ucagb_crc32(buf, AGB_BUF_SIZE);
+	// save_file("128K.a.bin", buf, AGB_BUF_SIZE);
+	dev_printf(d, "random buffer CRC32: 0x%08x\n", crc);
+
+	df_upload(d, buf, AGB_BUF_SIZE);
+
+	while(!d->err){
+		crc = df_worker(d, DF_CMD_CRC32 | AGB_BUF_SIZE,
+			NULL, "waiting for DFAGB CRC32", "DFAGB CRC32 returned");
+		if(crc == 0x454c4449){
+			break;
+		}
+	}
+
+	df_download(d, buf, AGB_BUF_SIZE);
+
+	// save_file("128K.b.bin", buf, AGB_BUF_SIZE);
+	crc = ucagb_crc32(buf, AGB_BUF_SIZE);
+	dev_printf(d, "buffer CRC32: 0x%08x\n", crc);
+
+	return dev_err(s);
+}
+
+int ucagb_flash_block(struct ucagb *s, const u8 *block, u32 crc0, u32 i){
+	tDev d = s->d;
+	u32 crc1, tries = 0;
+	u64 t0 = get_ntime();
+	// the verify only counts once the CRC matched
+	struct df_job check[] = {
+		{DF_CMD_CRC32, 0, AGB_BUF_SIZE, 0},
+		{DF_CMD_VERIFY, i * AGB_BUF_SIZE, AGB_BUF_SIZE, 0},
+	}, write[] = {
+		{DF_CMD_ERASE, i * AGB_BUF_SIZE, AGB_BUF_SIZE, 0},
+		{DF_CMD_PROGRAM, i * AGB_BUF_SIZE, AGB_BUF_SIZE, 0},
+	};
+	// coincidentally our AGB_BUF_SIZE == I28F128J3 block size
+	// dev_printf(d, "processing rom block %d @%08x\n", i, (u32)block);
+
+	// some ugly retry
+	while(!d->err){
+		df_upload(d, block, AGB_BUF_SIZE);
+		df_batch(s, check, 2, "waiting for DFAGB CRC32 and verify");
+		if(d->err){
+			break;
+		}
+		crc1 = check[0].r;
+		link_block(s, crc0 == crc1);
+		if(crc0 == crc1){
+			dev_printf(d, "CRC match, 0x%08x == 0x%08x\n", crc0, crc1);
+			break;
+		}else{
+			dev_printf(d, "CRC mismatch, 0x%08x != 0x%08x\n", crc0, crc1);
+			METRIC_INC(M_CRC_MISMATCH_UPLOAD);
+			if(s->upload_tries && ++tries >= s->upload_tries){
+				return UCAGB_E_CRC;
+			}
+			METRIC_INC(M_RETRY_UPLOAD);
+		}
+	}
+	if(!d->err && !check[1].r){
+		dev_printf(d, "identical block, skipped\n");
+		TRACE_END_ARG(t0, "flash_block", "block", i);
+		METRIC_INC(M_BLOCKS_SKIPPED);
+		metric_observe(H_FLASH_BLOCK, get_ntime() - t0);
+		return dev_err(s) ? dev_err(s) : 1;
+	}
+	// with v2 the program runs even if the erase failed, it is all
+	// done over again then anyway
+	while(!d->err){
+		if(df_batch(s, write, 2, "erasing and programming")){
+			break;
+		}
+		if(write[0].r != 0x80){
+			METRIC_INC(M_ERASE_FAIL);
+			METRIC_INC(M_RETRY_ERASE);
+			continue;
+		}
+		// I've seen r = DF_STATE_IDLE instead of 0x80 while GBA side is OK
+		// very hard to reproduce, I can't figure out why :(
+		if(write[1].r != 0x80){
+			// the erase is repeated too
+			METRIC_INC(M_PROGRAM_FAIL);
+			METRIC_INC(M_RETRY_PROGRAM);
+			continue;
+		}
+		break;
+		// TODO: verify the block
+	}
+	TRACE_END_ARG(t0, "flash_block", "block", i);
+	METRIC_INC(M_BLOCKS_FLASHED);
+	metric_observe(H_FLASH_BLOCK, get_ntime() - t0);
+	return dev_err(s);
+}
+
+// size is the ROM size, data isn't touched beyond it
+static int image_setup(struct ucagb_image *img, const u8 *data, tSize size){
+	tSize rest = size % AGB_BUF_SIZE;
+	u32 i;
+	TRACE_BEGIN(t0);
+	img->data = data;
+	img->size = align(size, AGB_BUF_SIZE);
+	img->blocks = img->size / AGB_BUF_SIZE;
+	img->tail = NULL;
+	if(rest){
+		img->tail = malloc(AGB_BUF_SIZE);
+		memcpy(img->tail, data + size - rest, rest);
+		memset(img->tail + rest, 0, AGB_BUF_SIZE - rest);
+	}
+	img->crc = malloc(img->blocks * sizeof(u32));
+	img->crc_rom = 0;
+	for(i = 0; i < img->blocks; ++i){
+		img->crc[i] = ucagb_crc32(ucagb_image_block(img, i), AGB_BUF_SIZE);
+		// the padding isn't part of the ROM
+		if(rest && i == img->blocks - 1){
+			img->crc_rom = crc32_combine(img->crc_rom, ucagb_crc32(img->tail, rest), rest);
+		}else{
+			img->crc_rom = crc32_combine(img->crc_rom, img->crc[i], AGB_BUF_SIZE);
+		}
+	}
+	TRACE_END_ARG(t0, "host_crc32", "bytes", img->size);
+	return UCAGB_OK;
+}
+
+int ucagb_image_init(struct ucagb_image *img, u8 *data, tSize size){
+	img->owned = data;
+	img->map.data = NULL;
+	return image_setup(img, data, size);
+}
+
+int ucagb_image_load(struct ucagb_image *img, const char *filename){
+	tSize size;
+	u8 *data;
+	img->owned = NULL;
+	if(map_file(&img->map, filename)){
+		fprintf(stderr, "failed to open \"%s\" for read\n", filename);
+		img->data = NULL;
+		return UCAGB_E_FILE;
+	}
+	if(zfile_magic(img->map.data, img->map.size) == ZF_PLAIN){
+		return image_setup(img, img->map.data, img->map.size);
+	}
+	// every block's CRC32 is needed before the first upload, a compressed
+	// ROM is decompressed to memory in one go
+	unmap_file(&img->map);
+	data = ucagb_load_file(filename, &size, 1);
+	if(!data){
+		img->data = NULL;
+		return UCAGB_E_FILE;
+	}
+	return ucagb_image_init(img, data, size);
+}
+
+const u8 *ucagb_image_block(const struct ucagb_image *img, u32 i){
+	if(img->tail && i == img->blocks - 1){
+		return img->tail;
+	}
+	return img->data + i * AGB_BUF_SIZE;
+}
+
+void ucagb_image_free(struct ucagb_image *img){
+	unmap_file(&img->map);
+	free(img->owned);
+	free(img->tail);
+	free(img->crc);
+	img->data = NULL;
+	img->owned = NULL;
+	img->tail = NULL;
+	img->crc = NULL;
+}
+
+// the cart's block 0 finds its entry, a few other blocks picked at random
+// have to agree with it, anything flashed elsewhere in between drops it
+static void flash_cache(struct ucagb *s, struct cache *c, u32 id){
+	tDev d = s->d;
+	struct df_job j[2 * (CACHE_SAMPLES + 1)];
+	u32 b[CACHE_SAMPLES], n, k;
+	j[0].cmd = DF_CMD_DUMP;
+	j[0].offset = 0;
+	j[0].length = AGB_BUF_SIZE;
+	j[1].cmd = DF_CMD_CRC32;
+	j[1].offset = 0;
+	j[1].length = AGB_BUF_SIZE;
+	df_batch(s, j, 2, "waiting for block 0 CRC32");
+	if(d->err){
+		memset(c, 0, sizeof(*c));
+		return;
+	}
+	if(cache_load(c, id, j[1].r)){
+		n = cache_samples(c, b, CACHE_SAMPLES);
+		for(k = 0; k < n; ++k){
+			j[2 * k] = j[0];
+			j[2 * k].offset = b[k] * AGB_BUF_SIZE;
+			j[2 * k + 1] = j[1];
+		}
+		df_batch(s, j, 2 * n, "spot checking cached blocks");
+		for(k = 0; k < n; ++k){
+			if(d->err || !cache_has(c, b[k], j[2 * k + 1].r)){
+				dev_printf(d, "cache: block %d changed, not trusted\n", b[k]);
+				cache_forget(c);
+				break;
+			}
+		}
+		if(k == n){
+			dev_printf(d, "cache: cart known, %d blocks checked\n", n + 1);
+		}
+	}
+	// read just now, it counts whatever the entry said
+	cache_set(c, 0, c->key);
+}
+
+// DUMP + CRC32 of every block from start on that the cart cache can't tell,
+// nothing is downloaded, the plan knows what each block needs afterwards
+static int flash_survey(struct ucagb *s, struct plan *p, const struct ucagb_image *img, struct cache *c, u32 start){
+	tDev d = s->d;
+	struct df_job j[2 * PLAN_SURVEY_FRAME];
+	u32 b[PLAN_SURVEY_FRAME], i, k, n = 0;
+	u64 t0;
+	for(i = start; i < p->blocks; ++i){
+		if(!cache_known(c, i)){
+			plan_survey(p, i);
+		}
+	}
+	if(p->ops[PLAN_OP_SURVEY]){
+		dev_printf(d, "plan: surveying %d blocks, predicted %.2fs\n",
+			p->ops[PLAN_OP_SURVEY], plan_predict(p, PLAN_OP_SURVEY) / 1e9);
+	}
+	for(i = start; i < p->blocks; ++i){
+		// the cache passed the spot check, what it knows is what the cart has
+		if(cache_known(c, i)){
+			if(plan_block(p, i, img->crc[i], c->crc[i]) == PLAN_SAME){
+				METRIC_INC(M_BLOCKS_CACHED);
+			}
+		}else{
+			b[n++] = i;
+		}
+		if(n < PLAN_SURVEY_FRAME && !(n && i == p->blocks - 1)){
+			continue;
+		}
+		for(k = 0; k < n; ++k){
+			j[2 * k].cmd = DF_CMD_DUMP;
+			j[2 * k].offset = b[k] * AGB_BUF_SIZE;
+			j[2 * k].length = AGB_BUF_SIZE;
+			j[2 * k + 1].cmd = DF_CMD_CRC32;
+			j[2 * k + 1].offset = 0;
+			j[2 * k + 1].length = AGB_BUF_SIZE;
+		}
+		t0 = get_ntime();
+		df_batch(s, j, 2 * n, "surveying the cart");
+		if(d->err){
+			return dev_err(s);
+		}
+		plan_time(p, PLAN_OP_SURVEY, n, get_ntime() - t0);
+		for(k = 0; k < n; ++k){
+			// a result that never came makes it a block to write
+			if(j[2 * k + 1].r != DF_STATE_NAK){
+				cache_set(c, b[k], j[2 * k + 1].r);
+			}
+			if(plan_block(p, b[k], img->crc[b[k]], j[2 * k + 1].r) == PLAN_SAME){
+				METRIC_INC(M_BLOCKS_SKIPPED);
+			}
+		}
+		n = 0;
+	}
+	return UCAGB_OK;
+}
+
+// every PLAN_ERASE and PLAN_WRITE block, DF_FRAME_MAX to a frame, one that
+// failed goes again with the next frame, a PLAN_WRITE is blank afterwards
+static int flash_erase(struct ucagb *s, struct plan *p, const struct ucagb_image *img,
+	struct cache *c, struct journal *jl, u32 *done){
+	tDev d = s->d;
+	struct df_job j[DF_FRAME_MAX];
+	u32 b[DF_FRAME_MAX], i = 0, k, m, n = 0;
+	u64 t0;
+	while(1){
+		for(; i < p->blocks && n < DF_FRAME_MAX; ++i){
+			if(p->cls[i] == PLAN_ERASE || p->cls[i] == PLAN_WRITE){
+				b[n++] = i;
+			}
+		}
+		if(!n){
+			return UCAGB_OK;
+		}
+		for(k = 0; k < n; ++k){
+			j[k].cmd = DF_CMD_ERASE;
+			j[k].offset = b[k] * AGB_BUF_SIZE;
+			j[k].length = AGB_BUF_SIZE;
+			// whatever it had, it may be half erased now
+			cache_unset(c, b[k]);
+		}
+		t0 = get_ntime();
+		df_batch(s, j, n, "erasing");
+		if(d->err){
+			return dev_err(s);
+		}
+		plan_time(p, PLAN_OP_ERASE, n, get_ntime() - t0);
+		for(k = m = 0; k < n; ++k){
+			if(j[k].r != 0x80){
+				METRIC_INC(M_ERASE_FAIL);
+				METRIC_INC(M_RETRY_ERASE);
+				b[m++] = b[k];
+				continue;
+			}
+			cache_set(c, b[k], p->blank);
+			if(p->cls[b[k]] == PLAN_ERASE){
+				dev_printf(d, "block %d erased, blank in the ROM\n", b[k] + 1);
+				METRIC_INC(M_BLOCKS_FLASHED);
+				if(jl){
+					journal_block(jl, b[k], img->crc[b[k]]);
+				}
+				progress(s, "flash", ++*done, p->blocks);
+			}
+		}
+		n = m;
+	}
+}
+
+// a blank block, uploaded until DFAGB has the right CRC32, then programmed
+// a program that failed is done again after another erase
+static int flash_program(struct ucagb *s, struct plan *p, const u8 *block, u32 crc0, u32 i){
+	tDev d = s->d;
+	u64 t0 = get_ntime(), t1;
+	struct df_job check = {DF_CMD_CRC32, 0, AGB_BUF_SIZE, 0}, write[] = {
+		{DF_CMD_ERASE, i * AGB_BUF_SIZE, AGB_BUF_SIZE, 0},
+		{DF_CMD_PROGRAM, i * AGB_BUF_SIZE, AGB_BUF_SIZE, 0},
+	}, *w = write + 1;
+	uint n = 1;
+
+	while(!d->err){
+		t1 = get_ntime();
+		df_upload(d, block, AGB_BUF_SIZE);
+		df_batch(s, &check, 1, "waiting for DFAGB CRC32");
+		plan_time(p, PLAN_OP_UPLOAD, 1, get_ntime() - t1);
+		if(d->err){
+			break;
+		}
+		link_block(s, crc0 == check.r);
+		if(crc0 == check.r){
+			dev_printf(d, "CRC match, 0x%08x == 0x%08x\n", crc0, check.r);
+			break;
+		}
+		dev_printf(d, "CRC mismatch, 0x%08x != 0x%08x\n", crc0, check.r);
+		METRIC_INC(M_CRC_MISMATCH_UPLOAD);
+		METRIC_INC(M_RETRY_UPLOAD);
+	}
+	while(!d->err){
+		t1 = get_ntime();
+		if(df_batch(s, w, n, n == 1 ? "programming" : "erasing and programming")){
+			break;
+		}
+		// an erase and program again is neither op alone, it stays out of the costs
+		if(n == 1){
+			plan_time(p, PLAN_OP_PROGRAM, 1, get_ntime() - t1);
+		}
+		if(n == 2 && write[0].r != 0x80){
+			METRIC_INC(M_ERASE_FAIL);
+			METRIC_INC(M_RETRY_ERASE);
+			continue;
+		}
+		if(write[1].r != 0x80){
+			METRIC_INC(M_PROGRAM_FAIL);
+			METRIC_INC(M_RETRY_PROGRAM);
+			w = write;
+			n = 2;
+			continue;
+		}
+		break;
+	}
+	TRACE_END_ARG(t0, "flash_block", "block", i);
+	METRIC_INC(M_BLOCKS_FLASHED);
+	metric_observe(H_FLASH_BLOCK, get_ntime() - t0);
+	return dev_err(s);
+}
+
+// start is ~0 to take it from the journal, jl can be NULL
+// filename is what the cache points the blocks at, NULL if none
+static int flash_image(struct ucagb *s, const struct ucagb_image *img, u32 start, struct journal *jl, const char *filename){
+	tDev d = s->d;
+	struct cache c;
+	struct plan p;
+	u32 r, i, total, done;
+	int e = UCAGB_OK;
+
+	set_wait(d, s->wait_p0, 0);
+	df_proto(s);
+
+	r = df_worker(d, DF_CMD_ID,
+		NULL, "waiting for Flash ID", "Flash ID returned");
+	if (r != 0x00890018){
+		dev_printf(d, "sorry, unsupported flash\n");
+		return dev_err(s) ? dev_err(s) : UCAGB_E_FLASH;
+	}
+
+	flash_cache(s, &c, r);
+
+	r = df_worker(d, DF_CMD_UNLOCK,
+		NULL, "waiting for clearing Block-Lock Bits", "done");
+	if(r != 0x80){
+		return dev_err(s) ? dev_err(s) : UCAGB_E_FLASH;
+	}
+
+	total = img->blocks;
+	dev_printf(d, "ROM CRC32 0x%08x, %d blocks\n", img->crc_rom, total);
+
+	if(jl && start == ~0u){
+		start = journal_resume(jl);
+		// the flash ID is the same on every such cart, the last block done
+		// has to be on this one, it is only checked if it is
+		if(start){
+			dev_printf(d, "journal: %d / %d blocks done, checking block %d\n", start, total, start);
+			e = ucagb_flash_block(s, ucagb_image_block(img, start - 1), img->crc[start - 1], start - 1);
+			if(e < 0){
+				return e;
+			}
+			if(!e){
+				dev_printf(d, "journal: not this cart, starting over\n");
+				journal_reset(jl);
+				start = 0;
+			}
+		}
+	}
+	if (start >= total){
+		start = 0;
+	}
+	for(i = 0; i < start; ++i){
+		cache_set(&c, i, img->crc[i]);
+	}
+
+	plan_init(&p, total, s->rate.key);
+	e = flash_survey(s, &p, img, &c, start);
+	done = start;
+	if(e == UCAGB_OK){
+		dev_printf(d, "plan: %d same, %d erase only, %d program only, %d erase and program, predicted %.2fs\n",
+			p.count[PLAN_SAME], p.count[PLAN_ERASE], p.count[PLAN_PROGRAM], p.count[PLAN_WRITE],
+			(plan_predict(&p, PLAN_OPS) - plan_predict(&p, PLAN_OP_SURVEY)) / 1e9);
+		for(i = start; i < total; ++i){
+			if(p.cls[i] == PLAN_SAME){
+				if(jl){
+					journal_block(jl, i, img->crc[i]);
+				}
+				progress(s, "flash", ++done, total);
+			}
+		}
+		e = flash_erase(s, &p, img, &c, jl, &done);
+	}
+	// every block left is blank now
+	for(i = start; i < total && e == UCAGB_OK; ++i){
+		if(p.cls[i] != PLAN_PROGRAM && p.cls[i] != PLAN_WRITE){
+			continue;
+		}
+		dev_printf(d, " === %d / %d ===\n", i + 1, total);
+		// it may be left half written
+		cache_unset(&c, i);
+		e = flash_program(s, &p, ucagb_image_block(img, i), img->crc[i], i);
+		if(e < 0){
+			break;
+		}
+		cache_set(&c, i, img->crc[i]);
+		if(jl){
+			journal_block(jl, i, img->crc[i]);
+		}
+		progress(s, "flash", ++done, total);
+	}
+	plan_report(&p, d);
+	plan_save(&p);
+	plan_free(&p);
+	if(e == UCAGB_OK && filename){
+		cache_file(&c, filename);
+	}
+	cache_save(&c);
+
+	// TODO: lock blocks
+	return e;
+}
+
+int ucagb_flash(struct ucagb *s, const struct ucagb_image *img, u32 start){
+	return flash_image(s, img, start, NULL, NULL);
+}
+
+int ucagb_flash_file(struct ucagb *s, const char *filename, u32 start){
+	struct ucagb_image img;
+	struct journal jl;
+	int r = ucagb_image_load(&img, filename);
+	if(r){
+		return r;
+	}
+	journal_open(&jl, filename, "flash", img.size, img.crc_rom, 0x00890018);
+	r = flash_image(s, &img, start, &jl, filename);
+	journal_close(&jl, r == UCAGB_OK);
+	ucagb_image_free(&img);
+	return r;
+}
+
+// the blocks of an earlier dump or flash, read from its file one at a time
+// and only the ones DFAGB has the CRC32 the cache knows for
+struct local {
+	const struct cache *c;
+	struct zfile *z;
+	// the block the stream is at
+	u32 at;
+};
+
+// block i of the file to p, the ones before it are skipped, 0 if it is there
+static int local_read(struct local *l, u32 i, u8 *p){
+	if(!l->z || i < l->at){
+		return -1;
+	}
+	for(; l->at <= i; ++l->at){
+		if(zfile_read(l->z, p, AGB_BUF_SIZE) != AGB_BUF_SIZE){
+			zfile_close(l->z);
+			l->z = NULL;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// DFAGB reads block i of the cart, it is downloaded to p and checked
+// a mismatch is most likely the line, the block is still in DFAGB's buffer
+// so only its CRC and the download are repeated
+// with local the block is read from its file instead of downloaded if DFAGB
+// has the same CRC32, NULL downloads every block
+static int dump_block(struct ucagb *s, u32 i, u32 total, u8 *p, u32 *crc, struct local *local){
+	tDev d = s->d;
+	u32 crc0, crc1, tries = 0;
+	u64 t0 = get_ntime();
+	struct df_job j[] = {
+		{DF_CMD_DUMP, i * AGB_BUF_SIZE, AGB_BUF_SIZE, 0},
+		{DF_CMD_CRC32, 0, AGB_BUF_SIZE, 0},
+	};
+	dev_printf(d, " === %d / %d ===\n", i + 1, total);
+	df_batch(s, j, 2, "waiting for dump and DFAGB CRC32");
+	if(local && !d->err && cache_has(local->c, i, j[1].r) && !local_read(local, i, p)
+		&& ucagb_crc32(p, AGB_BUF_SIZE) == j[1].r){
+		dev_printf(d, "cached, 0x%08x\n", j[1].r);
+		*crc = j[1].r;
+		METRIC_INC(M_BLOCKS_CACHED);
+		progress(s, "dump", i + 1, total);
+		return UCAGB_OK;
+	}
+	while(1){
+		crc0 = j[1].r;
+		df_download(d, p, AGB_BUF_SIZE);
+		if(d->err){
+			return dev_err(s);
+		}
+		TRACE_BEGIN(t1);
+		crc1 = ucagb_crc32(p, AGB_BUF_SIZE);
+		TRACE_END(t1, "host_crc32");
+		// a slower wait gets its own DUMP_RETRIES
+		if(link_block(s, crc0 == crc1)){
+			tries = 0;
+		}
+		if(crc0 == crc1){
+			dev_printf(d, "CRC match, 0x%08x == 0x%08x\n", crc0, crc1);
+			break;
+		}
+		dev_printf(d, "CRC mismatch, 0x%08x != 0x%08x\n", crc0, crc1);
+		METRIC_INC(M_CRC_MISMATCH_DUMP);
+		if(tries++ == DUMP_RETRIES){
+			return UCAGB_E_CRC;
+		}
+		METRIC_INC(M_RETRY_DUMP);
+		// the CRC may have been the garbled one
+		df_batch(s, j + 1, 1, "waiting for DFAGB CRC32");
+	}
+	*crc = crc1;
+	TRACE_END_ARG(t0, "dump_block", "block", i);
+	METRIC_INC(M_BLOCKS_DUMPED);
+	metric_observe(H_DUMP_BLOCK, get_ntime() - t0);
+	progress(s, "dump", i + 1, total);
+	return UCAGB_OK;
+}
+
+int ucagb_dump(struct ucagb *s, u8 *buf, u32 size){
+	u32 i, total, crc, crc_all = 0;
+	int r;
+
+	if(!size || size % AGB_BUF_SIZE){
+		return UCAGB_E_PARAM;
+	}
+	total = size / AGB_BUF_SIZE;
+
+	set_wait(s->d, s->wait_p0, 0);
+	df_proto(s);
+
+	for(i = 0; i < total; ++ i){
+		// without a buffer the blocks are only checked
+		r = dump_block(s, i, total, buf ? buf + i * AGB_BUF_SIZE : s->buf, &crc, NULL);
+		if(r){
+			return r;
+		}
+		crc_all = crc32_combine(crc_all, crc, AGB_BUF_SIZE);
+	}
+	dev_printf(s->d, "dump CRC32 0x%08x\n", crc_all);
+
+	return UCAGB_OK;
+}
+
+// the blocks the journal has that are still in the file as they were
+// a compressed one is good up to its last flush
+static u32 dump_file_check(const char *filename, const struct journal *jl, u32 resume){
+	struct zfile *z = zfile_open(filename);
+	u8 *buf;
+	u32 i;
+	if(!z){
+		return 0;
+	}
+	buf = malloc(AGB_BUF_SIZE);
+	for(i = 0; i < resume; ++i){
+		if(zfile_read(z, buf, AGB_BUF_SIZE) != AGB_BUF_SIZE || ucagb_crc32(buf, AGB_BUF_SIZE) != jl->crc[i]){
+			break;
+		}
+	}
+	free(buf);
+	zfile_close(z);
+	return i;
+}
+
+int ucagb_dump_file(struct ucagb *s, const char *filename, u32 size){
+	struct file_writer *w;
+	struct journal jl;
+	struct cache c;
+	struct local local = {&c, NULL, 0};
+	char path[0x200];
+	u32 i, total, start, id, crc, crc_all = 0;
+	int r;
+
+	if(!size || size % AGB_BUF_SIZE){
+		return UCAGB_E_PARAM;
+	}
+	total = size / AGB_BUF_SIZE;
+
+	set_wait(s->d, s->wait_p0, 0);
+	df_proto(s);
+
+	id = df_worker(s->d, DF_CMD_ID, NULL, "waiting for Flash ID", "Flash ID returned");
+	// block 0 has the cart header, it tells a journal of another cart
+	r = dump_block(s, 0, total, s->buf, &crc, NULL);
+	if(r){
+		return r;
+	}
+	if(cache_load(&c, id, crc) && c.file[0]){
+		local.z = zfile_open(c.file);
+		if(local.z){
+			dev_printf(s->d, "cache: blocks of \"%s\" are taken where the cart has them\n", c.file);
+		}
+	}
+	cache_set(&c, 0, crc);
+	journal_open(&jl, filename, "dump", size, 0, crc);
+	// a block journaled but not on disk yet is found out here
+	start = dump_file_check(filename, &jl, journal_resume(&jl));
+	if(start > 1){
+		dev_printf(s->d, "journal: %d / %d blocks done\n", start, total);
+	}else{
+		start = 1;
+	}
+	// the file may be the one written here, written anew it would be cut off
+	// under the reader, so the name goes first and the reader keeps the old
+	// one, where that fails (Windows) its blocks are downloaded after all
+	if(local.z && start == 1 && !full_path(filename, path, sizeof(path)) && !strcmp(path, c.file)){
+		remove(filename);
+	}
+	w = file_writer_open(filename, AGB_BUF_SIZE, start == 1 ? 0 : start * (tSize)AGB_BUF_SIZE);
+	if(w == NULL){
+		if(local.z){
+			zfile_close(local.z);
+		}
+		journal_close(&jl, 0);
+		return UCAGB_E_FILE;
+	}
+	if(start == 1){
+		memcpy(file_writer_slot(w), s->buf, AGB_BUF_SIZE);
+		file_writer_push(w);
+		journal_block(&jl, 0, crc);
+	}
+	for(i = 0; i < start; ++i){
+		crc_all = crc32_combine(crc_all, jl.crc[i], AGB_BUF_SIZE);
+		cache_set(&c, i, jl.crc[i]);
+	}
+
+	// every block goes to disk once its CRC matched, while the next one comes in
+	for(i = start; i < total && r == UCAGB_OK; ++ i){
+		r = dump_block(s, i, total, file_writer_slot(w), &crc, &local);
+		if(r == UCAGB_OK){
+			file_writer_push(w);
+			journal_block(&jl, i, crc);
+			cache_set(&c, i, crc);
+			crc_all = crc32_combine(crc_all, crc, AGB_BUF_SIZE);
+		}
+	}
+	if(local.z){
+		zfile_close(local.z);
+	}
+	if(r == UCAGB_OK){
+		dev_printf(s->d, "dump CRC32 0x%08x\n", crc_all);
+	}
+
+	if(file_writer_close(w)){
+		dev_printf(s->d, "failed to write \"%s\"\n", filename);
+		journal_close(&jl, 0);
+		return r ? r : UCAGB_E_FILE;
+	}
+	journal_close(&jl, r == UCAGB_OK);
+	// what is in the file now, only a complete dump is worth pointing at
+	if(r == UCAGB_OK){
+		cache_file(&c, filename);
+	}
+	cache_save(&c);
+	return r;
+}
+
+static u32 parse_save_type(tDev d, const char *save_type, int is_write, u32 *p_cmd){
+	if(!strcmp(save_type, "sram256") || !strcmp(save_type, "sram32")){
+		*p_cmd = is_write ? DF_CMD_WRITE_SRAM : DF_CMD_READ_SRAM;
+		return 0x8000;
+	}else if(!strcmp(save_type, "sram512") || !strcmp(save_type, "sram64")){
+		*p_cmd = is_write ? DF_CMD_WRITE_SRAM : DF_CMD_READ_SRAM;
+		return 0x10000;
+	}else if(!strcmp(save_type, "eeprom4") || !strcmp(save_type, "eeprom0.5") || !strcmp(save_type, "eeprom512")){
+		*p_cmd = is_write ? DF_CMD_WRITE_EEPROM : DF_CMD_READ_EEPROM;
+		return 0x200;
+	}else if(!strcmp(save_type, "eeprom64") || !strcmp(save_type, "eeprom8")){
+		*p_cmd = is_write ? DF_CMD_WRITE_EEPROM : DF_CMD_READ_EEPROM;
+		return 0x2000;
+	}else if(!strcmp(save_type, "flash512") || !strcmp(save_type, "flash64")){
+		*p_cmd = is_write ? DF_CMD_WRITE_FLASH : DF_CMD_READ_FLASH;
+		return 0x10000;
+	}else if(!strcmp(save_type, "flash1024") || !strcmp(save_type, "flash1M") || !strcmp(save_type, "flash128")){
+		*p_cmd = is_write ? DF_CMD_WRITE_FLASH : DF_CMD_READ_FLASH;
+		return 0x20000;
+	}else{
+		dev_printf(d, "invalid save type: %s\n", save_type);
+		return 0;
+	}
+}
+
+u32 ucagb_save_size(const char *save_type){
+	u32 cmd;
+	return parse_save_type(NULL, save_type, 0, &cmd);
+}
+
+// write save to cart
+int ucagb_write_save(struct ucagb *s, const char *save_type, const u8 *buf){
+	tDev d = s->d;
+	u32 cmd, size, crc0, crc1;
+	size = parse_save_type(d, save_type, 1, &cmd);
+	if(size == 0){
+		return UCAGB_E_PARAM;
+	}
+	crc0 = ucagb_crc32(buf, size);
+
+	set_wait(d, s->wait_p0, 0);
+	df_proto(s);
+
+	df_upload(d, buf, size);
+	crc1 = df_worker(d, DF_CMD_CRC32 | size,
+		NULL, "waiting for DFAGB CRC32", "done");
+	if(d->err){
+		return dev_err(s);
+	}
+	link_block(s, crc0 == crc1);
+
+	if(crc0 == crc1){
+		dev_printf(d, "CRC match, 0x%08x == 0x%08x\n", crc0, crc1);
+	}else{
+		dev_printf(d, "CRC mismatch, 0x%08x != 0x%08x\n", crc0, crc1);
+		METRIC_INC(M_CRC_MISMATCH_SAVE_WRITE);
+		return UCAGB_E_CRC;
+	}
+
+	df_worker(d, cmd | size, NULL, "waiting for write save", "done");
+	progress(s, "write_save", 1, 1);
+
+	return dev_err(s);
+}
+
+// read save from cart
+int ucagb_read_save(struct ucagb *s, const char *save_type, u8 *buf){
+	tDev d = s->d;
+	u32 cmd, size, crc0, crc1;
+	struct df_job j[] = {{0, 0, 0, 0}, {DF_CMD_CRC32, 0, 0, 0}};
+	size = parse_save_type(d, save_type, 0, &cmd);
+	if(size == 0){
+		return UCAGB_E_PARAM;
+	}
+	j[0].cmd = cmd;
+	j[0].length = size;
+	j[1].length = size;
+
+	set_wait(d, s->wait_p0, 0);
+	if(df_batch(s, j, 2, "waiting for read save and DFAGB CRC32")){
+		return dev_err(s);
+	}
+	crc0 = j[1].r;
+	df_download(d, buf, size);
+	if(d->err){
+		return dev_err(s);
+	}
+	crc1 = ucagb_crc32(buf, size);
+	link_block(s, crc0 == crc1);
+	if(crc0 == crc1){
+		dev_printf(d, "CRC match, 0x%08x == 0x%08x\n", crc0, crc1);
+	}else{
+		dev_printf(d, "CRC mismatch, 0x%08x != 0x%08x\n", crc0, crc1);
+		METRIC_INC(M_CRC_MISMATCH_SAVE_READ);
+		return UCAGB_E_CRC;
+	}
+	progress(s, "read_save", 1, 1);
+
+	return UCAGB_OK;
+}
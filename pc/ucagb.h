@@ -0,0 +1,161 @@
+#ifndef ucagb_h__
+#define ucagb_h__
+
+/*
+libucagb
+===
+a session owns one uCSIO adapter: the serial port, the SIO wait used
+with DFAGB and a reusable 128KB buffer
+everything returns UCAGB_OK or one of the negative UCAGB_E_*,
+nothing exits, nothing writes files unless asked to
+
+a session must only be used by one thread at a time,
+different sessions can run on different threads
+log lines go to stderr unless ucagb_set_log is used
+*/
+#include "pl.h"
+#include "rate.h"
+
+#define UCAGB_OK		0
+#define UCAGB_E_OPEN		-1 // can't open the serial port
+#define UCAGB_E_PING		-2 // the uCSIO didn't answer the ping
+#define UCAGB_E_IO		-3 // serial port error, the session is dead
+#define UCAGB_E_TIMEOUT		-4 // a reply didn't come, the session is dead
+#define UCAGB_E_GBA		-5 // GBA not answering the multiboot handshake
+#define UCAGB_E_CRC		-6 // CRC32 mismatch between PC and DFAGB
+#define UCAGB_E_FLASH		-7 // unsupported flash cart or unlock failed
+#define UCAGB_E_PARAM		-8 // invalid parameter, like an unknown save type
+#define UCAGB_E_FILE		-9 // can't read or write a file
+
+// called after every 128KB block and at the end of an operation
+typedef void (*ucagb_progress)(void *user, const char *op, u32 done, u32 total);
+typedef void (*ucagb_log)(void *user, const char *line);
+
+// what the adapter answered to CMD_CAPS, see common.h
+// version 0 is a uCSIO from before it, nothing but the fixed BULK_SIZE bulks
+struct ucagb_caps {
+	u32 version, mcu, board;
+	// CDC endpoint sizes in bytes, 0 if unknown
+	u32 ep_in, ep_out;
+	u32 bulk_max, ram, features;
+};
+
+struct ucagb {
+	tDev d;
+	// SIO wait used while talking to DFAGB, multiboot always uses 0
+	// follows rate unless ucagb_set_wait pinned it
+	u8 wait_p0;
+	struct rate rate;
+	// d->garbled as of the last block
+	u32 garbled;
+	// AGB_BUF_SIZE, for whatever a single operation needs
+	u8 *buf;
+	ucagb_progress progress;
+	void *progress_user;
+	// multiboot even if the same DFAGB build is already running
+	u8 cold;
+	// DFAGB protocol, 0 until asked, 1 single word commands, 2 v2 frames
+	// UCAGB_PROTO=1 in the environment keeps v1
+	u8 proto;
+	// sequence number of the last v2 command
+	u8 seq;
+	struct ucagb_caps caps;
+	// CRC mismatches ucagb_flash_block gives up after with UCAGB_E_CRC,
+	// 0 retries for as long as it takes, the fault sweep sets it
+	u32 upload_tries;
+};
+
+// a ROM in whole blocks, with the CRC32 of every block
+// only read by ucagb_flash, so it can be shared by any number of sessions
+struct ucagb_image {
+	// mapped from the file or handed to ucagb_image_init
+	const u8 *data;
+	// padded to whole blocks
+	tSize size;
+	u32 blocks, *crc;
+	// CRC32 of the ROM as it is, without the padding
+	u32 crc_rom;
+	// the last block padded with 0, if the ROM doesn't end on a block
+	u8 *tail;
+	u8 *owned;
+	struct map map;
+};
+
+// once, before anything else
+void ucagb_init(void);
+const char *ucagb_strerror(int err);
+u32 ucagb_crc32(const void *buf, u32 size);
+
+// name prefixes the log lines, it can be NULL
+// the bulk transfers are sized from the CMD_CAPS reply, UCAGB_BULK in the
+// environment caps the words per CMD_XFERN, 0 keeps the BULK_SIZE bulks
+int ucagb_open(struct ucagb **ps, const char *devname, const char *name);
+// s can be NULL
+void ucagb_close(struct ucagb *s);
+void ucagb_set_progress(struct ucagb *s, ucagb_progress f, void *user);
+void ucagb_set_log(struct ucagb *s, ucagb_log f, void *user);
+// pins the wait, the rate control is off for the rest of the session
+void ucagb_set_wait(struct ucagb *s, u8 wait_p0);
+// after UCAGB_E_TIMEOUT, gets the uCSIO and DFAGB back in step with the host
+// UCAGB_OK if both answer again, the operation itself has to be started over
+int ucagb_resync(struct ucagb *s);
+
+// rom is copied, it gets encrypted on the way
+// the DFAGB protocol is asked again afterwards
+// nothing is sent if rom is a DFAGB and that very build is running, see DF_CMD_BUILD
+int ucagb_multiboot(struct ucagb *s, const u8 *rom, tSize size);
+// size in bytes, a multiple of 128KB, buf can be NULL to only check the CRCs
+// a block failing its CRC is downloaded again a few times
+int ucagb_dump(struct ucagb *s, u8 *buf, u32 size);
+// the same, each block is written to the file as soon as it is checked
+// so a failed dump keeps every good block before it, and the same dump run
+// again goes on after them, see journal.h
+// blocks the cart cache has a file for aren't downloaded, see cache.h
+int ucagb_dump_file(struct ucagb *s, const char *filename, u32 size);
+// start is the first block, 0 based
+// blocks the cart cache knows it has already aren't uploaded, see cache.h
+// the rest are surveyed and only erased and programmed as needed, the time
+// it takes is predicted and reported, see plan.h
+int ucagb_flash(struct ucagb *s, const struct ucagb_image *img, u32 start);
+// the same with the ROM file, start ~0 goes on after the last block the
+// journal of an interrupted flash of that file has
+int ucagb_flash_file(struct ucagb *s, const char *filename, u32 start);
+// upload, verify, erase and program a single block, crc is its CRC32
+// returns 1 if the block was identical and skipped
+int ucagb_flash_block(struct ucagb *s, const u8 *block, u32 crc, u32 i);
+// like "sram256" or "eeprom64", 0 if the type is unknown
+u32 ucagb_save_size(const char *save_type);
+// buf must hold ucagb_save_size bytes
+int ucagb_read_save(struct ucagb *s, const char *save_type, u8 *buf);
+int ucagb_write_save(struct ucagb *s, const char *save_type, const u8 *buf);
+// rom can be NULL to skip the multiboot
+// returns the number of regressions against the baseline if everything else went well
+int ucagb_bench(struct ucagb *s, const char *out, const char *baseline, const u8 *rom, tSize rom_size);
+// uploads and dumps at every bit flip rate, see fault.h, emulator only
+int ucagb_fault_sweep(struct ucagb *s, const char *out, const double *rates, uint n);
+void ucagb_reset_to_bootloader(struct ucagb *s);
+// the uCSIO serial speed test and the DFAGB upload/download test
+int ucagb_serial_bench(struct ucagb *s, int mode, int length);
+int ucagb_df_test(struct ucagb *s, unsigned seed);
+
+// data is taken over, the image frees it
+int ucagb_image_init(struct ucagb_image *img, u8 *data, tSize size);
+// the file is mapped, not read
+int ucagb_image_load(struct ucagb_image *img, const char *filename);
+// AGB_BUF_SIZE bytes of block i
+const u8 *ucagb_image_block(const struct ucagb_image *img, u32 i);
+void ucagb_image_free(struct ucagb_image *img);
+
+// whole file, padded with 0 to a multiple of a
+// gzip and zstd files are decompressed on the way in, .gz and .zst names
+// compressed on the way out, see zfile.h
+u8 *ucagb_load_file(const char *filename, tSize *psize, tSize a);
+int ucagb_save_file(const char *filename, const void *buf, tSize size);
+
+// DFAGB protocol, for the bench and other tools
+void set_wait(tDev d, u8 wait_p0, u8 wait_p1);
+void df_wait(tDev d, const char *msg, int posted);
+void df_upload(tDev d, const void * buf, u32 size);
+void df_download(tDev d, void *buf, u32 size);
+u32 df_worker(tDev d, u32 cmd, const char *msg0, const char *msg1, const char *msg2);
+#endif
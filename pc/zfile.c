@@ -0,0 +1,492 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+// crc.h has its own crc32_combine
+#define crc32 zlib_crc32
+#define crc32_combine zlib_crc32_combine
+#include <zlib.h>
+#undef crc32
+#undef crc32_combine
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "pl.h"
+#include "crc.h"
+#include "zfile.h"
+
+static const char *codec_name[] = {"plain", "gzip", "zstd"};
+
+int zfile_magic(const u8 *p, tSize n){
+	if(n >= 2 && p[0] == 0x1f && p[1] == 0x8b){
+		return ZF_GZIP;
+	}
+	if(n >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd){
+		return ZF_ZSTD;
+	}
+	return ZF_PLAIN;
+}
+
+int zfile_codec(const char *filename){
+	size_t n = strlen(filename);
+	if(n > 3 && !strcmp(filename + n - 3, ".gz")){
+		return ZF_GZIP;
+	}
+	if(n > 4 && !strcmp(filename + n - 4, ".zst")){
+		return ZF_ZSTD;
+	}
+	return ZF_PLAIN;
+}
+
+#ifdef HAVE_ZLIB
+// zlib only does raw deflate here, the gzip header and trailer are ours,
+// once linked with common/crc32.c its gzip code would call that crc32()
+static const u8 gz_head[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+
+static int gz_init(struct zfile *z){
+	z_stream *s = calloc(1, sizeof(z_stream));
+	z->z = s;
+	if(z->write){
+		return deflateInit2(s, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK
+			|| fwrite(gz_head, sizeof(gz_head), 1, z->f) != 1;
+	}
+	return inflateInit2(s, -15) != Z_OK;
+}
+
+static int gz_byte(struct zfile *z){
+	z_stream *s = z->z;
+	if(!s->avail_in){
+		s->next_in = z->buf;
+		s->avail_in = fread(z->buf, 1, ZFILE_BUF, z->f);
+		if(!s->avail_in){
+			return -1;
+		}
+	}
+	--s->avail_in;
+	return *s->next_in++;
+}
+
+// a member header, 1 if the file ended before one, -1 if it's broken
+static int gz_member(struct zfile *z){
+	z_stream *s = z->z;
+	int c, flg, n;
+	if((c = gz_byte(z)) < 0){
+		return 1;
+	}
+	if(c != 0x1f || gz_byte(z) != 0x8b || gz_byte(z) != 8){
+		return -1;
+	}
+	flg = gz_byte(z);
+	// mtime, xfl, os
+	for(n = 0; n < 6; ++n){
+		gz_byte(z);
+	}
+	if(flg & 4){
+		n = gz_byte(z);
+		n |= gz_byte(z) << 8;
+		while(n-- > 0){
+			gz_byte(z);
+		}
+	}
+	if(flg & 8){
+		while(gz_byte(z) > 0);
+	}
+	if(flg & 16){
+		while(gz_byte(z) > 0);
+	}
+	if(flg & 2){
+		gz_byte(z);
+		gz_byte(z);
+	}
+	// anything cut short ran into the end of the file, there is no deflate data then
+	if(flg < 0 || (!s->avail_in && feof(z->f))){
+		return -1;
+	}
+	inflateReset(s);
+	z->crc = 0;
+	z->size = 0;
+	return 0;
+}
+
+static u32 gz_u32(struct zfile *z){
+	u32 r = 0;
+	int i, c;
+	for(i = 0; i < 32; i += 8){
+		if((c = gz_byte(z)) < 0){
+			z->err = 1;
+		}
+		r |= (u32)(c & 0xff) << i;
+	}
+	return r;
+}
+
+static tSize gz_read(struct zfile *z, u8 *p, tSize n){
+	z_stream *s = z->z;
+	u8 *o;
+	int r;
+	s->next_out = p;
+	s->avail_out = n;
+	while(s->avail_out && !z->end && !z->err){
+		// gzip files may be several members one after another
+		if(!z->frame){
+			r = gz_member(z);
+			z->end = r > 0;
+			z->err = r < 0;
+			z->frame = !r;
+			continue;
+		}
+		if(!s->avail_in){
+			s->next_in = z->buf;
+			s->avail_in = fread(z->buf, 1, ZFILE_BUF, z->f);
+			if(!s->avail_in){
+				// the file ended before the stream did
+				z->err = 1;
+				break;
+			}
+		}
+		o = s->next_out;
+		r = inflate(s, Z_NO_FLUSH);
+		z->crc = crc32_update(z->crc, o, s->next_out - o);
+		z->size += s->next_out - o;
+		if(r == Z_STREAM_END){
+			if(gz_u32(z) != z->crc || gz_u32(z) != z->size){
+				z->err = 1;
+			}
+			z->frame = 0;
+		}else if(r != Z_OK){
+			z->err = 1;
+		}
+	}
+	return n - s->avail_out;
+}
+
+static int gz_deflate(struct zfile *z, int flush){
+	z_stream *s = z->z;
+	tSize n;
+	do{
+		s->next_out = z->buf;
+		s->avail_out = ZFILE_BUF;
+		if(deflate(s, flush) == Z_STREAM_ERROR){
+			return -1;
+		}
+		n = ZFILE_BUF - s->avail_out;
+		if(n && fwrite(z->buf, n, 1, z->f) != 1){
+			return -1;
+		}
+	}while(!s->avail_out);
+	return 0;
+}
+
+static int gz_write(struct zfile *z, const u8 *p, tSize n){
+	z_stream *s = z->z;
+	z->crc = crc32_update(z->crc, p, n);
+	z->size += n;
+	s->next_in = (u8*)p;
+	s->avail_in = n;
+	return gz_deflate(z, Z_NO_FLUSH);
+}
+
+static int gz_end(struct zfile *z){
+	u8 t[8];
+	int i, r = 0;
+	if(z->write){
+		for(i = 0; i < 4; ++i){
+			t[i] = z->crc >> (i * 8);
+			t[4 + i] = z->size >> (i * 8);
+		}
+		r = gz_deflate(z, Z_FINISH) || fwrite(t, sizeof(t), 1, z->f) != 1;
+		deflateEnd(z->z);
+	}else{
+		inflateEnd(z->z);
+	}
+	return r;
+}
+
+// ISIZE, the last 4 bytes, the size mod 4G of the last member
+static tSize gz_size(struct zfile *z){
+	u8 b[4];
+	if(fseek(z->f, -4, SEEK_END) || fread(b, 4, 1, z->f) != 1){
+		return 0;
+	}
+	return b[0] | b[1] << 8 | b[2] << 16 | (tSize)b[3] << 24;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int zs_init(struct zfile *z){
+	if(z->write){
+		z->z = ZSTD_createCStream();
+		return !z->z;
+	}
+	z->z = ZSTD_createDStream();
+	if(z->z && ZSTD_isError(ZSTD_initDStream(z->z))){
+		ZSTD_freeDStream(z->z);
+		z->z = NULL;
+	}
+	return !z->z;
+}
+
+static tSize zs_read(struct zfile *z, u8 *p, tSize n){
+	ZSTD_outBuffer out = {p, n, 0};
+	ZSTD_inBuffer in;
+	size_t r;
+	while(out.pos < out.size && !z->end && !z->err){
+		if(z->pos == z->len){
+			z->pos = 0;
+			z->len = fread(z->buf, 1, ZFILE_BUF, z->f);
+			if(!z->len){
+				// frames follow each other, the file may only end between them
+				z->end = !z->frame;
+				z->err = z->frame;
+				break;
+			}
+		}
+		in.src = z->buf;
+		in.size = z->len;
+		in.pos = z->pos;
+		r = ZSTD_decompressStream(z->z, &out, &in);
+		z->pos = in.pos;
+		if(ZSTD_isError(r)){
+			z->err = 1;
+		}
+		z->frame = r != 0;
+	}
+	return out.pos;
+}
+
+static int zs_compress(struct zfile *z, const u8 *p, tSize n, ZSTD_EndDirective e){
+	ZSTD_inBuffer in = {p, n, 0};
+	ZSTD_outBuffer out;
+	size_t r;
+	do{
+		out.dst = z->buf;
+		out.size = ZFILE_BUF;
+		out.pos = 0;
+		r = ZSTD_compressStream2(z->z, &out, &in, e);
+		if(ZSTD_isError(r)){
+			return -1;
+		}
+		if(out.pos && fwrite(z->buf, out.pos, 1, z->f) != 1){
+			return -1;
+		}
+	// continue is done once the input is taken, flush and end once r says so
+	}while(e == ZSTD_e_continue ? in.pos < in.size : r != 0);
+	return 0;
+}
+
+static int zs_end(struct zfile *z){
+	int r = 0;
+	if(z->write){
+		r = zs_compress(z, NULL, 0, ZSTD_e_end);
+		ZSTD_freeCStream(z->z);
+	}else{
+		ZSTD_freeDStream(z->z);
+	}
+	return r;
+}
+
+// only if the one who wrote it knew it in advance
+static tSize zs_size(struct zfile *z){
+	u8 b[18];
+	size_t n = fread(b, 1, sizeof(b), z->f);
+	unsigned long long r = ZSTD_getFrameContentSize(b, n);
+	return r >= 0xffffffffu ? 0 : (tSize)r;
+}
+#endif
+
+static int codec_init(struct zfile *z){
+	z->buf = malloc(ZFILE_BUF);
+	switch(z->codec){
+#ifdef HAVE_ZLIB
+	case ZF_GZIP:
+		return gz_init(z);
+#endif
+#ifdef HAVE_ZSTD
+	case ZF_ZSTD:
+		return zs_init(z);
+#endif
+	case ZF_PLAIN:
+		return 0;
+	}
+	return -1;
+}
+
+static void zfile_free(struct zfile *z){
+	if(z->f){
+		fclose(z->f);
+	}
+	free(z->buf);
+	free(z->z);
+	free(z);
+}
+
+static struct zfile *zfile_new(FILE *f, int codec, int write, const char *filename){
+	struct zfile *z = calloc(1, sizeof(struct zfile));
+	z->f = f;
+	z->codec = codec;
+	z->write = write;
+	if(codec_init(z)){
+		fprintf(stderr, "\"%s\" is %s, this build can't %s it\n",
+			filename, codec_name[codec], write ? "compress" : "decompress");
+		// nothing was set up to be ended
+		z->codec = ZF_PLAIN;
+		zfile_free(z);
+		return NULL;
+	}
+	return z;
+}
+
+struct zfile *zfile_open(const char *filename){
+	u8 m[4];
+	size_t n;
+	FILE *f = fopen(filename, "rb");
+	if(!f){
+		return NULL;
+	}
+	n = fread(m, 1, sizeof(m), f);
+	rewind(f);
+	return zfile_new(f, zfile_magic(m, n), 0, filename);
+}
+
+struct zfile *zfile_create(const char *filename, tSize offset){
+	int codec = zfile_codec(filename);
+	struct zfile *z;
+	u8 *keep = NULL;
+	FILE *f;
+	if(codec == ZF_PLAIN){
+		f = fopen(filename, offset ? "r+b" : "wb");
+		if(!f || (offset && fseek(f, (long)offset, SEEK_SET))){
+			if(f){
+				fclose(f);
+			}
+			return NULL;
+		}
+		return zfile_new(f, codec, 1, filename);
+	}
+	// there is no appending to the middle of a stream, it is read back first
+	if(offset){
+		keep = malloc(offset);
+		z = zfile_open(filename);
+		if(!z || zfile_read(z, keep, offset) != offset){
+			if(z){
+				zfile_close(z);
+			}
+			free(keep);
+			return NULL;
+		}
+		zfile_close(z);
+	}
+	f = fopen(filename, "wb");
+	z = f ? zfile_new(f, codec, 1, filename) : NULL;
+	if(z && keep && zfile_write(z, keep, offset)){
+		zfile_close(z);
+		z = NULL;
+	}
+	free(keep);
+	return z;
+}
+
+tSize zfile_size(struct zfile *z){
+	tSize n = 0;
+	long at = ftell(z->f);
+	switch(z->codec){
+	case ZF_PLAIN:
+		if(!fseek(z->f, 0, SEEK_END)){
+			n = ftell(z->f);
+		}
+		break;
+#ifdef HAVE_ZLIB
+	case ZF_GZIP:
+		n = gz_size(z);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case ZF_ZSTD:
+		n = zs_size(z);
+		break;
+#endif
+	}
+	fseek(z->f, at, SEEK_SET);
+	return n;
+}
+
+tSize zfile_read(struct zfile *z, void *p, tSize n){
+	switch(z->codec){
+#ifdef HAVE_ZLIB
+	case ZF_GZIP:
+		return gz_read(z, p, n);
+#endif
+#ifdef HAVE_ZSTD
+	case ZF_ZSTD:
+		return zs_read(z, p, n);
+#endif
+	}
+	n = fread(p, 1, n, z->f);
+	z->err = ferror(z->f);
+	return n;
+}
+
+int zfile_write(struct zfile *z, const void *p, tSize n){
+	int r = -1;
+	switch(z->codec){
+	case ZF_PLAIN:
+		r = fwrite(p, n, 1, z->f) != 1;
+		break;
+#ifdef HAVE_ZLIB
+	case ZF_GZIP:
+		r = gz_write(z, p, n);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case ZF_ZSTD:
+		r = zs_compress(z, p, n, ZSTD_e_continue);
+		break;
+#endif
+	}
+	z->err |= r;
+	return r;
+}
+
+int zfile_flush(struct zfile *z){
+	int r = 0;
+	switch(z->codec){
+#ifdef HAVE_ZLIB
+	case ZF_GZIP:
+		r = gz_deflate(z, Z_SYNC_FLUSH);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case ZF_ZSTD:
+		r = zs_compress(z, NULL, 0, ZSTD_e_flush);
+		break;
+#endif
+	}
+	r |= fflush(z->f);
+	z->err |= r;
+	return r;
+}
+
+int zfile_close(struct zfile *z){
+	int r = z->write ? z->err : 0;
+	switch(z->codec){
+#ifdef HAVE_ZLIB
+	case ZF_GZIP:
+		r |= gz_end(z);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case ZF_ZSTD:
+		r |= zs_end(z);
+		// the stream is the library's to free
+		z->z = NULL;
+		break;
+#endif
+	}
+	r |= fclose(z->f);
+	z->f = NULL;
+	zfile_free(z);
+	return r;
+}
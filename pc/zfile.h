@@ -0,0 +1,54 @@
+#ifndef zfile_h__
+#define zfile_h__
+
+#include <stdio.h>
+
+#include "pl.h"
+
+/*
+compressed files
+===
+ROMs, dumps and saves can be gzip or zstd compressed, they are streamed
+through zlib and libzstd a buffer at a time, without a temp file
+a file is read by its magic, whatever its name, and written by its name,
+.gz and .zst are compressed, anything else is written as it is
+gzip needs HAVE_ZLIB and -lz, zstd HAVE_ZSTD and -lzstd, zflags.sh has
+them for the headers that are installed, a file that needs one that
+isn't built in is refused
+*/
+enum {ZF_PLAIN, ZF_GZIP, ZF_ZSTD};
+#define ZFILE_BUF 0x10000
+
+struct zfile {
+	FILE *f;
+	u8 codec, write;
+	// the stream ended, or is in the middle of a gzip member or zstd frame
+	u8 end, frame;
+	// CRC32 and size of the gzip member so far, for its trailer
+	u32 crc, size;
+	// a broken or cut short stream, or a failed write
+	int err;
+	// z_stream or ZSTD_DStream/ZSTD_CStream, buf is the compressed side
+	void *z;
+	u8 *buf;
+	tSize len, pos;
+};
+
+// what the first bytes of a file say it is
+int zfile_magic(const u8 *p, tSize n);
+// what a file of that name is written as
+int zfile_codec(const char *filename);
+struct zfile *zfile_open(const char *filename);
+// offset 0 starts a new file, anything else keeps the first offset bytes of
+// an existing one and goes on after them, a compressed one is written anew
+struct zfile *zfile_create(const char *filename, tSize offset);
+// the uncompressed size if the file tells, 0 otherwise, call before reading
+tSize zfile_size(struct zfile *z);
+// like fread, short at the end, err tells a stream that was cut short
+tSize zfile_read(struct zfile *z, void *p, tSize n);
+int zfile_write(struct zfile *z, const void *p, tSize n);
+// what was written so far can be read back, even if we die next
+int zfile_flush(struct zfile *z);
+// ends the stream, non 0 if anything failed
+int zfile_close(struct zfile *z);
+#endif
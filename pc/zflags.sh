@@ -0,0 +1,9 @@
+#!/bin/sh
+# compiler and linker flags for the compressed files of zfile.c, for the
+# libraries whose headers are installed, nothing if there are none
+for l in "zlib.h ZLIB z" "zstd.h ZSTD zstd"; do
+	set -- $l
+	if echo "#include <$1>" | ${CC:-cc} -E - >/dev/null 2>&1; then
+		printf ' -DHAVE_%s -l%s' $2 $3
+	fi
+done
@@ -0,0 +1,3 @@
+#!/bin/sh
+# SIO transcript replay, Linux/POSIX only
+${CC:-cc} -O2 -pthread -o replay replay.c $(ls ../pc/*.c | grep -v main.c) ../common/crc32.c $(sh ../pc/zflags.sh)
@@ -0,0 +1,617 @@
+/*
+SIO transcript replay
+===
+	usbagb --transcript session.uct <port> <command> ...
+records a session, see pc/transcript.h, then
+	./replay report session.uct
+where the wall clock time went: host time between serial calls,
+time handing bytes to write_serial, time blocked in read_serial waiting
+for each kind of uCSIO command, read timeouts and the slowest reads
+	./replay dump session.uct [dev]
+every record as text, the DFAGB words of single transfers decoded
+	./replay serve session.uct [-L path] [-D dev] [-f]
+a device stand-in on a pty, usbagb is run against it with the same command
+the host bytes are checked against the recorded ones, the first difference
+stops it, the recorded replies go back with the recorded latency, so the
+host sees the same bytes at the same times, timeouts included
+	./replay play session.uct <port> [-D dev] [-f]
+a host stand-in, the recorded host bytes go to a device (the emulator, or
+an adapter when the session only read) keeping the recorded host time
+between calls, the time per kind of command is compared with the original
+DFAGB worker polls are not adapted, only play what the device can take
+
+-f drops the timing and goes as fast as the other side allows
+Linux/POSIX
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+
+#include "../common/common.h"
+#include "../pc/pl.h"
+#include "../pc/transcript.h"
+
+#define MAX_CLASSES 0x40
+#define REPLY_FIFO 0x400
+#define SLOWEST 5
+
+struct rec {
+	u8 type, dev;
+	// ns since the transcript started
+	u64 t, dur;
+	tSize req, n;
+	const u8 *data;
+};
+
+static struct rec *recs;
+static uint n_recs;
+
+// time per kind of command, the columns are the original and a replay
+struct cls {
+	const char *name;
+	u32 count;
+	u64 bytes, ns[2];
+};
+static struct cls classes[MAX_CLASSES];
+static uint n_classes;
+
+static int get_varint(const u8 **p, const u8 *e, u64 *v){
+	uint shift = 0;
+	*v = 0;
+	while(*p < e && shift < 64){
+		*v |= (u64)(**p & 0x7f) << shift;
+		if(!(*(*p)++ & 0x80)){
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
+
+static int load(struct map *m, const char *filename){
+	const u8 *p, *e;
+	u64 dt, dur, req, n, t = 0;
+	uint cap = 0;
+	if(map_file(m, filename)){
+		fprintf(stderr, "failed to open \"%s\" for read\n", filename);
+		return -1;
+	}
+	if(m->size < TRANSCRIPT_MAGIC_LEN || memcmp(m->data, TRANSCRIPT_MAGIC, TRANSCRIPT_MAGIC_LEN)){
+		fprintf(stderr, "%s is not a transcript\n", filename);
+		return -1;
+	}
+	p = m->data + TRANSCRIPT_MAGIC_LEN;
+	e = m->data + m->size;
+	while(p + 2 <= e){
+		if(n_recs == cap){
+			cap = cap ? cap * 2 : 0x1000;
+			recs = realloc(recs, cap * sizeof(struct rec));
+		}
+		recs[n_recs].type = p[0];
+		recs[n_recs].dev = p[1];
+		p += 2;
+		if(get_varint(&p, e, &dt) || get_varint(&p, e, &dur)
+			|| get_varint(&p, e, &req) || get_varint(&p, e, &n) || n > (u64)(e - p)){
+			// a transcript cut short, keep what is whole
+			fprintf(stderr, "truncated after %u records\n", n_recs);
+			break;
+		}
+		t += dt & 1 ? ~(dt >> 1) : dt >> 1;
+		recs[n_recs].t = t;
+		recs[n_recs].dur = dur;
+		recs[n_recs].req = (tSize)req;
+		recs[n_recs].n = (tSize)n;
+		recs[n_recs].data = p;
+		p += n;
+		++n_recs;
+	}
+	return 0;
+}
+
+/*
+host stream parser
+===
+a uCSIO command is a byte, then 4 or 32 bytes with CMD_FLAG_W,
+a reply of 4 or 32 bytes comes back for each one with CMD_FLAG_R
+writes split commands anywhere, so it goes byte by byte
+*/
+struct reply {
+	uint cls;
+	tSize left;
+};
+
+struct parser {
+	// count is set while the word count of a CMD_XFERN is still to come
+	u8 cmd, word[4], count;
+	tSize words, need, got;
+	struct reply fifo[REPLY_FIFO];
+	uint head, tail;
+};
+
+static uint cls_of(const char *name){
+	uint i;
+	for(i = 0; i < n_classes; ++i){
+		if(!strcmp(classes[i].name, name)){
+			return i;
+		}
+	}
+	if(n_classes == MAX_CLASSES){
+		return MAX_CLASSES - 1;
+	}
+	classes[n_classes].name = name;
+	return n_classes++;
+}
+
+static const char *df_name(u32 w){
+	static const struct { u32 cmd; const char *name; } df[] = {
+		{DF_CMD_UPLOAD, "xfer df upload"}, {DF_CMD_DOWNLOAD, "xfer df download"},
+		{DF_CMD_READ, "xfer df read"}, {DF_CMD_BUILD, "xfer df build"},
+		{DF_CMD_CRC32, "xfer df crc32"},
+		{DF_CMD_READ_SRAM, "xfer df read_sram"}, {DF_CMD_WRITE_SRAM, "xfer df write_sram"},
+		{DF_CMD_READ_FLASH, "xfer df read_flash"}, {DF_CMD_WRITE_FLASH, "xfer df write_flash"},
+		{DF_CMD_READ_EEPROM, "xfer df read_eeprom"}, {DF_CMD_WRITE_EEPROM, "xfer df write_eeprom"},
+		{DF_CMD_DUMP, "xfer df dump"}, {DF_CMD_VERIFY, "xfer df verify"},
+		{DF_CMD_ID, "xfer df id"}, {DF_CMD_UNLOCK, "xfer df unlock"},
+		{DF_CMD_ERASE, "xfer df erase"}, {DF_CMD_PROGRAM, "xfer df program"},
+		{DF_CMD_FRAME, "xfer df frame"}, {DF_CMD_RESULT, "xfer df result"},
+		{DF_CMD_PROTO, "xfer df proto"},
+	};
+	uint i;
+	if(w == DF_CMD_NOP){
+		return "xfer df nop";
+	}
+	for(i = 0; i < sizeof(df) / sizeof(df[0]); ++i){
+		if((w & DF_CMD_MASK) == df[i].cmd){
+			return df[i].name;
+		}
+	}
+	return "xfer word";
+}
+
+static const char *cmd_name(u8 cmd, const u8 *word){
+	u32 w;
+	switch(cmd & CMD_MASK){
+		case CMD_XFER:
+			if(cmd & CMD_FLAG_B){
+				return "xfer bulk";
+			}
+			if(!(cmd & CMD_FLAG_W)){
+				return "xfer read";
+			}
+			memcpy(&w, word, 4);
+			return df_name(w);
+		case CMD_PING: return "ping";
+		case CMD_BOOTLOADER: return "bootloader";
+		case CMD_COUNTER: return "counter";
+		case CMD_SET_WAIT: return "set_wait";
+		case CMD_CAPS: return "caps";
+		case CMD_XFERN: return "xfer bulk";
+	}
+	return "unknown";
+}
+
+static void command_done(struct parser *ps){
+	u8 cmd = ps->cmd;
+	uint c = cls_of(cmd_name(cmd, ps->word));
+	++classes[c].count;
+	classes[c].bytes += 1 + ps->need + ((cmd & CMD_MASK) == CMD_XFERN);
+	if((cmd & CMD_FLAG_R) && ps->head - ps->tail < REPLY_FIFO){
+		ps->fifo[ps->head % REPLY_FIFO].cls = c;
+		ps->fifo[ps->head % REPLY_FIFO].left = ps->words << 2;
+		++ps->head;
+	}
+	ps->need = 0;
+	ps->got = 0;
+	ps->cmd = 0;
+}
+
+static void parse_write(struct parser *ps, const u8 *p, tSize n){
+	tSize i;
+	for(i = 0; i < n; ++i){
+		if(!ps->cmd){
+			ps->cmd = p[i];
+			ps->got = 0;
+			ps->count = (p[i] & CMD_MASK) == CMD_XFERN;
+			if(ps->count){
+				continue;
+			}
+			ps->words = p[i] & CMD_FLAG_B ? BULK_SIZE : 1;
+			ps->need = p[i] & CMD_FLAG_W ? ps->words << 2 : 0;
+		}else if(ps->count){
+			ps->count = 0;
+			ps->words = p[i];
+			ps->need = ps->cmd & CMD_FLAG_W ? ps->words << 2 : 0;
+		}else{
+			if(ps->got < 4){
+				ps->word[ps->got] = p[i];
+			}
+			++ps->got;
+		}
+		if(ps->got == ps->need){
+			command_done(ps);
+		}
+	}
+}
+
+// the time of a read goes to the replies it took, by bytes
+// ns0 and ns1 are the original and the replay
+static void parse_read(struct parser *ps, tSize n, u64 ns0, u64 ns1){
+	tSize k;
+	struct reply *r;
+	while(n && ps->tail != ps->head){
+		r = &ps->fifo[ps->tail % REPLY_FIFO];
+		k = n < r->left ? n : r->left;
+		classes[r->cls].ns[0] += ns0 * k / n;
+		classes[r->cls].ns[1] += ns1 * k / n;
+		classes[r->cls].bytes += k;
+		ns0 -= ns0 * k / n;
+		ns1 -= ns1 * k / n;
+		n -= k;
+		r->left -= k;
+		if(!r->left){
+			++ps->tail;
+		}
+	}
+}
+
+// the command the next reply belongs to
+static const char *awaited(struct parser *ps){
+	return ps->tail != ps->head ? classes[ps->fifo[ps->tail % REPLY_FIFO].cls].name : "nothing";
+}
+
+static int cmp_cls(const void *a, const void *b){
+	const struct cls *x = a, *y = b;
+	return x->ns[0] < y->ns[0] ? 1 : x->ns[0] > y->ns[0] ? -1 : 0;
+}
+
+static void print_classes(int cols){
+	uint i;
+	qsort(classes, n_classes, sizeof(struct cls), cmp_cls);
+	printf("\n%-24s %10s %12s %14s%s\n", "waiting for", "commands", "bytes", "ms",
+		cols > 1 ? "      replay ms" : "");
+	for(i = 0; i < n_classes; ++i){
+		printf("%-24s %10u %12llu %14.3f", classes[i].name, classes[i].count,
+			classes[i].bytes, classes[i].ns[0] / 1e6);
+		if(cols > 1){
+			printf(" %14.3f", classes[i].ns[1] / 1e6);
+		}
+		printf("\n");
+	}
+}
+
+static void report(void){
+	static struct parser ps[0x100];
+	u64 t_write[0x100] = {0}, t_read[0x100] = {0}, t_first[0x100], t_last[0x100] = {0};
+	u64 span, host;
+	u32 reads[0x100] = {0}, slow[SLOWEST] = {0};
+	const char *slow_what[SLOWEST];
+	uint i, k, j, dev, devs = 0;
+	struct rec *r;
+
+	memset(t_first, 0xff, sizeof(t_first));
+	for(i = 0; i < n_recs; ++i){
+		r = &recs[i];
+		dev = r->dev;
+		if(r->type == TR_OPEN){
+			printf("dev %u: %.*s\n", dev, (int)r->n, r->data);
+			devs = dev + 1 > devs ? dev + 1 : devs;
+			continue;
+		}
+		if(t_first[dev] > r->t){
+			t_first[dev] = r->t;
+		}
+		if(t_last[dev] < r->t + r->dur){
+			t_last[dev] = r->t + r->dur;
+		}
+		if(r->type == TR_WRITE){
+			t_write[dev] += r->dur;
+			parse_write(&ps[dev], r->data, r->n);
+			continue;
+		}
+		t_read[dev] += r->dur;
+		++reads[dev];
+		if(r->n < r->req){
+			printf("record %u at %.6f s: read timeout, %u of %u bytes, waiting for %s\n",
+				i, r->t / 1e9, r->n, r->req, awaited(&ps[dev]));
+		}
+		// kept sorted, record 0 is always an open so 0 is a free slot
+		for(k = SLOWEST; k && (!slow[k - 1] || recs[slow[k - 1]].dur < r->dur); --k);
+		if(k < SLOWEST){
+			for(j = SLOWEST - 1; j > k; --j){
+				slow[j] = slow[j - 1];
+				slow_what[j] = slow_what[j - 1];
+			}
+			slow[k] = i;
+			slow_what[k] = awaited(&ps[dev]);
+		}
+		parse_read(&ps[dev], r->n, r->dur, 0);
+	}
+
+	for(dev = 0; dev < devs; ++dev){
+		if(t_last[dev] == 0){
+			continue;
+		}
+		span = t_last[dev] - t_first[dev];
+		host = span - t_write[dev] - t_read[dev];
+		printf("\ndev %u: %.3f s\n", dev, span / 1e9);
+		printf("\thost, sleeps included\t\t%12.3f ms %5.1f%%\n", host / 1e6, host * 100.0 / span);
+		printf("\twrite_serial\t\t\t%12.3f ms %5.1f%%\n", t_write[dev] / 1e6, t_write[dev] * 100.0 / span);
+		printf("\tread_serial, %8u reads\t%12.3f ms %5.1f%%\n", reads[dev],
+			t_read[dev] / 1e6, t_read[dev] * 100.0 / span);
+	}
+	print_classes(1);
+
+	printf("\nslowest reads\n");
+	for(k = 0; k < SLOWEST && slow[k]; ++k){
+		r = &recs[slow[k]];
+		printf("record %-8u dev %u at %10.6f s %12.3f ms  %u bytes, waiting for %s\n",
+			slow[k], r->dev, r->t / 1e9, r->dur / 1e6, r->n, slow_what[k]);
+	}
+}
+
+static void dump(int only){
+	static struct parser ps[0x100];
+	struct rec *r;
+	uint i, k;
+	u32 w;
+	for(i = 0; i < n_recs; ++i){
+		r = &recs[i];
+		if(only >= 0 && r->dev != only){
+			continue;
+		}
+		printf("%-8u %12.6f dev %u ", i, r->t / 1e9, r->dev);
+		if(r->type == TR_OPEN){
+			printf("open %.*s\n", (int)r->n, r->data);
+			continue;
+		}
+		printf("%s %u", r->type == TR_WRITE ? "write" : "read", r->n);
+		if(r->n < r->req){
+			printf(" of %u, timeout", r->req);
+		}
+		printf(" %.3f ms", r->dur / 1e6);
+		if(r->type == TR_READ){
+			printf(", %s", awaited(&ps[r->dev]));
+			parse_read(&ps[r->dev], r->n, r->dur, 0);
+		}else{
+			parse_write(&ps[r->dev], r->data, r->n);
+		}
+		// single words are where the DFAGB states are
+		if(r->n == 4 || (r->type == TR_WRITE && r->n == 5)){
+			memcpy(&w, r->data + r->n - 4, 4);
+			printf(" 0x%08x", w);
+		}else{
+			for(k = 0; k < r->n && k < 16; ++k){
+				printf(" %02x", r->data[k]);
+			}
+			if(k < r->n){
+				printf(" ...");
+			}
+		}
+		printf("\n");
+	}
+}
+
+static void sleep_until(u64 t){
+	u64 now = get_ntime();
+	if(t > now){
+		usleep((t - now) / 1000);
+	}
+}
+
+static int first_dev(int dev){
+	uint i;
+	for(i = 0; dev < 0 && i < n_recs; ++i){
+		if(recs[i].type == TR_OPEN){
+			dev = recs[i].dev;
+		}
+	}
+	return dev;
+}
+
+// reads exactly n bytes, -1 on EOF or after 5s of silence
+static int read_full(int fd, u8 *p, tSize n){
+	struct pollfd pfd = {fd, POLLIN, 0};
+	ssize_t r;
+	while(n){
+		if(poll(&pfd, 1, 5000) <= 0){
+			return -1;
+		}
+		r = read(fd, p, n);
+		if(r <= 0){
+			return -1;
+		}
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+static int serve(const char *link_path, int only, int fast){
+	struct termios tio;
+	const char *slave;
+	int master, slave_fd;
+	u8 buf[0x10000];
+	u64 base_orig = 0, base_now = 0, t0 = 0, t_orig;
+	tSize o, n, k;
+	uint i, replies = 0;
+	struct rec *r;
+
+	only = first_dev(only);
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(master < 0 || grantpt(master) || unlockpt(master)){
+		perror("posix_openpt");
+		return -1;
+	}
+	slave = ptsname(master);
+	slave_fd = open(slave, O_RDWR | O_NOCTTY);
+	tcgetattr(slave_fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave_fd, TCSANOW, &tio);
+	if(link_path){
+		unlink(link_path);
+		if(symlink(slave, link_path)){
+			perror("symlink");
+			return -1;
+		}
+	}
+	printf("%s\n", link_path ? link_path : slave);
+	fflush(stdout);
+	fprintf(stderr, "replaying dev %d on %s\n", only, slave);
+
+	for(i = 0; i < n_recs; ++i){
+		r = &recs[i];
+		if(r->dev != only || r->type == TR_OPEN){
+			continue;
+		}
+		if(r->type == TR_WRITE){
+			for(o = 0; o < r->n; o += n){
+				n = r->n - o < sizeof(buf) ? r->n - o : sizeof(buf);
+				if(read_full(master, buf, n)){
+					fprintf(stderr, "record %u: the host stopped after %u of %u bytes\n", i, o, r->n);
+					return -1;
+				}
+				for(k = 0; k < n; ++k){
+					if(buf[k] != r->data[o + k]){
+						fprintf(stderr, "record %u: the host diverged at byte %u, 0x%02x instead of 0x%02x\n",
+							i, o + k, buf[k], r->data[o + k]);
+						return -1;
+					}
+				}
+			}
+			if(!t0){
+				t0 = get_ntime();
+			}
+			base_now = get_ntime();
+			base_orig = r->t + r->dur;
+			continue;
+		}
+		// a reply is due as long after the last write as it was then
+		t_orig = r->t + r->dur;
+		if(!fast && t_orig > base_orig){
+			sleep_until(base_now + t_orig - base_orig);
+		}
+		if(r->n && write(master, r->data, r->n) != (ssize_t)r->n){
+			fprintf(stderr, "short write to the pty\n");
+		}
+		++replies;
+	}
+	fprintf(stderr, "%u replies, all host bytes matched, %.3f s\n", replies, (get_ntime() - t0) / 1e9);
+	// let the host take the last reply before the pty goes
+	sleep(1000);
+	close(slave_fd);
+	close(master);
+	if(link_path){
+		unlink(link_path);
+	}
+	return 0;
+}
+
+static int play(const char *devname, int only, int fast){
+	static struct parser ps;
+	tDev d;
+	u8 *buf;
+	u64 prev_orig = 0, prev_now = 0, t, t0;
+	uint i, diff = 0;
+	struct rec *r;
+
+	only = first_dev(only);
+	d = open_serial(devname);
+	if(validate_serial(d)){
+		fprintf(stderr, "failed to open %s\n", devname);
+		return -1;
+	}
+	setup_serial(d);
+	buf = malloc(SERIAL_RING_SIZE);
+	t0 = get_ntime();
+
+	for(i = 0; i < n_recs && !d->err; ++i){
+		r = &recs[i];
+		if(r->dev != only || r->type == TR_OPEN){
+			continue;
+		}
+		// the host took as long between calls as it did then
+		if(!fast && prev_orig && r->t > prev_orig){
+			sleep_until(prev_now + r->t - prev_orig);
+		}
+		t = get_ntime();
+		if(r->type == TR_WRITE){
+			write_serial(d, r->data, r->n);
+			parse_write(&ps, r->data, r->n);
+		}else{
+			// a read that timed out takes what came, a timeout would stop the device
+			read_serial(d, buf, r->n);
+			if(memcmp(buf, r->data, r->n) && ++diff <= 5){
+				fprintf(stderr, "record %u: a different reply, waiting for %s\n", i, awaited(&ps));
+			}
+			parse_read(&ps, r->n, r->dur, get_ntime() - t);
+		}
+		prev_orig = r->t + r->dur;
+		prev_now = get_ntime();
+	}
+	if(d->err){
+		fprintf(stderr, "record %u: the device stopped answering\n", i);
+	}
+	printf("%.3f s, %u replies differ\n", (get_ntime() - t0) / 1e9, diff);
+	print_classes(2);
+	close_serial(d);
+	free(buf);
+	return 0;
+}
+
+static void usage(const char *name){
+	fprintf(stderr, "usage:\n"
+		"\t%s report session.uct\n"
+		"\t%s dump session.uct [dev]\n"
+		"\t%s serve session.uct [-L path] [-D dev] [-f]\n"
+		"\t%s play session.uct <port> [-D dev] [-f]\n",
+		name, name, name, name);
+	exit(-1);
+}
+
+int main(int argc, const char *argv[]){
+	struct map m;
+	const char *link_path = NULL, *port = NULL;
+	int i, only = -1, fast = 0, r;
+
+	if(argc < 3){
+		usage(argv[0]);
+	}
+	for(i = 3; i < argc; ++i){
+		if(!strcmp(argv[i], "-L") && i + 1 < argc){
+			link_path = argv[++i];
+		}else if(!strcmp(argv[i], "-D") && i + 1 < argc){
+			only = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "-f")){
+			fast = 1;
+		}else if(!port){
+			port = argv[i];
+		}else{
+			usage(argv[0]);
+		}
+	}
+	if(load(&m, argv[2])){
+		return -1;
+	}
+
+	if(!strcmp(argv[1], "report")){
+		report();
+		r = 0;
+	}else if(!strcmp(argv[1], "dump")){
+		dump(port ? atoi(port) : -1);
+		r = 0;
+	}else if(!strcmp(argv[1], "serve")){
+		r = serve(link_path, only, fast);
+	}else if(!strcmp(argv[1], "play") && port){
+		r = play(port, only, fast);
+	}else{
+		usage(argv[0]);
+	}
+	unmap_file(&m);
+	free(recs);
+	return r;
+}
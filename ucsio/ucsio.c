@@ -93,7 +93,16 @@ inline static void jmp_bl(void){
 #define VLTOE_OUT PORTD
 #define VLTOE_BIT 1
 
-static uint32_t data, buffer[BULK_SIZE], c_r, c_w, c_x;
+// words per CMD_XFERN, what the SRAM can spare
+#if defined(__AVR_AT90USB1286__)
+#define BULK_MAX 255
+#elif defined(__AVR_AT90USB162__)
+#define BULK_MAX 16
+#else
+#define BULK_MAX 64
+#endif
+
+static uint32_t data, buffer[BULK_MAX], c_r, c_w, c_x;
 static uint8_t wait_p0, wait_p1;
 
 inline static void wait(void){
@@ -143,9 +152,14 @@ inline static void xfer(void) {
 	c_x += 4;
 }
 
-inline static void xfer_bulk(void){
+// interrupts are back on every BULK_SIZE words, USB must not wait too long
+inline static void xfer_bulk(uint8_t n){
 	cli();
-	for(uint8_t k = 0; k < BULK_SIZE; ++k){
+	for(uint8_t k = 0; k < n; ++k){
+		if(k && !(k % BULK_SIZE)){
+			sei();
+			cli();
+		}
 		wait();
 		for(int8_t j = 3; j >= 0; --j){
 			uint8_t d8 = ((uint8_t*)&buffer[k])[j];
@@ -166,7 +180,7 @@ inline static void xfer_bulk(void){
 		}
 	}
 	sei();
-	c_x += (BULK_SIZE << 2);
+	c_x += (uint16_t)n << 2;
 }
 
 inline static void read_data(void){
@@ -177,12 +191,17 @@ inline static void read_data(void){
 	c_r += 4;
 }
 
-inline static void read_data_bulk(void){
-	for(uint8_t i = 0; i < (BULK_SIZE << 2); ++i){
+inline static uint8_t read_byte(void){
+	while(usb_serial_available() < 1);
+	return usb_serial_getchar();
+}
+
+inline static void read_data_bulk(uint8_t n){
+	for(uint16_t i = 0; i < ((uint16_t)n << 2); ++i){
 		while(usb_serial_available() < 1);
 		((uint8_t*)buffer)[i] = usb_serial_getchar();
 	}
-	c_r += (BULK_SIZE << 2);
+	c_r += (uint16_t)n << 2;
 }
 
 inline static void write_data(void){
@@ -191,10 +210,41 @@ inline static void write_data(void){
 	c_w += 4;
 }
 
-inline static void write_data_bulk(void){
-	usb_serial_write((uint8_t*)buffer, (BULK_SIZE << 2));
+inline static void write_data_bulk(uint8_t n){
+	usb_serial_write((uint8_t*)buffer, (uint16_t)n << 2);
 	usb_serial_flush_output();
-	c_w += (BULK_SIZE << 2);
+	c_w += (uint16_t)n << 2;
+}
+
+// what is left between the heap and the stack
+static uint16_t free_ram(void){
+	extern char __heap_start, *__brkval;
+	char top;
+	return &top - (__brkval ? __brkval : &__heap_start);
+}
+
+static void caps(void){
+	for(uint8_t i = 0; i < BULK_SIZE; ++i){
+		buffer[i] = 0;
+	}
+	buffer[CAPS_W_MAGIC] = CAPS_MAGIC;
+	buffer[CAPS_W_VERSION] = UCSIO_VERSION;
+#if defined(__AVR_ATmega32U4__)
+	buffer[CAPS_W_MCU] = CAPS_MCU_ATMEGA32U4;
+#elif defined(__AVR_AT90USB1286__)
+	buffer[CAPS_W_MCU] = CAPS_MCU_AT90USB1286;
+#elif defined(__AVR_AT90USB162__)
+	buffer[CAPS_W_MCU] = CAPS_MCU_AT90USB162;
+#endif
+#ifdef TEENSY
+	buffer[CAPS_W_MCU] |= CAPS_BOARD_TEENSY << 8;
+#else
+	buffer[CAPS_W_MCU] |= CAPS_BOARD_LEONARDO << 8;
+#endif
+	buffer[CAPS_W_EP] = usb_serial_ep_sizes();
+	buffer[CAPS_W_BULK_MAX] = BULK_MAX;
+	buffer[CAPS_W_RAM] = free_ram();
+	buffer[CAPS_W_FEATURES] = CAPS_F_COUNTER | CAPS_F_SET_WAIT | CAPS_F_BOOTLOADER | CAPS_F_XFERN;
 }
 
 int main(void) {
@@ -242,10 +292,18 @@ int main(void) {
 		wdt_reset();
 		uint8_t cmd = usb_serial_getchar();
 		uint8_t bulk = cmd & CMD_FLAG_B;
+		uint8_t n = BULK_SIZE;
+		if((cmd & CMD_MASK) == CMD_XFERN){
+			// a bad count still must not run over the buffer
+			n = read_byte();
+			if(n > BULK_MAX){
+				n = BULK_MAX;
+			}
+		}
 		if(cmd & CMD_FLAG_W){
 			if(bulk){
 				// LED_ON();
-				read_data_bulk();
+				read_data_bulk(n);
 				// _delay_ms(5);
 				// LED_OFF();
 			}else{
@@ -255,11 +313,14 @@ int main(void) {
 		switch(cmd & CMD_MASK){
 			case CMD_XFER:
 				if(bulk){
-					xfer_bulk();
+					xfer_bulk(BULK_SIZE);
 				}else{
 					xfer();
 				}
 				break;
+			case CMD_XFERN:
+				xfer_bulk(n);
+				break;
 			case CMD_PING:
 				data = ~data;
 				LED_ON();
@@ -279,10 +340,13 @@ int main(void) {
 				wait_p0 = (uint8_t)(data & 0xff);
 				wait_p1 = (uint8_t)((data >> 8)& 0xff);
 				break;
+			case CMD_CAPS:
+				caps();
+				break;
 		}
 		if(cmd & CMD_FLAG_R){
 			if(bulk){
-				write_data_bulk();
+				write_data_bulk(n);
 			}else{
 				write_data();
 			}
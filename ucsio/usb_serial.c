@@ -639,6 +639,12 @@ void usb_serial_flush_output(void)
 	SREG = intr_state;
 }
 
+// CDC_TX_SIZE is the IN endpoint, towards the PC
+uint32_t usb_serial_ep_sizes(void)
+{
+	return CDC_TX_SIZE | ((uint32_t)CDC_RX_SIZE << 16);
+}
+
 // functions to read the various async serial settings.  These
 // aren't actually used by USB at all (communication is always
 // at full USB speed), but they are set by the host so we can
@@ -17,6 +17,7 @@ int8_t usb_serial_putchar(uint8_t c);	// transmit a character
 int8_t usb_serial_putchar_nowait(uint8_t c);  // transmit a character, do not wait
 int8_t usb_serial_write(const uint8_t *buffer, uint16_t size); // transmit a buffer
 void usb_serial_flush_output(void);	// immediately transmit any buffered output
+uint32_t usb_serial_ep_sizes(void);	// CDC TX size in the low half, RX in the high
 
 // serial parameters
 uint32_t usb_serial_get_baud(void);	// get the baud rate